@@ -290,6 +290,8 @@ STRING(256,                 directory_path, "", str,, "Path of directory for log
 STRING(256,                 path,           "", str_nonempty,, "Path of single log file, either absolute or relative to directory_path")
 ATOM(unsigned short,        rotate,         12, ushort,, "Number of log files to rotate, zero means no deletion")
 ATOM(uint32_t,              duration,       3600, uint32_time_interval,, "Time duration of each log file, zero means one file per invocation")
+ATOM(bool_t,                async,          0, boolean,, "If true, log messages are written to the file by a separate thread, so that a slow disk does not delay the daemon")
+ATOM(uint32_t,              async_buffer,   262144, uint32_nonzero,, "Bytes of log messages that can wait for the separate thread to write them, before further messages are dropped")
 LOG_FORMAT_OPTIONS
 END_STRUCT
 
@@ -344,9 +346,21 @@ ATOM(bool_t,                route,           1, boolean,, "If false, do not adve
 ATOM(short,                 encapsulation,   ENCAP_OVERLAY, encapsulation,, "Type of packet encapsulation")
 END_STRUCT
 
+STRUCT(keyring)
+ATOM(int32_t,               unlock_threads, 0, int32_nonneg,, "Number of threads used to try a PIN against a large keyring, or 0 for one per CPU")
+END_STRUCT
+
 STRUCT(mdp)
 ATOM(bool_t,                enable_inet, 0, boolean,, "If true, allow mdp clients to connect over loopback UDP")
 STRING(256,                 filter_rules_path, "", str_nonempty,, "Path of file containing MDP filter rules, either absolute or relative to instance directory")
+ATOM(uint32_t,              nm_cache_size, 512, uint32_nonzero,, "Maximum number of Curve25519 shared secrets to cache for MDP encryption")
+ATOM(bool_t,                session_frames, 0, boolean,, "If true, seal unicast MDP frames with a per-peer session key instead of a public key signature or full nonce")
+ATOM(uint32_t,              broadcast_filter_size, 1024, uint32_nonzero,, "Number of recent broadcast packet identifiers to remember, at least the number of broadcast frames received in broadcast_filter_ms")
+ATOM(uint32_t,              broadcast_filter_ms, 60000, uint32_nonzero,, "Time to remember a broadcast packet identifier, so that the same broadcast frame is not processed or forwarded twice")
+END_STRUCT
+
+STRUCT(msp)
+ATOM(uint16_t,              window,      64, uint16_nonzero,, "Maximum number of unacknowledged packets on each MSP stream")
 END_STRUCT
 
 STRUCT(vomp)
@@ -405,12 +419,16 @@ END_STRUCT
 STRUCT(rhizome_http)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome HTTP server is started")
 ATOM(uint16_t,              port,       HTTPD_PORT_DEFAULT, uint16_nonzero,, "Port number for Rhizome HTTP server")
+ATOM(uint32_t,              keepalive_requests, 100, uint32_scaled,, "Maximum number of requests served on one persistent connection, zero to close after every response")
+ATOM(uint32_t,              keepalive_timeout, 5000, uint32_scaled,, "Milliseconds to wait for the next request on a persistent connection")
 END_STRUCT
 
 STRUCT(rhizome_mdp)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome MDP server is started")
 ATOM(uint64_t,              stall_timeout,      1000, uint64_scaled,, "Timeout to request more data.")
 ATOM(uint64_t,              block_size, 512, uint64_scaled,, "Transfer block size.")
+ATOM(uint32_t,              max_open_payloads, 64, uint32_nonzero,, "Maximum number of payloads kept open to serve block requests")
+ATOM(uint32_t,              max_sources, 4, uint32_nonzero,, "Maximum number of peers to fetch different parts of one payload from at once")
 END_STRUCT
 
 STRUCT(rhizome_advertise)
@@ -418,6 +436,14 @@ ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome advertise
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
 END_STRUCT
 
+STRUCT(rhizome_db)
+ATOM(bool_t,                wal,                 1, boolean,, "If true, use SQLite write-ahead logging so that readers do not block writers")
+ATOM(uint32_t,              checkpoint_interval, 5000, uint32_nonzero,, "Milliseconds between write-ahead log checkpoints made by the server")
+ATOM(uint64_t,              cache_size,          2 * 1024 * 1024, uint64_scaled,, "Size of the SQLite page cache in bytes")
+ATOM(uint64_t,              mmap_size,           32 * 1024 * 1024, uint64_scaled,, "Number of bytes of the database to access using memory-mapped I/O, zero to disable")
+ATOM(short,                 synchronous,         RHIZOME_DB_SYNC_NORMAL, sqlite_synchronous,, "SQLite synchronous policy; off, normal, full or extra")
+END_STRUCT
+
 STRUCT(rhizome)
 ATOM(bool_t,                enable,         1, boolean,, "If true, server opens Rhizome database when starting")
 ATOM(bool_t,                fetch,          1, boolean,, "If false, no new bundles will be fetched from peers")
@@ -429,11 +455,13 @@ ATOM(uint64_t,              min_free_space, 100*1024*1024, uint64_scaled,, "Mini
 ATOM(uint32_t,              max_blob_size,  128 * 1024, uint32_scaled,, "Store payloads larger than this in files not SQLite blobs")
 ATOM(uint64_t,              idle_timeout,           RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint32_t,              fetch_delay_ms,         50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
+ATOM(uint32_t,              fetch_queue_limit,      64, uint32_nonzero,, "Maximum number of fetch candidates queued for each payload size range")
 SUB_STRUCT(rhizome_direct,  direct,)
 SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
 SUB_STRUCT(rhizome_mdp,     mdp,)
 SUB_STRUCT(rhizome_advertise, advertise,)
+SUB_STRUCT(rhizome_db,      db,)
 END_STRUCT
 
 STRUCT(directory)
@@ -472,6 +500,7 @@ ATOM(bool_t,                debug,           0, boolean,, "If true, log details
 ATOM(bool_t,                point_to_point,  0, boolean,, "If true, assume there will only be two devices on this interface")
 ATOM(bool_t,                ctsrts,          0, boolean,, "If true, enable CTS/RTS hardware handshaking")
 ATOM(int32_t,               uartbps,         57600, int32_rs232baudrate,, "Speed of serial UART link speed (which may be different to serial device link speed)")
+ATOM(uint16_t,              batch_size,      16, uint16_nonzero,, "Maximum number of datagrams to receive or send with a single system call")
 END_STRUCT
 
 ARRAY(interface_list, NO_DUPLICATES)
@@ -505,6 +534,8 @@ SUB_STRUCT(log,             log,)
 SUB_STRUCT(server,          server,)
 SUB_STRUCT(monitor,         monitor,)
 SUB_STRUCT(mdp,             mdp,)
+SUB_STRUCT(keyring,         keyring,)
+SUB_STRUCT(msp,             msp,)
 SUB_STRUCT(dna,             dna,)
 SUB_STRUCT(vomp,            vomp,)
 SUB_STRUCT(debug,           debug,)
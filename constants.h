@@ -144,6 +144,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 
 #define MSP_PAYLOAD_PREAMBLE_SIZE  5
+#define MSP_SACK_SIZE              4
+#define MSP_WINDOW_SIZE            2
+#define MSP_MAX_PREAMBLE_SIZE      (MSP_PAYLOAD_PREAMBLE_SIZE + MSP_SACK_SIZE + MSP_WINDOW_SIZE)
 #define MSP_MESSAGE_SIZE           1024
 //should be something like this...; (MDP_MTU - MSP_PAYLOAD_PREAMBLE_SIZE)
 
@@ -203,6 +206,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define ENCAP_OVERLAY 1
 #define ENCAP_SINGLE 2
 
+// values of SQLite "PRAGMA synchronous"
+#define RHIZOME_DB_SYNC_OFF 0
+#define RHIZOME_DB_SYNC_NORMAL 1
+#define RHIZOME_DB_SYNC_FULL 2
+#define RHIZOME_DB_SYNC_EXTRA 3
+
 // numbers chosen to not conflict with KEYTYPE flags
 #define UNLOCK_REQUEST (0xF0)
 #define UNLOCK_CHALLENGE (0xF1)
@@ -94,3 +94,46 @@ int crypto_seed_keypair(sign_keypair_t *keypair, const char *fmt, ...)
   crypto_sign_seed_keypair(keypair->public_key.binary, keypair->binary, u.seed.binary);
   return 0;
 }
+
+/* Derive the key used to seal frames sent from sender to recipient, from the
+   Curve25519 shared secret of the pair. Each direction gets a different key, so
+   both parties may count their nonces independently. */
+int crypto_session_key(uint8_t *key, const uint8_t *nm_bytes, const sid_t *sender, const sid_t *recipient)
+{
+  uint8_t sids[sizeof(sid_t) * 2];
+  memcpy(&sids[0], sender->binary, sizeof(sid_t));
+  memcpy(&sids[sizeof(sid_t)], recipient->binary, sizeof(sid_t));
+  if (crypto_generichash(key, SESSION_KEY_BYTES, sids, sizeof sids, nm_bytes, crypto_box_BEFORENMBYTES))
+    return WHY("crypto_generichash() failed");
+  return 0;
+}
+
+static void session_nonce(uint8_t *npub, const uint8_t *nonce)
+{
+  bzero(npub, crypto_aead_chacha20poly1305_ietf_NPUBBYTES);
+  memcpy(&npub[crypto_aead_chacha20poly1305_ietf_NPUBBYTES - SESSION_NONCE_BYTES], nonce, SESSION_NONCE_BYTES);
+}
+
+// encrypt message_len bytes (which may be zero) into cipher_text, followed by SESSION_MAC_BYTES that also authenticate ad
+int crypto_session_seal(uint8_t *cipher_text, const uint8_t *message, size_t message_len,
+  const uint8_t *ad, size_t ad_len, const uint8_t *nonce, const uint8_t *key)
+{
+  uint8_t npub[crypto_aead_chacha20poly1305_ietf_NPUBBYTES];
+  session_nonce(npub, nonce);
+  if (crypto_aead_chacha20poly1305_ietf_encrypt(cipher_text, NULL, message, message_len, ad, ad_len, NULL, npub, key))
+    return WHY("crypto_aead_chacha20poly1305_ietf_encrypt() failed");
+  return 0;
+}
+
+// verify and decrypt cipher_len bytes (including the trailing mac) into message
+int crypto_session_open(uint8_t *message, const uint8_t *cipher_text, size_t cipher_len,
+  const uint8_t *ad, size_t ad_len, const uint8_t *nonce, const uint8_t *key)
+{
+  if (cipher_len < SESSION_MAC_BYTES)
+    return WHY("Message is too short to include a mac");
+  uint8_t npub[crypto_aead_chacha20poly1305_ietf_NPUBBYTES];
+  session_nonce(npub, nonce);
+  if (crypto_aead_chacha20poly1305_ietf_decrypt(message, NULL, NULL, cipher_text, cipher_len, ad, ad_len, npub, key))
+    return WHY("Session mac verification failed");
+  return 0;
+}
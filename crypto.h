@@ -23,10 +23,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <sodium.h>
 #define SIGNATURE_BYTES crypto_sign_BYTES
 
+// symmetric keys derived from a Curve25519 shared secret, used to seal bursts of frames
+#define SESSION_KEY_BYTES crypto_aead_chacha20poly1305_ietf_KEYBYTES
+#define SESSION_NONCE_BYTES 8
+#define SESSION_MAC_BYTES crypto_aead_chacha20poly1305_ietf_ABYTES
+
 int crypto_isvalid_keypair(const sign_private_t *private_key, const sign_public_t *public_key);
 int crypto_verify_message(struct subscriber *subscriber, unsigned char *message, size_t *message_len);
 int crypto_sign_to_sid(const sign_public_t *public_key, sid_t *sid);
 int crypto_ismatching_sign_sid(const sign_public_t *public_key, const sid_t *sid);
 int crypto_seed_keypair(sign_keypair_t *key, const char *fmt, ...);
+int crypto_session_key(uint8_t *key, const uint8_t *nm_bytes, const sid_t *sender, const sid_t *recipient);
+int crypto_session_seal(uint8_t *cipher_text, const uint8_t *message, size_t message_len,
+  const uint8_t *ad, size_t ad_len, const uint8_t *nonce, const uint8_t *key);
+int crypto_session_open(uint8_t *message, const uint8_t *cipher_text, size_t cipher_len,
+  const uint8_t *ad, size_t ad_len, const uint8_t *nonce, const uint8_t *key);
 
 #endif
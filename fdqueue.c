@@ -47,132 +47,191 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <inttypes.h> // for PRIu64
+#include <stddef.h> // for offsetof
 #include "fdqueue.h"
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
 #include "conf.h"
 #include "net.h"
+#include "mem.h"
 #include "str.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 
-#define MAX_WATCHED_FDS 128
-__thread struct pollfd fds[MAX_WATCHED_FDS];
+// File handles being watched, grown as required.
+__thread struct pollfd *fds=NULL;
 __thread int fdcount=0;
-__thread struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
+__thread struct sched_ent **fd_callbacks=NULL;
+static __thread int fds_allocated=0;
 
-__thread struct sched_ent *wake_list=NULL;
-__thread struct sched_ent *run_soon=NULL;
-__thread struct sched_ent *run_now=NULL;
+#ifdef USE_EPOLL
+static __thread int epoll_fd=-1;
+static __thread struct epoll_event *epoll_events=NULL;
+// 1-based index into fds[] of each watched file descriptor, zero if not watched
+static __thread unsigned *fd_index=NULL;
+static __thread int fd_index_allocated=0;
+// watched handles that epoll(7) refuses (eg, regular files), so must be checked with poll(2)
+static __thread uint8_t *fd_unpollable=NULL;
+static __thread int fds_unpollable=0;
+#endif
 
-struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0,0};
+/* Scheduled alarms are kept in three binary min-heaps: run_soon ordered by run_after, wake_list
+ * ordered by wake_at, and run_now ordered by run_before.  An alarm is in either run_soon (and
+ * wake_list if it has a wake_at time) or run_now, so both run heaps share the same index field.
+ */
+struct alarm_heap {
+  struct sched_ent **items;
+  unsigned count;
+  unsigned allocated;
+  size_t key_offset;
+  size_t index_offset;
+};
+
+#define ALARM_HEAP(KEY, INDEX) { \
+    .items=NULL, \
+    .count=0, \
+    .allocated=0, \
+    .key_offset=offsetof(struct sched_ent, KEY), \
+    .index_offset=offsetof(struct sched_ent, INDEX), \
+  }
+
+#define HEAP_KEY(H, A)    (*(time_ms_t *)((char *)(A) + (H)->key_offset))
+#define HEAP_INDEX(H, A)  (*(unsigned *)((char *)(A) + (H)->index_offset))
+
+static __thread struct alarm_heap wake_list = ALARM_HEAP(wake_at, _wake_index);
+static __thread struct alarm_heap run_soon = ALARM_HEAP(run_after, _run_index);
+static __thread struct alarm_heap run_now = ALARM_HEAP(run_before, _run_index);
+static __thread uint64_t sched_sequence=0;
+
+// values of sched_ent._scheduled
+#define SCHEDULED_RUN_SOON 1
+#define SCHEDULED_RUN_NOW  2
+
+struct profile_total poll_stats={.name="Idle (in poll)"};
 
 #define alloca_alarm_name(alarm) ((alarm)->stats ? alloca_str_toprint((alarm)->stats->name) : "Unnamed")
 
-void list_alarms()
+static int heap_before(const struct alarm_heap *heap, struct sched_ent *a, struct sched_ent *b)
 {
-  time_ms_t now = gettime_ms();
-  struct sched_ent *alarm;
-  
-  _DEBUG("Run now;");
-  for (alarm = run_now; alarm; alarm=alarm->_next_run)
-    _DEBUGF("%p %s deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_before - now);
-    
-  _DEBUG("Run soon;");
-  for (alarm = run_soon; alarm; alarm=alarm->_next_run)
-    _DEBUGF("%p %s run in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_after - now);
-  
-  _DEBUG("Wake at;");
-  for (alarm = wake_list; alarm; alarm = alarm->_next_wake)
-    _DEBUGF("%p %s wake in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->wake_at - now);
-  
-  _DEBUG("File handles;");
-  int i;
-  for (i = 0; i < fdcount; ++i)
-    _DEBUGF("%s watching #%d for %x", alloca_alarm_name(fd_callbacks[i]), fds[i].fd, fds[i].events);
+  time_ms_t ka = HEAP_KEY(heap, a);
+  time_ms_t kb = HEAP_KEY(heap, b);
+  return ka < kb || (ka == kb && a->_sequence < b->_sequence);
 }
 
-static void insert_run_now(struct sched_ent *alarm)
+static void heap_set(struct alarm_heap *heap, unsigned i, struct sched_ent *alarm)
 {
-  struct sched_ent **list = &run_now;
-  
-  while(*list){
-    if ((*list)->run_before > alarm->run_before)
+  heap->items[i] = alarm;
+  HEAP_INDEX(heap, alarm) = i + 1;
+}
+
+static void heap_sift_up(struct alarm_heap *heap, unsigned i)
+{
+  struct sched_ent *alarm = heap->items[i];
+  while (i > 0) {
+    unsigned parent = (i - 1) / 2;
+    if (!heap_before(heap, alarm, heap->items[parent]))
       break;
-    list = &(*list)->_next_run;
+    heap_set(heap, i, heap->items[parent]);
+    i = parent;
   }
-  alarm->_next_run = *list;
-  *list = alarm;
+  heap_set(heap, i, alarm);
 }
 
-static void insert_run_soon(struct sched_ent *alarm)
+static void heap_sift_down(struct alarm_heap *heap, unsigned i)
 {
-  struct sched_ent **list = &run_soon;
-  
-  while(*list){
-    if ((*list)->run_after > alarm->run_after)
+  struct sched_ent *alarm = heap->items[i];
+  while (1) {
+    unsigned child = i * 2 + 1;
+    if (child >= heap->count)
+      break;
+    if (child + 1 < heap->count && heap_before(heap, heap->items[child + 1], heap->items[child]))
+      child++;
+    if (!heap_before(heap, heap->items[child], alarm))
       break;
-    list = &(*list)->_next_run;
+    heap_set(heap, i, heap->items[child]);
+    i = child;
   }
-  alarm->_next_run = *list;
-  *list = alarm;
+  heap_set(heap, i, alarm);
 }
 
-static void remove_run_list(struct sched_ent *alarm, struct sched_ent **list)
+static struct sched_ent *heap_top(const struct alarm_heap *heap)
 {
-  while(*list){
-    if (*list==alarm){
-      *list = alarm->_next_run;
-      list = &alarm->_next_run;
-      alarm->_next_run=NULL;
-      return;
-    }else{
-      list = &(*list)->_next_run;
-    }
+  return heap->count ? heap->items[0] : NULL;
+}
+
+static void heap_insert(struct alarm_heap *heap, struct sched_ent *alarm)
+{
+  if (heap->count >= heap->allocated) {
+    unsigned allocated = heap->allocated ? heap->allocated * 2 : 32;
+    struct sched_ent **items = erealloc(heap->items, allocated * sizeof *items);
+    if (!items)
+      FATAL("Cannot grow alarm heap");
+    heap->items = items;
+    heap->allocated = allocated;
   }
+  heap->items[heap->count] = alarm;
+  heap_sift_up(heap, heap->count++);
 }
 
-static void insert_wake_list(struct sched_ent *alarm)
+// safe to call if the alarm is not in this heap
+static void heap_remove(struct alarm_heap *heap, struct sched_ent *alarm)
 {
-  if (alarm->wake_at == TIME_MS_NEVER_WILL)
+  unsigned i = HEAP_INDEX(heap, alarm);
+  if (i == 0 || i > heap->count || heap->items[i - 1] != alarm)
     return;
-  struct sched_ent **list = &wake_list, *last = NULL;
-  while(*list){
-    if ((*list)->wake_at > alarm->wake_at)
-      break;
-    last = (*list);
-    list = &last->_next_wake;
-  }
-  alarm->_next_wake = *list;
-  if (*list)
-    (*list)->_prev_wake = alarm;
-  alarm->_prev_wake = last;
-  *list = alarm;
+  --i;
+  HEAP_INDEX(heap, alarm) = 0;
+  if (i == --heap->count)
+    return;
+  // move the last alarm into the hole, then restore the heap property in whichever direction
+  struct sched_ent *last = heap->items[heap->count];
+  heap->items[i] = last;
+  if (i > 0 && heap_before(heap, last, heap->items[(i - 1) / 2]))
+    heap_sift_up(heap, i);
+  else
+    heap_sift_down(heap, i);
 }
 
-static void remove_wake_list(struct sched_ent *alarm)
+void list_alarms()
 {
-  struct sched_ent *prev = alarm->_prev_wake;
-  struct sched_ent *next = alarm->_next_wake;
+  time_ms_t now = gettime_ms();
+  unsigned n;
   
-  if (prev)
-    prev->_next_wake = next;
-  else if(wake_list==alarm)
-    wake_list = next;
+  _DEBUG("Run now;");
+  for (n = 0; n < run_now.count; ++n) {
+    struct sched_ent *alarm = run_now.items[n];
+    _DEBUGF("%p %s deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_before - now);
+  }
     
-  if (next)
-    next->_prev_wake = prev;
+  _DEBUG("Run soon;");
+  for (n = 0; n < run_soon.count; ++n) {
+    struct sched_ent *alarm = run_soon.items[n];
+    _DEBUGF("%p %s run in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_after - now);
+  }
+  
+  _DEBUG("Wake at;");
+  for (n = 0; n < wake_list.count; ++n) {
+    struct sched_ent *alarm = wake_list.items[n];
+    _DEBUGF("%p %s wake in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->wake_at - now);
+  }
   
-  alarm->_prev_wake = NULL;
-  alarm->_next_wake = NULL;
+  _DEBUG("File handles;");
+  int i;
+  for (i = 0; i < fdcount; ++i)
+    _DEBUGF("%s watching #%d for %x", alloca_alarm_name(fd_callbacks[i]), fds[i].fd, fds[i].events);
 }
 
 // move alarms from run_soon to run_now
 static void move_run_list(){
   time_ms_t now = gettime_ms();
-  while(run_soon && run_soon->run_after <= now){
-    struct sched_ent *alarm = run_soon;
-    run_soon = run_soon->_next_run;
-    remove_wake_list(alarm);
-    insert_run_now(alarm);
+  struct sched_ent *alarm;
+  while((alarm = heap_top(&run_soon)) && alarm->run_after <= now){
+    heap_remove(&run_soon, alarm);
+    heap_remove(&wake_list, alarm);
+    alarm->_sequence = ++sched_sequence;
+    heap_insert(&run_now, alarm);
+    alarm->_scheduled = SCHEDULED_RUN_NOW;
     DEBUGF(io, "Moved %s from run_soon to run_now", alloca_alarm_name(alarm));
   }
 }
@@ -211,9 +270,11 @@ void _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   // don't bother to schedule an alarm that will (by definition) never run
   // not an error as it simplifies calling API use
   if (alarm->run_after != TIME_MS_NEVER_WILL){
-    insert_wake_list(alarm);
-    insert_run_soon(alarm);
-    alarm->_scheduled=1;
+    alarm->_sequence = ++sched_sequence;
+    if (alarm->wake_at != TIME_MS_NEVER_WILL)
+      heap_insert(&wake_list, alarm);
+    heap_insert(&run_soon, alarm);
+    alarm->_scheduled=SCHEDULED_RUN_SOON;
   }
 }
 
@@ -226,13 +287,72 @@ void _unschedule(struct __sourceloc __whence, struct sched_ent *alarm)
     
   DEBUGF(io, "unschedule(alarm=%s)", alloca_alarm_name(alarm));
 
-  remove_run_list(alarm, &run_now);
-  remove_run_list(alarm, &run_soon);
-  remove_wake_list(alarm);
+  heap_remove(alarm->_scheduled == SCHEDULED_RUN_NOW ? &run_now : &run_soon, alarm);
+  heap_remove(&wake_list, alarm);
   alarm->_scheduled=0;
   alarm->run_after = TIME_MS_NEVER_WILL;
 }
 
+static int grow_watch_list()
+{
+  int allocated = fds_allocated ? fds_allocated * 2 : 32;
+  struct pollfd *new_fds = erealloc(fds, allocated * sizeof *fds);
+  if (!new_fds)
+    return -1;
+  fds = new_fds;
+  struct sched_ent **new_callbacks = erealloc(fd_callbacks, allocated * sizeof *fd_callbacks);
+  if (!new_callbacks)
+    return -1;
+  fd_callbacks = new_callbacks;
+#ifdef USE_EPOLL
+  struct epoll_event *new_events = erealloc(epoll_events, allocated * sizeof *epoll_events);
+  if (!new_events)
+    return -1;
+  epoll_events = new_events;
+  uint8_t *new_unpollable = erealloc(fd_unpollable, allocated * sizeof *fd_unpollable);
+  if (!new_unpollable)
+    return -1;
+  fd_unpollable = new_unpollable;
+#endif
+  fds_allocated = allocated;
+  return 0;
+}
+
+#ifdef USE_EPOLL
+static int epoll_register(struct sched_ent *alarm, int op)
+{
+  if (epoll_fd == -1 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    return WHY_perror("epoll_create1");
+  // epoll(7) event flags have the same values as their poll(2) equivalents
+  struct epoll_event ev = {.events = alarm->poll.events, .data.fd = alarm->poll.fd};
+  if (epoll_ctl(epoll_fd, op, alarm->poll.fd, &ev) == 0)
+    return 0;
+  // the kernel only drops a registration when every duplicate of the descriptor is closed
+  if (op == EPOLL_CTL_ADD && errno == EEXIST && epoll_ctl(epoll_fd, EPOLL_CTL_MOD, alarm->poll.fd, &ev) == 0)
+    return 0;
+  if (op == EPOLL_CTL_ADD && errno == EPERM)
+    return 1;
+  return WHYF_perror("epoll_ctl(%d, %s, %d)", epoll_fd, op == EPOLL_CTL_ADD ? "EPOLL_CTL_ADD" : "EPOLL_CTL_MOD", alarm->poll.fd);
+}
+
+static int set_fd_index(int fd, unsigned index)
+{
+  if (fd >= fd_index_allocated) {
+    int allocated = fd_index_allocated ? fd_index_allocated : 64;
+    while (allocated <= fd)
+      allocated *= 2;
+    unsigned *new_index = erealloc(fd_index, allocated * sizeof *fd_index);
+    if (!new_index)
+      return -1;
+    memset(&new_index[fd_index_allocated], 0, (allocated - fd_index_allocated) * sizeof *fd_index);
+    fd_index = new_index;
+    fd_index_allocated = allocated;
+  }
+  fd_index[fd] = index;
+  return 0;
+}
+#endif
+
 // start watching a file handle, call this function again if you wish to change the event mask
 int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
 {
@@ -245,14 +365,36 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (!alarm->poll.events)
     FATAL("Can't watch if you haven't set any poll flags");
   
-  if (alarm->_poll_index>=0 && fd_callbacks[alarm->_poll_index]==alarm){
+  if (alarm->_poll_index>=0 && alarm->_poll_index<fdcount && fd_callbacks[alarm->_poll_index]==alarm){
     // updating event flags
     DEBUGF(io, "Updating watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
+#ifdef USE_EPOLL
+    if (!fd_unpollable[alarm->_poll_index]
+      && fds[alarm->_poll_index].events != alarm->poll.events
+      && epoll_register(alarm, EPOLL_CTL_MOD) == -1)
+      return -1;
+#endif
   }else{
     DEBUGF(io, "Adding watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
-    if (fdcount>=MAX_WATCHED_FDS)
+    if (fdcount>=fds_allocated && grow_watch_list()==-1)
       return WHY("Too many file handles to watch");
     set_nonblock(alarm->poll.fd);
+#ifdef USE_EPOLL
+    if (alarm->poll.fd < 0)
+      return WHYF("Cannot watch invalid file descriptor %d", alarm->poll.fd);
+    if (set_fd_index(alarm->poll.fd, fdcount + 1) == -1)
+      return WHY("Too many file handles to watch");
+    int unpollable = epoll_register(alarm, EPOLL_CTL_ADD);
+    if (unpollable == -1) {
+      fd_index[alarm->poll.fd] = 0;
+      return -1;
+    }
+    if (unpollable) {
+      DEBUGF(io, "epoll cannot watch #%d, using poll", alarm->poll.fd);
+      fds_unpollable++;
+    }
+    fd_unpollable[fdcount] = unpollable;
+#endif
     fd_callbacks[fdcount]=alarm;
     alarm->poll.revents = 0;
     alarm->_poll_index=fdcount;
@@ -264,7 +406,7 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
 
 int is_watching(struct sched_ent *alarm)
 {
-  if (alarm->_poll_index <0 || fds[alarm->_poll_index].fd!=alarm->poll.fd)
+  if (alarm->_poll_index <0 || alarm->_poll_index >= fdcount || fds[alarm->_poll_index].fd!=alarm->poll.fd)
     return 0;
   return 1;
 }
@@ -275,15 +417,28 @@ int _unwatch(struct __sourceloc __whence, struct sched_ent *alarm)
   DEBUGF(io, "unwatch(alarm=%s)", alloca_alarm_name(alarm));
 
   int index = alarm->_poll_index;
-  if (index <0 || fds[index].fd!=alarm->poll.fd)
+  if (index <0 || index >= fdcount || fds[index].fd!=alarm->poll.fd)
     return WHY("Attempted to unwatch a handle that is not being watched");
   
+#ifdef USE_EPOLL
+  if (fd_unpollable[index])
+    fds_unpollable--;
+  // closing a descriptor removes it from the epoll set, so it may already be gone
+  else if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, alarm->poll.fd, NULL) == -1 && errno != EBADF && errno != ENOENT)
+    WHYF_perror("epoll_ctl(%d, EPOLL_CTL_DEL, %d)", epoll_fd, alarm->poll.fd);
+  if (alarm->poll.fd < fd_index_allocated)
+    fd_index[alarm->poll.fd] = 0;
+#endif
   fdcount--;
   if (index!=fdcount){
     // squash fds
     fds[index] = fds[fdcount];
     fd_callbacks[index] = fd_callbacks[fdcount];
     fd_callbacks[index]->_poll_index=index;
+#ifdef USE_EPOLL
+    fd_unpollable[index] = fd_unpollable[fdcount];
+    fd_index[fds[index].fd] = index + 1;
+#endif
   }
   fds[fdcount].fd=-1;
   fd_callbacks[fdcount]=NULL;
@@ -323,38 +478,46 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   OUT();
 }
 
+// remove the most urgent alarm from the run_now list and call it
+static void run_next_alarm()
+{
+  struct sched_ent *alarm = heap_top(&run_now);
+  heap_remove(&run_now, alarm);
+  alarm->_scheduled=0;
+  alarm->run_after = TIME_MS_NEVER_WILL;
+  call_alarm(alarm, 0);
+}
 
 int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeup)())
 {
   IN();
   
   // clear the run now list of any alarms that are overdue
-  if (run_now && run_now->run_before <= gettime_ms()){
-    struct sched_ent *alarm = run_now;
-    run_now = alarm->_next_run;
-    alarm->_scheduled=0;
-    alarm->run_after = TIME_MS_NEVER_WILL;
-    call_alarm(alarm, 0);
+  if (run_now.count && heap_top(&run_now)->run_before <= gettime_ms()){
+    run_next_alarm();
     RETURN(1);
   }
   
   // return 0 when there's nothing to do, it doesn't make sense to wait for infinity
-  if (!run_now && !wake_list && fdcount==0)
+  if (!run_now.count && !wake_list.count && fdcount==0)
     RETURN(0);
   
   time_ms_t now = gettime_ms();
   time_ms_t wait_until=TIME_MS_NEVER_WILL;
   uint8_t called_waiting = 0;
+#ifdef USE_EPOLL
+  uint8_t used_epoll = 0;
+#endif
   
-  if (run_now){
+  if (run_now.count){
     wait_until = now;
   }else{
     time_ms_t next_run=TIME_MS_NEVER_WILL;
-    if(run_soon)
-      next_run = run_soon->run_after;
+    if(run_soon.count)
+      next_run = heap_top(&run_soon)->run_after;
     
-    if (wake_list)
-      wait_until = wake_list->wake_at;
+    if (wake_list.count)
+      wait_until = heap_top(&wake_list)->wake_at;
       
     if (waiting && wait_until > now){
       wait_until = waiting(now, next_run, wait_until);
@@ -378,6 +541,32 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
     else
       wait = wait_until - now;
     
+#ifdef USE_EPOLL
+    if (fdcount && !fds_unpollable){
+      DEBUGF(io, "Calling epoll_wait with %dms wait", wait);
+      
+      fd_func_enter(__HERE__, &call_stats);
+      r = epoll_wait(epoll_fd, epoll_events, fdcount, wait);
+      fd_func_exit(__HERE__, &call_stats);
+      used_epoll = 1;
+      
+      if (r==-1 && errno!=EINTR)
+	WHY_perror("epoll_wait");
+      
+      if (IF_DEBUG(io)) {
+	strbuf b = strbuf_alloca(1024);
+	int i;
+	for (i = 0; i < r; ++i) {
+	  if (i)
+	    strbuf_puts(b, ", ");
+	  strbuf_sprintf(b, "%d->", epoll_events[i].data.fd);
+	  strbuf_append_poll_events(b, epoll_events[i].events);
+	}
+	DEBUGF(io, "epoll_wait(fdcount=%d, ms=%d) -> %d (%s)", fdcount, wait, r, strbuf_str(b));
+      }
+      
+    }else
+#endif
     if (fdcount){
       DEBUGF(io, "Calling poll with %dms wait", wait);
 	
@@ -417,10 +606,27 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
   
   // We don't want a single alarm to be able to reschedule itself and starve all IO
   // So we only check for new overdue alarms if we attempted to sleep
-  if (wait && run_now && run_now->run_before <= gettime_ms())
+  if (wait && run_now.count && heap_top(&run_now)->run_before <= gettime_ms())
     RETURN(1);
   
   // process all watched IO handles once (we need to be fair)
+#ifdef USE_EPOLL
+  if (r>0 && used_epoll) {
+    int i;
+    for(i=r -1;i>=0;i--){
+      // look up the handle again, in case an earlier callback stopped watching it
+      int fd = epoll_events[i].data.fd;
+      unsigned index = fd < fd_index_allocated ? fd_index[fd] : 0;
+      if (index && fds[index - 1].fd == fd) {
+	fds[index - 1].revents = epoll_events[i].events;
+	call_alarm(fd_callbacks[index - 1], fds[index - 1].revents);
+      }
+    }
+    // time may have passed while processing IO, or processing IO could trigger a new overdue alarm
+    move_run_list();
+    
+  }else
+#endif
   if (r>0) {
     int i;
     for(i=fdcount -1;i>=0;i--){
@@ -436,13 +642,9 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
     // time may have passed while processing IO, or processing IO could trigger a new overdue alarm
     move_run_list();
     
-  }else if (run_now){
+  }else if (run_now.count){
     // No IO, no overdue alarms but another alarm is runnable? run a single alarm before polling again
-    struct sched_ent *alarm = run_now;
-    run_now = alarm->_next_run;
-    alarm->_scheduled=0;
-    alarm->run_after = TIME_MS_NEVER_WILL;
-    call_alarm(alarm, 0);
+    run_next_alarm();
   }
   
   RETURN(1);
@@ -59,20 +59,37 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "os.h"
 #include "log.h"
 #include "debug.h"
+#include "trigger.h"
+
+// Latencies below 2^LATENCY_SUB_BITS ns each have their own bucket, longer ones share
+// 2^LATENCY_SUB_BITS buckets per power of two, up to 2^LATENCY_MAX_BITS ns (about 18 minutes)
+#define LATENCY_SUB_BITS 2
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+struct latency_histogram {
+  uint64_t count;
+  time_ns_t total;
+  time_ns_t max;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
 
 struct profile_total {
   struct profile_total *_next;
   int _initialised;
   const char *name;
-  time_ms_t max_time;
-  time_ms_t total_time;
-  time_ms_t child_time;
+  // time spent in the current stats period, excluding child calls
+  time_ns_t max_time;
+  time_ns_t total_time;
+  time_ns_t child_time;
   int calls;
+  // every call since the process started, never cleared
+  struct latency_histogram latency;
 };
 
 struct call_stats{
-  time_ms_t enter_time;
-  time_ms_t child_time;
+  time_ns_t enter_time;
+  time_ns_t child_time;
   struct profile_total *totals;
   struct call_stats *prev;
 };
@@ -82,9 +99,11 @@ struct sched_ent;
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
 struct sched_ent{
-  struct sched_ent *_next_wake;
-  struct sched_ent *_prev_wake;
-  struct sched_ent *_next_run;
+  // 1-based positions within the scheduler's heaps, zero if not present
+  unsigned _run_index;
+  unsigned _wake_index;
+  // insertion order, so alarms with equal times run first-come first-served
+  uint64_t _sequence;
   uint8_t _scheduled;
   
   ALARM_FUNCP function;
@@ -158,13 +177,16 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
 /* function timing routines */
 int fd_clearstats();
 int fd_showstats();
+time_ns_t latency_percentile(const struct latency_histogram *h, unsigned per_mille);
+time_ns_t fd_stats_uptime();
+void fd_stats_json(struct strbuf *b);
 int fd_checkalarms();
 int fd_func_enter(struct __sourceloc, struct call_stats *this_call);
 int fd_func_exit(struct __sourceloc, struct call_stats *this_call);
 void dump_stack(int log_level);
 unsigned fd_depth();
 
-#define IN() static struct profile_total _aggregate_stats={NULL,0,__FUNCTION__,0,0,0,0}; \
+#define IN() static struct profile_total _aggregate_stats={.name=__FUNCTION__}; \
     struct call_stats _this_call={.totals=&_aggregate_stats}; \
     fd_func_enter(__HERE__, &_this_call);
 
@@ -172,7 +194,11 @@ unsigned fd_depth();
 #define RETURN(X) do { OUT(); return (X); } while (0)
 #define RETURNVOID do { OUT(); return; } while (0)
 
+extern __thread struct profile_total *stats_head;
+extern struct profile_total poll_stats;
 DECLARE_ALARM(fd_periodicstats);
+// called when the periodic time usage stats are shown, so other modules can log their own counters
+DECLARE_TRIGGER(show_stats);
 void list_alarms();
 
 #endif // __SERVAL_DNA__FDQUEUE_H
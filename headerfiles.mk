@@ -16,6 +16,7 @@ HDRS=	fifo.h \
 	meshmb.h \
 	message_ply.h \
 	nibble_tree.h \
+	prefix_index.h \
 	serval_types.h \
 	serval.h \
 	server.h \
@@ -17,9 +17,18 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <assert.h>
 #include <inttypes.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "serval_types.h"
 #include "http_server.h"
 #include "sighandlers.h"
@@ -100,6 +109,8 @@ static int http_request_start_body(struct http_request *r);
 static int http_request_reject_content(struct http_request *r);
 static int http_request_parse_body_form_data(struct http_request *r);
 static void http_request_start_response(struct http_request *r);
+static void http_request_parse(struct http_request *r);
+static void http_request_reset(struct http_request *r);
 
 void http_request_init(struct http_request *r, int sockfd)
 {
@@ -113,6 +124,8 @@ void http_request_init(struct http_request *r, int sockfd)
   assert(r->idle_timeout >= 0);
   if (r->idle_timeout == 0)
     r->idle_timeout = 10000; // 10 seconds
+  if (r->keepalive_timeout == 0)
+    r->keepalive_timeout = r->idle_timeout;
   r->alarm.poll.fd = sockfd;
   r->alarm.poll.events = POLLIN;
   r->phase = RECEIVE;
@@ -149,7 +162,12 @@ int http_request_set_response_bufsize(struct http_request *r, size_t bufsiz)
 {
   // Don't allocate a new buffer if the existing one contains content.
   assert(r->response_buffer_sent == r->response_buffer_length);
-  const char *const bufe = r->buffer + sizeof r->buffer;
+  // A heap buffer left over from an earlier response on the same connection is re-used as long as
+  // it is big enough.
+  if (r->response_free_buffer && bufsiz <= r->response_buffer_size)
+    return 0;
+  // Any pipelined request bytes at the end of the in-struct buffer must not be overwritten.
+  const char *const bufe = r->pipelined ? r->pipelined : r->buffer + sizeof r->buffer;
   assert(r->reserved < bufe);
   size_t rbufsiz = bufe - r->reserved;
   if (bufsiz <= rbufsiz) {
@@ -1008,6 +1026,8 @@ static int http_request_parse_header(struct http_request *r)
       if (unparsed > r->request_header.content_length) {
 	WARNF("HTTP parsing: already read %zu bytes past end of content", (size_t)(unparsed - r->request_header.content_length));
 	r->request_content_remaining = 0;
+	// The excess bytes will be parsed as content, so the connection cannot be re-used.
+	r->request_header.connection_close = 1;
       }
       else
 	r->request_content_remaining = r->request_header.content_length - unparsed;
@@ -1111,6 +1131,29 @@ static int http_request_parse_header(struct http_request *r)
     goto malformed;
   }
   _rewind(r);
+  if (_skip_literal_nocase(r, "Connection:")) {
+    // A comma-separated list of connection options, of which only "close" and "keep-alive" are
+    // significant.
+    _skip_optional_space(r);
+    while (r->cursor < eol) {
+      struct substring opt;
+      if (!_skip_token(r, &opt))
+	goto malformed;
+      size_t len = opt.end - opt.start;
+      if (len == 5 && strncasecmp(opt.start, "close", len) == 0)
+	r->request_header.connection_close = 1;
+      else if (len == 10 && strncasecmp(opt.start, "keep-alive", len) == 0)
+	r->request_header.connection_keepalive = 1;
+      _skip_optional_space(r);
+      if (r->cursor < eol && !_skip_literal(r, ","))
+	goto malformed;
+      _skip_optional_space(r);
+    }
+    r->cursor = nextline;
+    _commit(r);
+    return 0;
+  }
+  _rewind(r);
   if (_skip_literal_nocase(r, "Origin:")) {
     if (r->request_header.origin.null || r->request_header.origin.scheme[0]) {
       IDEBUGF(r->debug, "Skipping duplicate HTTP header Origin: %s", alloca_toprint(50, sol, r->end - sol));
@@ -1646,7 +1689,16 @@ static void http_request_receive(struct http_request *r)
   // We got some data, so reset the inactivity timer and invoke the parsing state machine to process
   // it.  The state machine invokes the caller-supplied callback functions.
   http_request_set_idle_timeout(r);
-  // Parse the unparsed and received data.
+  http_request_parse(r);
+  OUT();
+}
+
+/* Parse the unparsed and received data, invoking the caller-supplied callback functions, and start
+ * the response once the request has been parsed far enough for one to be set.
+ */
+static void http_request_parse(struct http_request *r)
+{
+  IN();
   while (r->phase == RECEIVE) {
     int result;
     _rewind(r);
@@ -1663,6 +1715,8 @@ static void http_request_receive(struct http_request *r)
       const char *oldparsed = r->parsed;
       if (r->parser == NULL) {
 	IDEBUGF(r->debug, "No HTTP parser function set -- skipping %zu bytes", (size_t)(r->end - r->cursor));
+	// The skipped bytes could be a pipelined request, so the connection cannot be re-used.
+	r->request_header.connection_close = 1;
 	_skip_all(r);
 	_commit(r);
 	result = 0;
@@ -1710,6 +1764,59 @@ static void http_request_receive(struct http_request *r)
   OUT();
 }
 
+/* Send some of the content that the generator asked to be sent directly from a file.  Returns the
+ * number of bytes written, zero if the socket is not ready, or -1 on error.
+ */
+static ssize_t http_request_send_file(struct http_request *r)
+{
+  size_t len = r->response_file_length;
+#ifdef HAVE_SYS_SENDFILE_H
+  off_t offset = (off_t) r->response_file_offset;
+  ssize_t written = sendfile(r->alarm.poll.fd, r->response_file_fd, &offset, len);
+  if (written == -1) {
+    switch (errno) {
+      case EINTR:
+      case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+	return 0;
+    }
+    return WHYF_perror("sendfile(%d,%d,%"PRIu64",%zu)", r->alarm.poll.fd, r->response_file_fd, r->response_file_offset, len);
+  }
+  if (written == 0)
+    return WHYF("Unexpected end of file on fd %d at offset %"PRIu64, r->response_file_fd, r->response_file_offset);
+#else
+  char buf[8 * 1024];
+  if (len > sizeof buf)
+    len = sizeof buf;
+  ssize_t rd = pread(r->response_file_fd, buf, len, (off_t) r->response_file_offset);
+  if (rd == -1)
+    return WHYF_perror("pread(%d,%p,%zu,%"PRIu64")", r->response_file_fd, buf, len, r->response_file_offset);
+  if (rd == 0)
+    return WHYF("Unexpected end of file on fd %d at offset %"PRIu64, r->response_file_fd, r->response_file_offset);
+  ssize_t written = write_nonblock(r->alarm.poll.fd, buf, (size_t) rd);
+  if (written == -1)
+    return -1;
+#endif
+  r->response_file_offset += (size_t) written;
+  r->response_file_length -= (size_t) written;
+  return written;
+}
+
+// Each chunk of content is preceded by a fixed-width hex size line and followed by CRLF.  Content
+// sent from a file is a chunk of its own, so a buffer fill may need two size lines.
+#define HTTP_CHUNK_HEADER_LEN 10 // "%08x\r\n"
+#define HTTP_CHUNK_OVERHEAD (2 * HTTP_CHUNK_HEADER_LEN + 2)
+
+static void _put_chunk_header(char *dst, size_t len)
+{
+  assert(len <= UINT32_MAX);
+  char header[HTTP_CHUNK_HEADER_LEN + 1];
+  snprintf(header, sizeof header, "%08x\r\n", (uint32_t)len);
+  memcpy(dst, header, HTTP_CHUNK_HEADER_LEN);
+}
+
 /* Write the current contents of the response buffer to the HTTP socket.  When no more bytes can be
  * written, return so that socket polling can continue.  Once all bytes are sent, if there is a
  * content generator function and the request is not paused, invoke it to put more content in the
@@ -1737,6 +1844,39 @@ static void http_request_send_response(struct http_request *r)
     }
     if (unsent == 0)
       r->response_buffer_sent = r->response_buffer_length = 0;
+    if (unsent == 0 && r->response_file_length) {
+      // All buffered content has been sent, so send the content that follows it directly from the
+      // file.
+      sigPipeFlag = 0;
+      ssize_t written = http_request_send_file(r);
+      if (written == -1) {
+	IDEBUG(r->debug, "HTTP socket sendfile error, closing connection");
+	http_request_finalise(r);
+	RETURNVOID;
+      }
+      if (sigPipeFlag) {
+	IDEBUG(r->debug, "Received SIGPIPE on HTTP socket sendfile, closing connection");
+	http_request_finalise(r);
+	RETURNVOID;
+      }
+      if (written == 0)
+	RETURNVOID;
+      r->response_sent += (size_t) written;
+      assert(r->response_sent <= r->response_length);
+      IDEBUGF(r->debug, "Sent %zu bytes from file to HTTP socket, total %"PRIhttp_size_t", remaining=%"PRIhttp_size_t,
+	    (size_t) written, r->response_sent, r->response_length - r->response_sent);
+      if (r->phase != PAUSE)
+	http_request_set_idle_timeout(r);
+      // If the socket did not take everything, then go back to polling.
+      if (r->response_file_length)
+	RETURNVOID;
+      // The buffer is empty, so end the chunk that carried the file content.
+      if (r->response_chunked == CHUNKED_BODY) {
+	memcpy(r->response_buffer, "\r\n", 2);
+	r->response_buffer_length = 2;
+      }
+      continue;
+    }
     if (r->phase == PAUSE) {
       // If the generator has paused the request, keep polling i/o for output until the response
       // buffer is all sent, then stop polling i/o.
@@ -1744,11 +1884,12 @@ static void http_request_send_response(struct http_request *r)
 	unwatch(&r->alarm);
 	RETURNVOID; // nothing left to send
       }
-    } else if (r->response.content_generator) {
+    } else if (r->response.content_generator && r->response_file_length == 0) {
+      const size_t overhead = r->response_chunked == CHUNKED_BODY ? HTTP_CHUNK_OVERHEAD : 0;
       // If the buffer is smaller than the content generator needs, and it contains no unsent
       // content, then allocate a larger buffer.
-      if (r->response_buffer_need > r->response_buffer_size && unsent == 0) {
-	if (http_request_set_response_bufsize(r, r->response_buffer_need) == -1) {
+      if (r->response_buffer_need + overhead > r->response_buffer_size && unsent == 0) {
+	if (http_request_set_response_bufsize(r, r->response_buffer_need + overhead) == -1) {
 	  WHYF("HTTP response truncated at offset=%"PRIhttp_size_t" due to insufficient buffer space",
 	      r->response_sent);
 	  http_request_finalise(r);
@@ -1766,7 +1907,10 @@ static void http_request_send_response(struct http_request *r)
       // more content.
       assert(r->response_buffer_length <= r->response_buffer_size);
       size_t unfilled = r->response_buffer_size - r->response_buffer_length;
-      if (unfilled > 0 && unfilled >= r->response_buffer_need) {
+      if (unfilled > overhead && unfilled - overhead >= r->response_buffer_need) {
+	// When sending chunks, leave room in front of the generated content for its size line.
+	size_t space = unfilled - overhead;
+	char *dst = r->response_buffer + r->response_buffer_length + (overhead ? HTTP_CHUNK_HEADER_LEN : 0);
 	// The content generator must fill or partly fill the part of the buffer we indicate and
 	// return the number of bytes appended.  If it returns zero, it means it has no more
 	// content (EOF), and must not be called again.  If the return value exceeds the buffer size
@@ -1775,30 +1919,56 @@ static void http_request_send_response(struct http_request *r)
 	// -1, it means an unrecoverable error occurred, and the generator must not be called again.
 	struct http_content_generator_result result;
 	bzero(&result, sizeof result);
-	int ret = r->response.content_generator(r, (unsigned char *) r->response_buffer + r->response_buffer_length, unfilled, &result);
+	int ret = r->response.content_generator(r, (unsigned char *) dst, space, &result);
 	if (ret == -1) {
 	  WHY("Content generation error, closing connection");
 	  http_request_finalise(r);
 	  RETURNVOID;
 	}
-	assert(result.generated <= unfilled);
-	r->response_buffer_length += result.generated;
+	assert(result.generated <= space);
+	if (overhead) {
+	  if (result.generated) {
+	    _put_chunk_header(r->response_buffer + r->response_buffer_length, result.generated);
+	    r->response_buffer_length += HTTP_CHUNK_HEADER_LEN + result.generated;
+	    memcpy(r->response_buffer + r->response_buffer_length, "\r\n", 2);
+	    r->response_buffer_length += 2;
+	  }
+	  if (result.file_length) {
+	    _put_chunk_header(r->response_buffer + r->response_buffer_length, result.file_length);
+	    r->response_buffer_length += HTTP_CHUNK_HEADER_LEN;
+	  }
+	} else
+	  r->response_buffer_length += result.generated;
 	r->response_buffer_need = result.need;
-	if (result.generated == 0 && result.need <= unfilled && r->phase != PAUSE) {
+	if (result.file_length) {
+	  r->response_file_fd = result.file_fd;
+	  r->response_file_offset = result.file_offset;
+	  r->response_file_length = result.file_length;
+	}
+	if (result.generated == 0 && result.file_length == 0 && result.need <= space && r->phase != PAUSE) {
 	  WHYF("HTTP response generator produced no content at offset %"PRIhttp_size_t" (ret=%d)", r->response_sent, ret);
 	  http_request_finalise(r);
 	  RETURNVOID;
 	}
-	IDEBUGF(r->debug, "Generated HTTP %zu bytes of content, need %zu bytes of buffer (ret=%d)", result.generated, result.need, ret);
+	IDEBUGF(r->debug, "Generated HTTP %zu bytes of content, %zu bytes from file, need %zu bytes of buffer (ret=%d)",
+	    result.generated, result.file_length, result.need, ret);
 	if (r->phase != PAUSE && ret == 0)
 	  r->response.content_generator = NULL; // ensure we never invoke again
 	continue;
       }
+    } else if (r->response_file_length) {
+      // Send the buffered content that precedes the file content.
     } else if (remaining != CONTENT_LENGTH_UNKNOWN && unsent < remaining) {
       WHYF("HTTP response generator finished prematurely at offset %"PRIhttp_size_t"/%"PRIhttp_size_t" (%"PRIhttp_size_t" bytes remaining)",
 	  r->response_sent, r->response_length, remaining);
       http_request_finalise(r);
       RETURNVOID;
+    } else if (unsent == 0 && r->response_chunked == CHUNKED_BODY) {
+      // All the content has been sent, so send the last (empty) chunk.
+      memcpy(r->response_buffer, "0\r\n\r\n", 5);
+      r->response_buffer_length = 5;
+      r->response_chunked = CHUNKED_DONE;
+      continue;
     } else if (unsent == 0)
       break;
     assert(unsent > 0);
@@ -1836,6 +2006,11 @@ static void http_request_send_response(struct http_request *r)
     if ((size_t) written < (size_t) unsent)
       RETURNVOID;
   }
+  if (r->keepalive) {
+    IDEBUG(r->debug, "Done, keeping connection open");
+    http_request_reset(r);
+    RETURNVOID;
+  }
   IDEBUG(r->debug, "Done, closing connection");
   http_request_finalise(r);
   OUT();
@@ -2114,7 +2289,9 @@ static int _render_response(struct http_request *r)
   }
   assert(hr.header.content_type != NULL);
   assert(hr.header.content_type[0]);
-  strbuf_sprintf(sb, "HTTP/1.0 %03u %s\r\n", hr.status_code, hr.reason);
+  // Answer HTTP/1.1 requests with HTTP/1.1 responses, all others with HTTP/1.0.
+  strbuf_sprintf(sb, "HTTP/1.%u %03u %s\r\n",
+      r->version_major == 1 && r->version_minor >= 1 ? 1 : 0, hr.status_code, hr.reason);
   strbuf_sprintf(sb, "Content-Type: %s", hr.header.content_type);
   if (hr.header.boundary) {
     strbuf_puts(sb, "; boundary=");
@@ -2169,6 +2346,17 @@ static int _render_response(struct http_request *r)
     strbuf_append_quoted_string(sb, hr.header.www_authenticate.realm);
     strbuf_puts(sb, "\r\n");
   }
+  // Without a Content-Length, an HTTP/1.0 client can only detect the end of the content when the
+  // connection closes, but an HTTP/1.1 client can be sent the content in chunks.
+  r->response_chunked = CHUNKED_NONE;
+  if (hr.header.content_length == CONTENT_LENGTH_UNKNOWN && r->keepalive) {
+    if (r->version_minor >= 1) {
+      r->response_chunked = CHUNKED_BODY;
+      strbuf_puts(sb, "Transfer-Encoding: chunked\r\n");
+    } else
+      r->keepalive = 0;
+  }
+  strbuf_puts(sb, r->keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
   if (r->render_extra_headers)
     r->render_extra_headers(r, sb);
   assert(strcmp(strbuf_substr(sb, -2), "\r\n") == 0);
@@ -2231,11 +2419,107 @@ static size_t http_request_drain(struct http_request *r)
   return drained;
 }
 
+/* Return true if the connection can be kept open to receive another request after the response to
+ * the current request has been sent.  This is only possible if the caller supports persistent
+ * connections, the client did not ask to close the connection (HTTP/1.0 clients must explicitly
+ * ask to keep it), and the whole request has been consumed, so that the next request (if any)
+ * starts at r->parsed.
+ */
+static int http_request_can_persist(struct http_request *r)
+{
+  if (r->reset == NULL || r->request_count >= r->keepalive_max)
+    return 0;
+  if (r->version_major != 1 || r->request_header.connection_close)
+    return 0;
+  if (r->version_minor == 0 && !r->request_header.connection_keepalive)
+    return 0;
+  if (r->parser == http_request_start_parsing_headers || r->parser == http_request_parse_header)
+    return 0;
+  if (   r->request_header.content_length == CONTENT_LENGTH_UNKNOWN
+      || r->request_header.content_length == 0)
+    return 1;
+  return r->request_content_remaining == 0 && r->parsed == r->end;
+}
+
+/* Move any bytes of pipelined requests that have already been received to the end of the in-struct
+ * buffer, so that they are not overwritten while the response is being sent from the rest of it.
+ */
+static void http_request_stash_pipelined(struct http_request *r)
+{
+  assert(r->parsed <= r->end);
+  size_t len = r->end - r->parsed;
+  if (len) {
+    r->pipelined = r->buffer + sizeof r->buffer - len;
+    memmove(r->pipelined, r->parsed, len);
+    IDEBUGF(r->debug, "Keeping %zu bytes of pipelined request", len);
+  } else
+    r->pipelined = NULL;
+}
+
+/* Prepare to receive the next request on a persistent connection, once the current response has
+ * been completely sent.  The in-struct buffer is re-initialised with any pipelined request bytes,
+ * and any heap response buffer is kept for the next response.
+ */
+static void http_request_reset(struct http_request *r)
+{
+  IN();
+  assert(r->phase == TRANSMIT);
+  assert(r->reset != NULL);
+  r->reset(r);
+  r->verb = NULL;
+  r->path = NULL;
+  bzero(r->query_parameters, sizeof r->query_parameters);
+  r->version_major = r->version_minor = 0;
+  bzero(&r->request_header, sizeof r->request_header);
+  r->request_header.content_length = CONTENT_LENGTH_UNKNOWN;
+  r->request_content_remaining = CONTENT_LENGTH_UNKNOWN;
+  r->parser = http_request_parse_verb;
+  r->handle_content_end = NULL;
+  r->form_data_state = START;
+  bzero(&r->form_data, sizeof r->form_data);
+  bzero(&r->part_header, sizeof r->part_header);
+  r->part_body_length = 0;
+  bzero(&r->response, sizeof r->response);
+  r->response.header.content_length = CONTENT_LENGTH_UNKNOWN;
+  r->response.header.resource_length = CONTENT_LENGTH_UNKNOWN;
+  r->render_extra_headers = NULL;
+  r->response_length = r->response_sent = 0;
+  r->response_buffer_need = r->response_buffer_length = r->response_buffer_sent = 0;
+  if (!r->response_free_buffer) {
+    r->response_buffer = NULL;
+    r->response_buffer_size = 0;
+  }
+  r->response_file_offset = 0;
+  r->response_file_length = 0;
+  r->response_chunked = CHUNKED_NONE;
+  r->keepalive = 0;
+  assert(r->reserved == r->buffer);
+  r->received = r->parsed = r->cursor = r->buffer + sizeof(void*) * (1 + NELS(r->query_parameters));
+  size_t len = 0;
+  if (r->pipelined) {
+    len = r->buffer + sizeof r->buffer - r->pipelined;
+    memmove(r->received, r->pipelined, len);
+    r->pipelined = NULL;
+  }
+  r->end = r->received + len;
+  r->phase = RECEIVE;
+  r->alarm.poll.events = POLLIN;
+  watch(&r->alarm);
+  r->alarm.alarm = gettime_ms() + r->keepalive_timeout;
+  r->alarm.deadline = r->alarm.alarm + 500;
+  unschedule(&r->alarm);
+  schedule(&r->alarm);
+  if (len)
+    http_request_parse(r);
+  OUT();
+}
+
 static void http_request_start_response(struct http_request *r)
 {
   IN();
   assert(r->phase == RECEIVE);
   _release_reserved(r);
+  ++r->request_count;
   if (r->response.content || r->response.content_generator) {
     assert(r->response.header.content_type != NULL);
     assert(r->response.header.content_type[0]);
@@ -2247,12 +2531,19 @@ static void http_request_start_response(struct http_request *r)
     http_request_finalise(r);
     RETURNVOID;
   }
-  // Drain the rest of the request that has not been received yet (eg, if sending an error response
-  // provoked while parsing the early part of a partially-received request).  If a read error
-  // occurs, the connection is closed so the phase changes to DONE.
-  http_request_drain(r);
-  if (r->phase != RECEIVE)
-    RETURNVOID;
+  // If the connection will be re-used, then keep any pipelined requests that have already been
+  // received.  Otherwise, drain the rest of the request that has not been received yet (eg, if
+  // sending an error response provoked while parsing the early part of a partially-received
+  // request).  If a read error occurs, the connection is closed so the phase changes to DONE.
+  const int persist = r->keepalive = http_request_can_persist(r);
+  if (persist)
+    http_request_stash_pipelined(r);
+  else {
+    r->pipelined = NULL;
+    http_request_drain(r);
+    if (r->phase != RECEIVE)
+      RETURNVOID;
+  }
   // Ensure conformance to HTTP standards.
   if (r->response.status_code == 401 && r->response.header.www_authenticate.scheme == NOAUTH) {
     WHY("HTTP 401 response missing WWW-Authenticate header, sending 500 Server Error instead");
@@ -2275,8 +2566,17 @@ static void http_request_start_response(struct http_request *r)
       RETURNVOID;
     }
   }
+  // If rendering the response ruled out re-using the connection, then any pipelined requests will
+  // never be answered, so drain them after all.
+  if (persist && !r->keepalive) {
+    r->pipelined = NULL;
+    http_request_drain(r);
+    if (r->phase != RECEIVE)
+      RETURNVOID;
+  }
   r->response_buffer_need = 0;
   r->response_sent = 0;
+  r->response_file_length = 0;
   IDEBUGF(r->debug, "Sending HTTP response: %s", alloca_toprint(160, (const char *)r->response_buffer, r->response_buffer_length));
   _http_request_start_transmitting(r);
   OUT();
@@ -102,6 +102,8 @@ struct http_request_headers {
   struct http_origin origin;
   struct http_range content_ranges[5];
   struct http_client_authorization authorization;
+  bool_t connection_close; // "Connection: close" received
+  bool_t connection_keepalive; // "Connection: keep-alive" received
 };
 
 struct http_response_headers {
@@ -119,6 +121,12 @@ struct http_response_headers {
 struct http_content_generator_result {
   size_t generated;
   size_t need;
+  // Instead of, or following, the generated content, the generator may ask for file_length bytes
+  // to be sent directly from the file file_fd starting at file_offset, without copying them through
+  // the response buffer.  The file must remain open until the generator is called again.
+  int file_fd;
+  uint64_t file_offset;
+  size_t file_length;
 };
 
 typedef int (HTTP_CONTENT_GENERATOR)(struct http_request *, unsigned char *, size_t, struct http_content_generator_result *);
@@ -201,6 +209,14 @@ struct http_request {
   // The following are used for parsing the HTTP request.
   time_ms_t initiate_time; // time connection was initiated
   time_ms_t idle_timeout; // disconnect if no bytes received for this long
+  // Persistent connections (HTTP/1.1 keep-alive) are only supported if the caller supplies a
+  // 'reset' function, which must release all per-request state so that the struct can receive
+  // the next request on the same connection.
+  void (*reset)(struct http_request *);
+  time_ms_t keepalive_timeout; // disconnect if next request does not start within this long
+  unsigned keepalive_max; // maximum number of requests to serve on one connection
+  unsigned request_count; // number of requests received on this connection so far
+  bool_t keepalive; // keep connection open after the current response has been sent
   struct socket_address client_addr; // caller may supply this
   // The parsed HTTP request is accumulated into the following fields.
   const char *verb; // points to nul terminated static string, "GET", "PUT", etc.
@@ -227,6 +243,7 @@ struct http_request {
   char *end; // end of received data in buffer[]
   char *parsed; // start of unparsed data in buffer[]
   char *cursor; // for parsing
+  char *pipelined; // start of next request's bytes, kept at end of buffer[] during TRANSMIT
   http_size_t request_content_remaining;
   // The following are used for parsing a multipart body.
   enum mime_state { START, PREAMBLE, HEADER, BODY, EPILOGUE } form_data_state;
@@ -247,6 +264,13 @@ struct http_request {
   size_t response_buffer_length;
   size_t response_buffer_sent;
   void (*response_free_buffer)(void*);
+  // Generated content of unknown length is sent to HTTP/1.1 clients using chunked transfer
+  // encoding, so that the connection can persist after it.
+  enum http_chunked { CHUNKED_NONE = 0, CHUNKED_BODY, CHUNKED_DONE } response_chunked;
+  // Content to be sent directly from a file, after the response buffer is all sent.
+  int response_file_fd;
+  uint64_t response_file_offset;
+  size_t response_file_length;
   // This buffer is used during RECEIVE and TRANSMIT phase.
   char buffer[8 * 1024];
 };
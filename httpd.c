@@ -17,6 +17,7 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <stddef.h>
 #include <sys/ioctl.h>
 #include "httpd.h"
 #include "mem.h"
@@ -25,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "str.h"
 
 #define RHIZOME_SERVER_MAX_LIVE_REQUESTS 32
+#define HTTPD_LISTEN_BACKLOG 20
 
 static int httpd_dispatch(struct http_request *hr)
 {
@@ -156,7 +158,7 @@ int httpd_server_start(const uint16_t port_low, const uint16_t port_high)
 	port, which could also fail with EADDRINUSE, in which case we have to scrap the socket and
 	create a new one, because once bound, a socket stays bound.
       */
-      if (listen(httpd_server_socket, 20) != -1)
+      if (listen(httpd_server_socket, HTTPD_LISTEN_BACKLOG) != -1)
 	goto success;
       if (errno != EADDRINUSE) {
 	WHY_perror("listen");
@@ -199,6 +201,19 @@ static unsigned int http_request_uuid_counter = 0;
 static httpd_request * current_httpd_requests = NULL;
 unsigned int current_httpd_request_count = 0;
 
+static void httpd_server_release_request_state(httpd_request *r)
+{
+  rhizome_bundle_result_free(&r->bundle_result);
+  if (r->manifest) {
+    rhizome_manifest_free(r->manifest);
+    r->manifest = NULL;
+  }
+  if (r->finalise_union) {
+    r->finalise_union(r);
+    r->finalise_union = NULL;
+  }
+}
+
 static void httpd_server_finalise_http_request(struct http_request *hr)
 {
   httpd_request *r = (httpd_request *) hr;
@@ -223,56 +238,73 @@ static void httpd_server_finalise_http_request(struct http_request *hr)
   if (current_httpd_requests == NULL) {
     assert(current_httpd_request_count == 0);
   }
-  rhizome_bundle_result_free(&r->bundle_result);
-  if (r->manifest) {
-    rhizome_manifest_free(r->manifest);
-    r->manifest = NULL;
-  }
-  if (r->finalise_union) {
-    r->finalise_union(r);
-    r->finalise_union = NULL;
-  }
+  httpd_server_release_request_state(r);
+}
+
+/* Called between requests on a persistent connection.  Leaves the request in the list of current
+ * requests, but returns all its per-request fields to the state they had when it was accepted.
+ */
+// The request is reset by zeroing every field from 'manifest' onwards, so only the fields that
+// must survive from one request to the next on the same connection may come before it.
+_Static_assert(offsetof(httpd_request, manifest) == offsetof(httpd_request, prev) + sizeof(struct httpd_request *),
+  "httpd_request fields between 'prev' and 'manifest' would not be reset between requests");
+
+static void httpd_server_reset_http_request(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  httpd_server_release_request_state(r);
+  bzero(&r->manifest, sizeof *r - offsetof(httpd_request, manifest));
+  r->payload_status = INVALID_RHIZOME_PAYLOAD_STATUS; // will cause FATAL unless set
+  r->bundle_result = INVALID_RHIZOME_BUNDLE_RESULT; // will cause FATAL unless set
 }
 
 void httpd_server_poll(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & (POLLIN | POLLOUT)) {
-    struct socket_address addr;
-    bzero(&addr, sizeof addr);
-    addr.addrlen = sizeof addr.raw;
-    int sock;
-    if ((sock = accept(httpd_server_socket, &addr.addr, &addr.addrlen)) == -1) {
-      if (errno && errno != EAGAIN)
-	WARN_perror("accept");
-    } else {
-      set_nonblock(sock);
-      ++http_request_uuid_counter;
-      strbuf_sprintf(&log_context, "httpd/%u", http_request_uuid_counter);
-      INFOF("HTTP SERVER, ACCEPT %s", alloca_socket_address(&addr));
-      httpd_request *request = emalloc_zero(sizeof(httpd_request));
-      if (request == NULL) {
-	WHY("Cannot respond to HTTP request, out of memory");
-	close(sock);
+    // Accept all the connections waiting in the listen backlog, not just one per poll.
+    unsigned accepted;
+    for (accepted = 0; accepted < HTTPD_LISTEN_BACKLOG; ++accepted) {
+      struct socket_address addr;
+      bzero(&addr, sizeof addr);
+      addr.addrlen = sizeof addr.raw;
+      int sock;
+      if ((sock = accept(httpd_server_socket, &addr.addr, &addr.addrlen)) == -1) {
+	if (errno && errno != EAGAIN && errno != EWOULDBLOCK)
+	  WARN_perror("accept");
+	break;
       } else {
-	request->next = current_httpd_requests;
-	request->prev = NULL;
-	if (current_httpd_requests) {
-	  assert(current_httpd_request_count > 0);
-	  current_httpd_requests->prev = request;
+	set_nonblock(sock);
+	++http_request_uuid_counter;
+	strbuf_sprintf(&log_context, "httpd/%u", http_request_uuid_counter);
+	INFOF("HTTP SERVER, ACCEPT %s", alloca_socket_address(&addr));
+	httpd_request *request = emalloc_zero(sizeof(httpd_request));
+	if (request == NULL) {
+	  WHY("Cannot respond to HTTP request, out of memory");
+	  close(sock);
+	} else {
+	  request->next = current_httpd_requests;
+	  request->prev = NULL;
+	  if (current_httpd_requests) {
+	    assert(current_httpd_request_count > 0);
+	    current_httpd_requests->prev = request;
+	  }
+	  current_httpd_requests = request;
+	  ++current_httpd_request_count;
+	  request->payload_status = INVALID_RHIZOME_PAYLOAD_STATUS; // will cause FATAL unless set
+	  request->bundle_result = INVALID_RHIZOME_BUNDLE_RESULT; // will cause FATAL unless set
+	  request->http.client_addr = addr;
+	  request->http.uuid = http_request_uuid_counter;
+	  request->http.handle_headers = httpd_dispatch;
+	  request->http.debug = INDIRECT_CONFIG_DEBUG(httpd);
+	  request->http.disable_tx = INDIRECT_CONFIG_DEBUG(nohttptx);
+	  request->http.finalise = httpd_server_finalise_http_request;
+	  request->http.release = free;
+	  request->http.reset = httpd_server_reset_http_request;
+	  request->http.idle_timeout = RHIZOME_IDLE_TIMEOUT;
+	  request->http.keepalive_timeout = config.rhizome.http.keepalive_timeout;
+	  request->http.keepalive_max = config.rhizome.http.keepalive_requests;
+	  http_request_init(&request->http, sock);
 	}
-	current_httpd_requests = request;
-	++current_httpd_request_count;
-	request->payload_status = INVALID_RHIZOME_PAYLOAD_STATUS; // will cause FATAL unless set
-	request->bundle_result = INVALID_RHIZOME_BUNDLE_RESULT; // will cause FATAL unless set
-	request->http.client_addr = addr;
-	request->http.uuid = http_request_uuid_counter;
-	request->http.handle_headers = httpd_dispatch;
-	request->http.debug = INDIRECT_CONFIG_DEBUG(httpd);
-	request->http.disable_tx = INDIRECT_CONFIG_DEBUG(nohttptx);
-	request->http.finalise = httpd_server_finalise_http_request;
-	request->http.release = free;
-	request->http.idle_timeout = RHIZOME_IDLE_TIMEOUT;
-	http_request_init(&request->http, sock);
       }
     }
   }
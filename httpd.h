@@ -57,6 +57,11 @@ typedef struct httpd_request
   struct httpd_request *next;
   struct httpd_request *prev;
 
+  /* All the following fields hold the state of the current request, and are zeroed by
+   * httpd_server_reset_http_request() before each request on a kept-alive connection.  New fields
+   * must be added below this point.
+   */
+
   /* For requests/responses that pertain to a single manifest.
    */
   rhizome_manifest *manifest;
@@ -160,6 +165,10 @@ typedef struct httpd_request
       size_t rowcount;
       time_ms_t end_time;
       struct rhizome_list_cursor cursor;
+      // Once a newsince list has read the database to the end, further rows are taken from the
+      // ring of recently added bundles, starting at this sequence number.
+      bool_t from_ring;
+      uint64_t ring_seq;
     }
       rhlist;
 
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <stdio.h>
 #include <assert.h>
+#include <signal.h>
 #include "serval.h"
 #include "conf.h"
 #include "constants.h"
@@ -33,6 +34,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "rotbuf.h"
 #include "route_link.h"
 #include "commandline.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 static keyring_file *keyring_open_or_create(const char *path, int writeable);
 static int keyring_initialise(keyring_file *k);
@@ -214,9 +218,180 @@ keypair *keyring_identity_keytype(const keyring_identity *id, unsigned keytype)
   return kp;
 }
 
+/* The in-memory indexes are sorted arrays searched with a binary search.  Each index has its own
+ * comparison function between an entry and a search key.
+ */
+typedef int (*keyring_index_cmp)(const struct keyring_index_entry *entry, const void *key);
+
+struct keyring_tag_key {
+  const char *name;
+  const unsigned char *value; // NULL to match any value
+  size_t length;
+};
+
+static int index_cmp_sid(const struct keyring_index_entry *entry, const void *key)
+{
+  return cmp_sid_t(entry->identity->box_pk, (const sid_t *)key);
+}
+
+static int index_cmp_sign(const struct keyring_index_entry *entry, const void *key)
+{
+  return cmp_identity_t(&entry->identity->sign_keypair->public_key, (const identity_t *)key);
+}
+
+static int index_cmp_did(const struct keyring_index_entry *entry, const void *key)
+{
+  return strcasecmp((const char *)entry->keypair->private_key, (const char *)key);
+}
+
+static int index_cmp_tag(const struct keyring_index_entry *entry, const void *key)
+{
+  const struct keyring_tag_key *tag = (const struct keyring_tag_key *)key;
+  const char *name;
+  const unsigned char *value;
+  size_t length;
+  // only keypairs that unpack are ever inserted
+  keyring_unpack_tag(entry->keypair->public_key, entry->keypair->public_key_len, &name, &value, &length);
+  int c = strcmp(name, tag->name);
+  if (c || !tag->value)
+    return c;
+  if (length != tag->length)
+    return length < tag->length ? -1 : 1;
+  return memcmp(value, tag->value, length);
+}
+
+// Return the position of the first entry that is not less than the key.
+static size_t keyring_index_search(const struct keyring_index *index, keyring_index_cmp cmp, const void *key)
+{
+  size_t lo = 0, hi = index->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (cmp(&index->entries[mid], key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static const struct keyring_index_entry *keyring_index_find(const struct keyring_index *index, keyring_index_cmp cmp, const void *key)
+{
+  size_t i = keyring_index_search(index, cmp, key);
+  if (i < index->count && cmp(&index->entries[i], key) == 0)
+    return &index->entries[i];
+  return NULL;
+}
+
+static int keyring_index_insert(struct keyring_index *index, keyring_index_cmp cmp, const void *key, keyring_identity *id, keypair *kp)
+{
+  size_t i = keyring_index_search(index, cmp, key);
+  while (i < index->count && cmp(&index->entries[i], key) == 0 && index->entries[i].identity->slot < id->slot)
+    i++;
+  if (index->count >= index->allocated) {
+    size_t allocated = index->allocated ? index->allocated * 2 : KEYRING_ALLOC_CHUNK;
+    struct keyring_index_entry *entries = erealloc(index->entries, allocated * sizeof(struct keyring_index_entry));
+    if (!entries)
+      return -1;
+    index->entries = entries;
+    index->allocated = allocated;
+  }
+  memmove(&index->entries[i + 1], &index->entries[i], (index->count - i) * sizeof(struct keyring_index_entry));
+  index->entries[i].identity = id;
+  index->entries[i].keypair = kp;
+  index->count++;
+  return 0;
+}
+
+static void keyring_index_remove(struct keyring_index *index, keyring_index_cmp cmp, const void *key, const keyring_identity *id)
+{
+  size_t i = keyring_index_search(index, cmp, key);
+  for (; i < index->count && cmp(&index->entries[i], key) == 0; i++) {
+    if (index->entries[i].identity == id) {
+      index->count--;
+      memmove(&index->entries[i], &index->entries[i + 1], (index->count - i) * sizeof(struct keyring_index_entry));
+      return;
+    }
+  }
+}
+
+static void keyring_index_free(struct keyring_index *index)
+{
+  if (index->entries)
+    free(index->entries);
+  bzero(index, sizeof *index);
+}
+
+static int tag_key(const keypair *kp, struct keyring_tag_key *key)
+{
+  return keyring_unpack_tag(kp->public_key, kp->public_key_len, &key->name, &key->value, &key->length);
+}
+
+/* Remove every index entry that refers to the given identity.  Must be called before the identity
+ * or any of its DID or tag keypairs are modified or freed.
+ */
+static void keyring_unindex_identity(keyring_file *k, const keyring_identity *id)
+{
+  if (id->box_pk)
+    keyring_index_remove(&k->index_sid, index_cmp_sid, id->box_pk, id);
+  if (id->sign_keypair)
+    keyring_index_remove(&k->index_sign, index_cmp_sign, &id->sign_keypair->public_key, id);
+  keypair *kp;
+  for (kp = id->keypairs; kp; kp = kp->next) {
+    struct keyring_tag_key key;
+    if (kp->type == KEYTYPE_DID)
+      keyring_index_remove(&k->index_did, index_cmp_did, kp->private_key, id);
+    else if (kp->type == KEYTYPE_PUBLIC_TAG && tag_key(kp, &key) == 0)
+      keyring_index_remove(&k->index_tag, index_cmp_tag, &key, id);
+  }
+}
+
+static int keyring_index_identity(keyring_file *k, keyring_identity *id)
+{
+  if (id->box_pk && keyring_index_insert(&k->index_sid, index_cmp_sid, id->box_pk, id, NULL) == -1)
+    goto fail;
+  if (id->sign_keypair
+    && keyring_index_insert(&k->index_sign, index_cmp_sign, &id->sign_keypair->public_key, id, NULL) == -1)
+    goto fail;
+  keypair *kp;
+  for (kp = id->keypairs; kp; kp = kp->next) {
+    struct keyring_tag_key key;
+    if (kp->type == KEYTYPE_DID) {
+      if (keyring_index_insert(&k->index_did, index_cmp_did, kp->private_key, id, kp) == -1)
+	goto fail;
+    } else if (kp->type == KEYTYPE_PUBLIC_TAG && tag_key(kp, &key) == 0) {
+      if (keyring_index_insert(&k->index_tag, index_cmp_tag, &key, id, kp) == -1)
+	goto fail;
+    }
+  }
+  return 0;
+fail:
+  keyring_unindex_identity(k, id);
+  return -1;
+}
+
+/* Continue an index search from the iterator's position, positioning the iterator on the next
+ * matching entry.
+ */
+static keypair *keyring_index_next(keyring_iterator *it, const struct keyring_index *index, keyring_index_cmp cmp, const void *key)
+{
+  size_t i = it->index_position ? it->index_position - 1 : keyring_index_search(index, cmp, key);
+  if (i < index->count && cmp(&index->entries[i], key) == 0) {
+    it->identity = index->entries[i].identity;
+    it->keypair = index->entries[i].keypair;
+    it->index_position = i + 2;
+    return it->keypair;
+  }
+  it->identity = NULL;
+  it->keypair = NULL;
+  it->index_position = index->count + 1;
+  return NULL;
+}
+
 keypair *keyring_find_did(keyring_iterator *it, const char *did)
 {
   keypair *kp;
+  if (did[0] && !(did[0]=='*' && did[1]==0) && (it->index_position || !it->identity))
+    return keyring_index_next(it, &it->file->index_did, index_cmp_did, did);
   while((kp=keyring_next_keytype(it, KEYTYPE_DID))){
     if ((!did[0])
 	||(did[0]=='*'&&did[1]==0)
@@ -229,17 +404,13 @@ keypair *keyring_find_did(keyring_iterator *it, const char *did)
 }
 
 keyring_identity *keyring_find_identity_sid(keyring_file *k, const sid_t *sidp){
-  keyring_identity *id = k->identities;
-  while(id && (!id->box_pk || cmp_sid_t(id->box_pk,sidp)!=0))
-    id = id->next;
-  return id;
+  const struct keyring_index_entry *entry = keyring_index_find(&k->index_sid, index_cmp_sid, sidp);
+  return entry ? entry->identity : NULL;
 }
 
 keyring_identity *keyring_find_identity(keyring_file *k, const identity_t *sign){
-  keyring_identity *id = k->identities;
-  while(id && (!id->box_pk || cmp_identity_t(&id->sign_keypair->public_key, sign)!=0))
-    id = id->next;
-  return id;
+  const struct keyring_index_entry *entry = keyring_index_find(&k->index_sign, index_cmp_sign, sign);
+  return entry ? entry->identity : NULL;
 }
 
 static void add_subscriber(keyring_identity *id)
@@ -312,6 +483,10 @@ void keyring_free(keyring_file *k)
     k->identities=i->next;
     keyring_free_identity(i);
   }
+  keyring_index_free(&k->index_sid);
+  keyring_index_free(&k->index_sign);
+  keyring_index_free(&k->index_did);
+  keyring_index_free(&k->index_tag);
   
   /* Wipe everything, just to be sure. */
   bzero(k,sizeof(keyring_file));
@@ -327,6 +502,7 @@ int keyring_release_identities_by_pin(keyring_file *f, const char *pin)
     keyring_identity *id = (*i);
     if (id->PKRPin && strcmp(id->PKRPin, pin) == 0){
       (*i) = id->next;
+      keyring_unindex_identity(f, id);
       keyring_free_identity(id);
     }else{
       i=&id->next;
@@ -342,6 +518,7 @@ int keyring_release_subscriber(keyring_file *k, const sid_t *sid)
     keyring_identity *id = (*i);
     if (cmp_sid_t(id->box_pk,sid)==0){
       (*i) = id->next;
+      keyring_unindex_identity(k, id);
       keyring_free_identity(id);
       return 0;
     }
@@ -390,7 +567,10 @@ static int keyring_munge_block(
 
   unsigned char work[65536];
 
-  if (len<96) return WHY("block too short");
+  if (len<96) {
+    DEBUG(keyring, "block too short");
+    return -1;
+  }
 
   unsigned char *PKRSalt=&block[0];
   int PKRSaltLen=32;
@@ -408,7 +588,7 @@ static int keyring_munge_block(
     assert(ofs <= sizeof work); \
     unsigned __len = (len); \
     if (__len > sizeof work - ofs) { \
-      WHY("Input too long"); \
+      DEBUG(keyring, "Input too long"); \
       goto kmb_safeexit; \
     } \
     bcopy((buf), &work[ofs], __len); \
@@ -670,7 +850,7 @@ static int unpack_private_only(keypair *kp, struct rotbuf *rb, size_t key_length
 {
   if (!kp->private_key){
     kp->private_key_len = key_length;
-    if ((kp->private_key = emalloc(kp->private_key_len))==NULL)
+    if ((kp->private_key = malloc(kp->private_key_len))==NULL)
       return -1;
   }else{
     if (kp->private_key_len != key_length)
@@ -684,7 +864,7 @@ static int unpack_public_only(keypair *kp, struct rotbuf *rb, size_t key_length)
 {
   if (!kp->public_key){
     kp->public_key_len = key_length;
-    if ((kp->public_key = emalloc(kp->public_key_len))==NULL)
+    if ((kp->public_key = malloc(kp->public_key_len))==NULL)
       return -1;
   }else{
     if(kp->public_key_len != key_length)
@@ -865,10 +1045,12 @@ static void keyring_free_keypair(keypair *kp)
   free(kp);
 }
 
-static keypair *keyring_alloc_keypair(unsigned ktype, size_t len)
+/* Does not log, so that the threads that unlock slots can use it.
+ */
+static keypair *keyring_new_keypair(unsigned ktype, size_t len)
 {
   assert(ktype != 0);
-  keypair *kp = emalloc_zero(sizeof(keypair));
+  keypair *kp = calloc(1, sizeof(keypair));
   if (!kp)
     return NULL;
   kp->type = ktype;
@@ -879,8 +1061,8 @@ static keypair *keyring_alloc_keypair(unsigned ktype, size_t len)
     kp->private_key_len = len;
     kp->public_key_len = 0;
   }
-  if (   (kp->private_key_len && (kp->private_key = emalloc(kp->private_key_len)) == NULL)
-      || (kp->public_key_len && (kp->public_key = emalloc(kp->public_key_len)) == NULL)
+  if (   (kp->private_key_len && (kp->private_key = malloc(kp->private_key_len)) == NULL)
+      || (kp->public_key_len && (kp->public_key = malloc(kp->public_key_len)) == NULL)
   ) {
     keyring_free_keypair(kp);
     return NULL;
@@ -888,6 +1070,14 @@ static keypair *keyring_alloc_keypair(unsigned ktype, size_t len)
   return kp;
 }
 
+static keypair *keyring_alloc_keypair(unsigned ktype, size_t len)
+{
+  keypair *kp = keyring_new_keypair(ktype, len);
+  if (!kp)
+    WHYF("Could not allocate key pair, type 0x%02x", ktype);
+  return kp;
+}
+
 static int keyring_pack_identity(const keyring_identity *id, unsigned char packed[KEYRING_PAGE_SIZE])
 {
   /* Convert an identity to a KEYRING_PAGE_SIZE bytes long block that consists of 32 bytes of random
@@ -1054,14 +1244,22 @@ static int keyring_identity_add_keypair(keyring_identity *id, keypair *kp)
   return 1;
 }
 
-static keyring_identity *keyring_unpack_identity(unsigned char *slot, const char *pin)
+/* Does not log anything except debug output, so that the threads that unlock slots can use it.  If
+ * memory runs out, sets *error and returns NULL.
+ */
+static keyring_identity *keyring_unpack_identity(unsigned char *slot, const char *pin, const char **error)
 {
   /* Skip salt and MAC */
-  keyring_identity *id = emalloc_zero(sizeof(keyring_identity));
-  if (!id)
+  keyring_identity *id = calloc(1, sizeof(keyring_identity));
+  if (!id) {
+    *error = "Could not allocate identity";
     return NULL;
-  if (pin && *pin)
-    id->PKRPin = str_edup(pin);
+  }
+  if (pin && *pin && (id->PKRPin = strdup(pin)) == NULL) {
+    *error = "Could not allocate identity PIN";
+    keyring_free_identity(id);
+    return NULL;
+  }
   // The two bytes immediately following the MAC describe the rotation offset.
   uint16_t rotation = (slot[PKR_SALT_BYTES + PKR_MAC_BYTES] << 8) | slot[PKR_SALT_BYTES + PKR_MAC_BYTES + 1];
   /* Pack the key pairs into the rest of the slot as a rotated buffer. */
@@ -1097,8 +1295,9 @@ static keyring_identity *keyring_unpack_identity(unsigned char *slot, const char
     }
     // Create keyring entry to hold the key pair.  Even entries of unknown type are stored,
     // so they can be dumped.
-    keypair *kp = keyring_alloc_keypair(ktype, keypair_len);
+    keypair *kp = keyring_new_keypair(ktype, keypair_len);
     if (kp == NULL) {
+      *error = "Could not allocate key pair";
       keyring_free_identity(id);
       return NULL;
     }
@@ -1111,7 +1310,10 @@ static keyring_identity *keyring_unpack_identity(unsigned char *slot, const char
 
     DEBUGF(keyring, "unpack key type = 0x%02x(%s) at offset %u", ktype, keytype_str(ktype, "unknown"), (int)rotbuf_position(&rbo));
     if (unpacker(kp, &rbuf, keypair_len) != 0) {
-      // If there is an error, it is probably an empty slot.
+      // An unpacker that sizes a key from its stored length leaves it NULL if it cannot allocate it.
+      if ((kp->private_key_len && !kp->private_key) || (kp->public_key_len && !kp->public_key))
+	*error = "Could not allocate key";
+      // Otherwise it is probably an empty slot.
       DEBUGF(keyring, "key type 0x%02x does not unpack", ktype);
       keyring_free_keypair(kp);
       keyring_free_identity(id);
@@ -1216,34 +1418,68 @@ static int keyring_finalise_identity(uint8_t *dirty, keyring_identity *id)
 }
 
 
+/* The occupied slots that we are trying to unlock with a PIN.  Decrypting, unpacking and checking
+ * the MAC of one slot doesn't depend on any other slot or on the keyring_file, so when there are
+ * many slots the work is spread across threads.  Only the calling thread commits the identities
+ * that were found.
+ */
+struct keyring_unlock {
+  const char *pin;
+  const char *KeyRingPin;
+  unsigned char *KeyRingSalt;
+  int KeyRingSaltLen;
+  // the whole keyring file mapped into memory, or NULL to read each slot from the file
+  const unsigned char *map;
+  FILE *file;
+  unsigned count;
+  const unsigned *slots;
+  keyring_identity **identities;
+  // why each slot could not be tried, if it could not; logged by the calling thread
+  const char **errors;
+};
+
+// Don't bother starting threads unless each of them has this many slots to try.
+#define KEYRING_UNLOCK_SLOTS_PER_THREAD 16
+#define KEYRING_UNLOCK_MAX_THREADS 64
+
 /* Read the slot, and try to decrypt it.  Decryption is symmetric with encryption, so the same
  * function is used for munging the slot before making use of it, whichever way we are going.  Once
  * munged, we then need to verify that the slot is valid, and if so unpack the details of the
  * identity.
+ *
+ * Runs on the worker threads, which must not log, so any error is returned in *error.
  */
-static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot_number)
+static keyring_identity *keyring_decrypt_pkr(const struct keyring_unlock *u, unsigned slot_number, const char **error)
 {
-  DEBUGF(keyring, "k=%p, pin=%s slot_number=%d", k, alloca_str_toprint(pin), slot_number);
+  DEBUGF(keyring, "pin=%s slot_number=%u", alloca_str_toprint(u->pin), slot_number);
   unsigned char slot[KEYRING_PAGE_SIZE];
+  unsigned char hash[crypto_hash_sha512_BYTES];
   keyring_identity *id=NULL;
 
   /* 1. Read slot. */
-  if (fseeko(k->file,slot_number*KEYRING_PAGE_SIZE,SEEK_SET))
-    return WHY_perror("fseeko");
-  if (fread(slot, KEYRING_PAGE_SIZE, 1, k->file) != 1)
-    return WHY_perror("fread");
+  if (u->map)
+    bcopy(&u->map[(size_t)slot_number * KEYRING_PAGE_SIZE], slot, KEYRING_PAGE_SIZE);
+  else{
+    if (fseeko(u->file, (off_t)slot_number * KEYRING_PAGE_SIZE, SEEK_SET)){
+      *error = "fseeko() failed";
+      return NULL;
+    }
+    if (fread(slot, KEYRING_PAGE_SIZE, 1, u->file) != 1){
+      *error = "fread() failed";
+      return NULL;
+    }
+  }
   /* 2. Decrypt data from slot. */
-  if (keyring_munge_block(slot, KEYRING_PAGE_SIZE, k->KeyRingSalt, k->KeyRingSaltLen, k->KeyRingPin, pin)) {
-    WHYF("keyring_munge_block() failed, slot=%u", slot_number);
+  if (keyring_munge_block(slot, KEYRING_PAGE_SIZE, u->KeyRingSalt, u->KeyRingSaltLen, u->KeyRingPin, u->pin)) {
+    *error = "keyring_munge_block() failed";
     goto kdp_safeexit;
   }
-  /* 3. Unpack contents of slot into a new identity in the provided context. */
+  /* 3. Unpack contents of slot into a new identity. */
   DEBUGF(keyring, "unpack slot %u", slot_number);
-  if (((id = keyring_unpack_identity(slot, pin)) == NULL))
+  if (((id = keyring_unpack_identity(slot, u->pin, error)) == NULL))
     goto kdp_safeexit; // Not a valid slot
   id->slot = slot_number;
   /* 4. Verify that slot is self-consistent (check MAC) */
-  unsigned char hash[crypto_hash_sha512_BYTES];
   if (keyring_identity_mac(id, slot, hash))
     goto kdp_safeexit;
   /* compare hash to record */
@@ -1255,11 +1491,9 @@ static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot_number
     }
     goto kdp_safeexit;
   }
-
-  if (keyring_commit_identity(k, id)!=1)
-    goto kdp_safeexit;
-
-  return 0;
+  bzero(slot,KEYRING_PAGE_SIZE);
+  bzero(hash,crypto_hash_sha512_BYTES);
+  return id;
 
  kdp_safeexit:
   /* Clean up any potentially sensitive data before exiting */
@@ -1267,7 +1501,81 @@ static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot_number
   bzero(hash,crypto_hash_sha512_BYTES);
   if (id)
     keyring_free_identity(id);
+  return NULL;
+}
+
+struct keyring_unlock_worker {
+  const struct keyring_unlock *unlock;
+  unsigned first;
+  unsigned stride;
+};
+
+static void *keyring_unlock_work(void *context)
+{
+  const struct keyring_unlock_worker *w = context;
+  unsigned i;
+  for (i = w->first; i < w->unlock->count; i += w->stride)
+    w->unlock->identities[i] = keyring_decrypt_pkr(w->unlock, w->unlock->slots[i], &w->unlock->errors[i]);
+  return NULL;
+}
+
+static unsigned keyring_unlock_threads(const struct keyring_unlock *u)
+{
+#ifdef HAVE_PTHREAD
+  // Worker threads must not log, so keep everything on this thread while debugging.  Errors are
+  // collected for each slot and logged once the workers are done.
+  if (!u->map || IF_DEBUG(keyring))
+    return 1;
+  long threads = config.keyring.unlock_threads;
+  if (threads == 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > (long)(u->count / KEYRING_UNLOCK_SLOTS_PER_THREAD))
+    threads = u->count / KEYRING_UNLOCK_SLOTS_PER_THREAD;
+  if (threads > KEYRING_UNLOCK_MAX_THREADS)
+    threads = KEYRING_UNLOCK_MAX_THREADS;
+  return threads > 1 ? (unsigned)threads : 1;
+#else
   return 1;
+#endif
+}
+
+/* Decrypt all of the given slots, filling in u->identities[] with any identity found in each one.
+ */
+static void keyring_decrypt_slots(const struct keyring_unlock *u)
+{
+  unsigned threads = keyring_unlock_threads(u);
+  struct keyring_unlock_worker workers[threads];
+  unsigned i;
+  for (i = 0; i < threads; i++){
+    workers[i].unlock = u;
+    workers[i].first = i;
+    workers[i].stride = threads;
+  }
+#ifdef HAVE_PTHREAD
+  if (threads > 1){
+    DEBUGF(keyring, "decrypting %u slots with %u threads", u->count, threads);
+    pthread_t tids[threads];
+    unsigned started = 0;
+    // signals must only be delivered to the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 1; i < threads; i++){
+      if (pthread_create(&tids[i], NULL, keyring_unlock_work, &workers[i]))
+	break;
+      started = i;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    // any worker we couldn't start is run here instead
+    for (i = started + 1; i < threads; i++)
+      keyring_unlock_work(&workers[i]);
+    keyring_unlock_work(&workers[0]);
+    for (i = 1; i <= started; i++)
+      pthread_join(tids[i], NULL);
+    return;
+  }
+#endif
+  keyring_unlock_work(&workers[0]);
 }
 
 /* Try all valid slots with the PIN and see if we find any identities with that PIN.
@@ -1291,9 +1599,26 @@ int keyring_enter_pin(keyring_file *k, const char *pin)
   }
   if (identitiesFound)
     RETURN(identitiesFound);
-    
+
+  unsigned slot_count = k->file_size / KEYRING_PAGE_SIZE;
+  if (!slot_count)
+    RETURN(0);
+  unsigned *slots = emalloc(slot_count * sizeof(unsigned));
+  if (!slots)
+    RETURN(0);
+
+  struct keyring_unlock unlock = {
+    .pin = pin,
+    .KeyRingPin = k->KeyRingPin,
+    .KeyRingSalt = k->KeyRingSalt,
+    .KeyRingSaltLen = k->KeyRingSaltLen,
+    .file = k->file,
+    .count = 0,
+    .slots = slots,
+  };
+
   unsigned slot;
-  for(slot=0;slot<k->file_size/KEYRING_PAGE_SIZE;slot++) {
+  for(slot=0;slot<slot_count;slot++) {
     /* slot zero is the BAM and salt, so skip it */
     if (slot&(KEYRING_BAM_BITS-1)) {
       /* Not a BAM slot, so examine */
@@ -1310,14 +1635,45 @@ int keyring_enter_pin(keyring_file *k, const char *pin)
       int position=slot&(KEYRING_BAM_BITS-1);
       int byte=position>>3;
       int bit=position&7;
-      if (b->bitmap[byte]&(1<<bit)) {
+      if (b->bitmap[byte]&(1<<bit))
 	/* Slot is occupied, so check it.
 	    We have to check it for each keyring context (ie keyring pin) */
-	if (keyring_decrypt_pkr(k, pin, slot) == 0)
-	  ++identitiesFound;
-      }
+	slots[unlock.count++] = slot;
+    }
+  }
+
+  if (unlock.count
+    && (unlock.identities = emalloc_zero(unlock.count * sizeof(keyring_identity *)))
+    && (unlock.errors = emalloc_zero(unlock.count * sizeof(const char *)))
+  ) {
+    /* Map all the slabs at once rather than seeking to and reading each slot. */
+    void *map = MAP_FAILED;
+    if (unlock.count > 1 && fflush(k->file) == 0)
+      map = mmap(NULL, k->file_size, PROT_READ, MAP_SHARED, fileno(k->file), 0);
+    if (map != MAP_FAILED)
+      unlock.map = map;
+
+    keyring_decrypt_slots(&unlock);
+
+    if (map != MAP_FAILED)
+      munmap(map, k->file_size);
+
+    /* Commit what we found in slot order, as if we had tried each slot in turn. */
+    unsigned i;
+    for (i = 0; i < unlock.count; i++){
+      if (unlock.errors[i])
+	WHYF("%s, slot=%u", unlock.errors[i], unlock.slots[i]);
+      if (!unlock.identities[i])
+	continue;
+      if (keyring_commit_identity(k, unlock.identities[i]) == 1)
+	++identitiesFound;
+      else
+	keyring_free_identity(unlock.identities[i]);
     }
   }
+  free(unlock.identities);
+  free(unlock.errors);
+  free(slots);
 
   if (k->dirty)
     keyring_commit(k);
@@ -1371,6 +1727,8 @@ static int keyring_commit_identity(keyring_file *k, keyring_identity *id)
   // Do nothing if an identity with this sid already exists
   if (keyring_find_identity_sid(k, id->box_pk))
     return 0;
+  if (keyring_index_identity(k, id) == -1)
+    return -1;
   set_slot(k, id->slot, 1);
 
   keyring_identity **i=&k->identities;
@@ -1504,8 +1862,10 @@ void keyring_destroy_identity(keyring_file *k, keyring_identity *id)
   keyring_identity **i = &k->identities;
   while (*i && *i != id)
     i = &(*i)->next;
-  if (*i == id)
+  if (*i == id) {
     *i = id->next;
+    keyring_unindex_identity(k, id);
+  }
 }
 
 int keyring_commit(keyring_file *k)
@@ -1603,7 +1963,7 @@ int keyring_commit(keyring_file *k)
   return errorCount ? WHYF("%u errors commiting keyring to disk", errorCount) : 0;
 }
 
-int keyring_set_did(keyring_identity *id, const char *did, const char *name)
+static int keyring_identity_set_did(keyring_identity *id, const char *did, const char *name)
 {
   /* Find where to put it */
   keypair *kp = id->keypairs;
@@ -1642,6 +2002,15 @@ int keyring_set_did(keyring_identity *id, const char *did, const char *name)
   return 0;
 }
 
+int keyring_set_did(keyring_file *k, keyring_identity *id, const char *did, const char *name)
+{
+  keyring_unindex_identity(k, id);
+  int ret = keyring_identity_set_did(id, did, name);
+  if (keyring_index_identity(k, id) == -1)
+    ret = -1;
+  return ret;
+}
+
 int keyring_set_pin(keyring_identity *id, const char *pin)
 {
   if (id->PKRPin){
@@ -1682,7 +2051,7 @@ int keyring_pack_tag(unsigned char *packed, size_t *packed_len, const char *name
   return 0;
 }
 
-int keyring_set_public_tag(keyring_identity *id, const char *name, const unsigned char *value, size_t length)
+static int keyring_identity_set_public_tag(keyring_identity *id, const char *name, const unsigned char *value, size_t length)
 {
   keypair *kp=id->keypairs;
   while(kp){
@@ -1709,6 +2078,8 @@ int keyring_set_public_tag(keyring_identity *id, const char *name, const unsigne
   
   if (kp->public_key)
     free(kp->public_key);
+  kp->public_key = NULL;
+  kp->public_key_len = 0;
   
   if (keyring_pack_tag(NULL, &kp->public_key_len, name, value, length))
     return -1;
@@ -1723,15 +2094,33 @@ int keyring_set_public_tag(keyring_identity *id, const char *name, const unsigne
   return 0;
 }
 
+int keyring_set_public_tag(keyring_file *k, keyring_identity *id, const char *name, const unsigned char *value, size_t length)
+{
+  keyring_unindex_identity(k, id);
+  int ret = keyring_identity_set_public_tag(id, name, value, length);
+  if (keyring_index_identity(k, id) == -1)
+    ret = -1;
+  return ret;
+}
+
 keypair * keyring_find_public_tag(keyring_iterator *it, const char *name, const unsigned char **value, size_t *length)
 {
   keypair *keypair;
-  while((keypair=keyring_next_keytype(it,KEYTYPE_PUBLIC_TAG))){
-    const char *tag_name;
-    if (!keyring_unpack_tag(keypair->public_key, keypair->public_key_len, &tag_name, value, length) &&
-      strcmp(name, tag_name)==0){
+  if (it->index_position || !it->identity) {
+    struct keyring_tag_key key = {.name = name, .value = NULL, .length = 0};
+    if ((keypair = keyring_index_next(it, &it->file->index_tag, index_cmp_tag, &key))) {
+      const char *tag_name;
+      keyring_unpack_tag(keypair->public_key, keypair->public_key_len, &tag_name, value, length);
       return keypair;
     }
+  } else {
+    while((keypair=keyring_next_keytype(it,KEYTYPE_PUBLIC_TAG))){
+      const char *tag_name;
+      if (!keyring_unpack_tag(keypair->public_key, keypair->public_key_len, &tag_name, value, length) &&
+	strcmp(name, tag_name)==0){
+	return keypair;
+      }
+    }
   }
   if (value)
     *value=NULL;
@@ -1743,6 +2132,10 @@ keypair * keyring_find_public_tag_value(keyring_iterator *it, const char *name,
   const unsigned char *stored_value;
   size_t stored_length;
   keypair *keypair;
+  if (it->index_position || !it->identity) {
+    struct keyring_tag_key key = {.name = name, .value = value, .length = length};
+    return keyring_index_next(it, &it->file->index_tag, index_cmp_tag, &key);
+  }
   while((keypair=keyring_find_public_tag(it, name, &stored_value, &stored_length))){
     if (stored_length == length && memcmp(value, stored_value, length)==0)
       return keypair;
@@ -1922,52 +2315,183 @@ keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed)
   can indeed be reused.
 */
 
-/* XXX We need a more efficient implementation than a linear list, but it will
-   do for now. */
+/* Cached shared secrets are found via a hash table keyed on both SIDs, and the least
+   recently used record is replaced once the cache holds mdp.nm_cache_size records. */
 struct nm_record {
-  /* 96 bytes per record */
   sid_t known_key;
   sid_t unknown_key;
   unsigned char nm_bytes[crypto_box_BEFORENMBYTES];
+  // session keys derived from nm_bytes, for frames sent to and from the unknown key
+  unsigned char session_keys[2][SESSION_KEY_BYTES];
+  uint8_t session_keys_valid;
+  struct nm_record *hash_next;
+  struct nm_record *lru_prev;
+  struct nm_record *lru_next;
 };
 
-unsigned nm_slots_used=0;
-/* 512 x 96 bytes = 48KB, not too big */
-#define NM_CACHE_SLOTS 512
-struct nm_record nm_cache[NM_CACHE_SLOTS];
+static struct nm_record **nm_hash = NULL;
+static unsigned nm_hash_size = 0;
+static unsigned nm_slots_used = 0;
+// most recently used at the head
+static struct nm_record *nm_lru_head = NULL;
+static struct nm_record *nm_lru_tail = NULL;
 
-unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp)
+static uint64_t nm_hits = 0;
+static uint64_t nm_misses = 0;
+static uint64_t nm_evictions = 0;
+
+static unsigned nm_hash_index(const sid_t *known, const sid_t *unknown)
+{
+  // SIDs are public keys, so any of their bytes are well distributed
+  uint32_t k, u;
+  memcpy(&k, known->binary, sizeof k);
+  memcpy(&u, unknown->binary, sizeof u);
+  return (k * 31 + u) & (nm_hash_size - 1);
+}
+
+static void nm_lru_unlink(struct nm_record *r)
+{
+  if (r->lru_prev)
+    r->lru_prev->lru_next = r->lru_next;
+  else
+    nm_lru_head = r->lru_next;
+  if (r->lru_next)
+    r->lru_next->lru_prev = r->lru_prev;
+  else
+    nm_lru_tail = r->lru_prev;
+  r->lru_prev = r->lru_next = NULL;
+}
+
+static void nm_lru_push(struct nm_record *r)
+{
+  r->lru_prev = NULL;
+  r->lru_next = nm_lru_head;
+  if (nm_lru_head)
+    nm_lru_head->lru_prev = r;
+  else
+    nm_lru_tail = r;
+  nm_lru_head = r;
+}
+
+static void nm_hash_unlink(struct nm_record *r)
+{
+  struct nm_record **rp = &nm_hash[nm_hash_index(&r->known_key, &r->unknown_key)];
+  while (*rp != r)
+    rp = &(*rp)->hash_next;
+  *rp = r->hash_next;
+  r->hash_next = NULL;
+}
+
+static void nm_hash_link(struct nm_record *r)
+{
+  unsigned i = nm_hash_index(&r->known_key, &r->unknown_key);
+  r->hash_next = nm_hash[i];
+  nm_hash[i] = r;
+}
+
+// keep the hash table at least as big as the cache capacity, so chains stay short
+static void nm_hash_resize(unsigned capacity)
+{
+  unsigned size = 16;
+  while (size < capacity)
+    size <<= 1;
+  if (size <= nm_hash_size)
+    return;
+  nm_hash_size = size;
+  free(nm_hash);
+  nm_hash = emalloc_zero(sizeof(struct nm_record *) * nm_hash_size);
+  if (!nm_hash)
+    FATAL("Cannot allocate nm cache");
+  struct nm_record *r;
+  for (r = nm_lru_head; r; r = r->lru_next)
+    nm_hash_link(r);
+}
+
+static struct nm_record *keyring_get_nm_record(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp)
 {
   IN();
+  unsigned capacity = config.mdp.nm_cache_size ? config.mdp.nm_cache_size : 1;
+  nm_hash_resize(capacity);
 
   /* See if we have it cached already */
-  unsigned i;
-  for(i=0;i<nm_slots_used;i++){
-    if (cmp_sid_t(&nm_cache[i].known_key, box_pk) != 0) continue;
-    if (cmp_sid_t(&nm_cache[i].unknown_key, unknown_sidp) != 0) continue;
-    RETURN(nm_cache[i].nm_bytes);
-  }
-
-  /* Not in the cache, so prepare to cache it (or return failure if known is not
-     in fact a known key */
-  /* work out where to store it */
-  if (nm_slots_used<NM_CACHE_SLOTS) {
-    i=nm_slots_used; nm_slots_used++; 
-  } else {
-    i=randombytes_uniform(NM_CACHE_SLOTS);
-  }
+  struct nm_record *r;
+  for (r = nm_hash[nm_hash_index(box_pk, unknown_sidp)]; r; r = r->hash_next){
+    if (cmp_sid_t(&r->unknown_key, unknown_sidp) != 0) continue;
+    if (cmp_sid_t(&r->known_key, box_pk) != 0) continue;
+    nm_hits++;
+    if (r != nm_lru_head){
+      nm_lru_unlink(r);
+      nm_lru_push(r);
+    }
+    RETURN(r);
+  }
+  nm_misses++;
+
+  /* Not in the cache, so prepare to cache it.
+     Drop the least recently used records if the cache is full, or has been configured smaller */
+  r = NULL;
+  while (nm_lru_tail && nm_slots_used >= capacity){
+    if (r)
+      free(r);
+    r = nm_lru_tail;
+    nm_lru_unlink(r);
+    nm_hash_unlink(r);
+    nm_slots_used--;
+    nm_evictions++;
+  }
+  if (!r && (r = emalloc_zero(sizeof(struct nm_record))) == NULL)
+    RETURN(NULL);
+  r->session_keys_valid = 0;
 
   /* calculate and store */
-  nm_cache[i].known_key = *box_pk;
-  nm_cache[i].unknown_key = *unknown_sidp;
-  if (crypto_box_beforenm(nm_cache[i].nm_bytes, unknown_sidp->binary, box_sk)){
+  if (crypto_box_beforenm(r->nm_bytes, unknown_sidp->binary, box_sk)){
+    free(r);
     WHY("crypto_box_beforenm failed");
     RETURN(NULL);
   }
-  RETURN(nm_cache[i].nm_bytes);
+  r->known_key = *box_pk;
+  r->unknown_key = *unknown_sidp;
+  nm_hash_link(r);
+  nm_lru_push(r);
+  nm_slots_used++;
+  RETURN(r);
   OUT();
 }
 
+unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp)
+{
+  struct nm_record *r = keyring_get_nm_record(box_sk, box_pk, unknown_sidp);
+  return r ? r->nm_bytes : NULL;
+}
+
+/* Return the symmetric key for sealing MDP frames sent from box_pk to unknown_sidp (outbound),
+   or from unknown_sidp to box_pk, deriving it from the cached shared secret on first use. */
+unsigned char *keyring_get_session_key(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp, int outbound)
+{
+  struct nm_record *r = keyring_get_nm_record(box_sk, box_pk, unknown_sidp);
+  if (!r)
+    return NULL;
+  unsigned i = outbound ? 0 : 1;
+  if (!(r->session_keys_valid & (1<<i))){
+    if (crypto_session_key(r->session_keys[i], r->nm_bytes,
+	outbound ? box_pk : unknown_sidp,
+	outbound ? unknown_sidp : box_pk) == -1)
+      return NULL;
+    r->session_keys_valid |= 1<<i;
+  }
+  return r->session_keys[i];
+}
+
+static void keyring_show_nm_stats()
+{
+  uint64_t lookups = nm_hits + nm_misses;
+  INFOF("nm cache: %u/%u entries, %"PRIu64" hits, %"PRIu64" misses (%"PRIu64"%% hit rate), %"PRIu64" evictions",
+    nm_slots_used, (unsigned)config.mdp.nm_cache_size,
+    nm_hits, nm_misses, lookups ? nm_hits * 100 / lookups : 0,
+    nm_evictions);
+}
+DEFINE_TRIGGER(show_stats, keyring_show_nm_stats);
+
 static int cmp_identity_ptrs(const keyring_identity *const *a, const keyring_identity *const *b)
 {
   if (a==b)
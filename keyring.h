@@ -72,6 +72,21 @@ typedef struct keyring_bam {
   struct keyring_bam *next;
 } keyring_bam;
 
+/* Sorted arrays of (identity, keypair) references, so that identities can be found by SID,
+ * signing key, DID or public tag with a binary search.  Entries with the same key are kept in
+ * ascending order of slot number.
+ */
+struct keyring_index_entry {
+  keyring_identity *identity;
+  keypair *keypair;
+};
+
+struct keyring_index {
+  struct keyring_index_entry *entries;
+  size_t count;
+  size_t allocated;
+};
+
 typedef struct keyring_file {
   keyring_bam *bam;
   char *KeyRingPin;
@@ -81,12 +96,18 @@ typedef struct keyring_file {
   FILE *file;
   size_t file_size;
   uint8_t dirty;
+  struct keyring_index index_sid;
+  struct keyring_index index_sign;
+  struct keyring_index index_did;
+  struct keyring_index index_tag;
 } keyring_file;
 
 typedef struct keyring_iterator{
   keyring_file *file;
   keyring_identity *identity;
   keypair *keypair;
+  // one more than the position of the next index entry to examine, or zero
+  size_t index_position;
 } keyring_iterator;
 
 void keyring_iterator_start(keyring_file *k, keyring_iterator *it);
@@ -123,7 +144,7 @@ keyring_file *keyring_create_instance();
 keyring_file *keyring_open_instance(const char *pin);
 keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed);
 int keyring_enter_pin(keyring_file *k, const char *pin);
-int keyring_set_did(keyring_identity *id, const char *did, const char *name);
+int keyring_set_did(keyring_file *k, keyring_identity *id, const char *did, const char *name);
 int keyring_set_pin(keyring_identity *id, const char *pin);
 int keyring_sign_message(struct keyring_identity *identity, unsigned char *content, size_t buffer_len, size_t *content_len);
 int keyring_send_identity_request(struct subscriber *subscriber);
@@ -138,13 +159,14 @@ int keyring_load_from_dump(keyring_file *k, unsigned entry_pinc, const char **en
 int keyring_dump(keyring_file *k, XPRINTF xpf, int include_secret);
 
 unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp);
+unsigned char *keyring_get_session_key(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp, int outbound);
 
 struct internal_mdp_header;
 struct overlay_buffer;
 int keyring_send_unlock(struct subscriber *subscriber);
 int keyring_release_subscriber(keyring_file *k, const sid_t *sid);
 
-int keyring_set_public_tag(keyring_identity *id, const char *name, const unsigned char *value, size_t length);
+int keyring_set_public_tag(keyring_file *k, keyring_identity *id, const char *name, const unsigned char *value, size_t length);
 keypair * keyring_find_public_tag(keyring_iterator *it, const char *name, const unsigned char **value, size_t *length);
 keypair * keyring_find_public_tag_value(keyring_iterator *it, const char *name, const unsigned char *value, size_t length);
 int keyring_unpack_tag(const unsigned char *packed, size_t packed_len, const char **name, const unsigned char **value, size_t *length);
@@ -286,7 +286,7 @@ static int app_keyring_set_did(const struct cli_parsed *parsed, struct cli_conte
   keyring_identity *id = keyring_find_identity_sid(keyring, &sid);
   if (!id)
     return WHY("No matching SID");
-  if (keyring_set_did(id, did, name))
+  if (keyring_set_did(keyring, id, did, name))
     return WHY("Could not set DID");
   if (set_pin && keyring_set_pin(id, new_pin))
     return WHY("Could not set new pin");
@@ -320,7 +320,7 @@ static int app_keyring_set_tag(const struct cli_parsed *parsed, struct cli_conte
   if (!id)
     return WHY("No matching SID");
   int length = strlen(value);
-  if (keyring_set_public_tag(id, tag, (const unsigned char*)value, length))
+  if (keyring_set_public_tag(keyring, id, tag, (const unsigned char*)value, length))
     return WHY("Could not set tag value");
   if (keyring_commit(keyring))
     return WHY("Could not write updated keyring record");
@@ -33,6 +33,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <stdint.h>
 #include <dirent.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
 
 #include "version_servald.h"
 #include "instance.h"
@@ -93,7 +96,7 @@ char _log_file_path_buf[400];
 static FILE *_log_file = NULL;
 static void _open_log_file(_log_iterator *);
 static void _rotate_log_file(_log_iterator *it);
-static void _flush_log_file();
+static void _flush_log_file(int level);
 static struct _log_state state_file;
 static struct config_log_format config_file;
 static struct { size_t len; mode_t mode; } mkdir_trace[10];
@@ -103,6 +106,34 @@ static time_t _log_file_start_time;
 static char _log_file_buf[8192];
 static struct strbuf _log_file_strbuf = STRUCT_STRBUF_EMPTY;
 
+/* Static variables for writing the log file from a separate thread, if log.file.async is set.
+ *
+ * Every message is still formatted by the thread that logs it, because its arguments do not
+ * outlive the call, but instead of being written to the file it is appended to a single-producer,
+ * single-consumer ring of bytes that the writer thread drains into the file.  Neither thread takes
+ * a lock to move bytes through the ring; the mutex only protects the condition variable used to
+ * wake the writer after it has found the ring empty.  A message that does not fit in the ring is
+ * dropped and counted, and the writer reports the count in the file, so a slow disk never stalls
+ * the daemon's main loop.
+ */
+static struct {
+  char *buf;
+  size_t size; // a power of two
+  uint64_t head; // only advanced by the logging thread
+  uint64_t tail; // only advanced by the writer thread
+  uint64_t dropped;
+  uint64_t dropped_reported; // only advanced by the writer thread
+  int fd;
+  bool_t running;
+  bool_t sleeping;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;
+} _log_ring = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .wakeup = PTHREAD_COND_INITIALIZER,
+};
+
 #ifdef ANDROID
 /* Static variables for sending log output to the Android log.
  *
@@ -286,10 +317,10 @@ static void _log_end_line(_log_iterator *it, int UNUSED(level))
   }
 }
 
-static void _log_flush(_log_iterator *it)
+static void _log_flush(_log_iterator *it, int level)
 {
   if (it->config == &config_file) {
-    _flush_log_file();
+    _flush_log_file(level);
   }
   else if (it->config == &config.log.console) {
     _flush_log_stderr();
@@ -373,7 +404,7 @@ static int _log_iterator_next(_log_iterator *it, int level)
   assert(level >= LOG_LEVEL_SILENT);
   assert(level <= LOG_LEVEL_FATAL);
   _log_end_line(it, level);
-  _log_flush(it);
+  _log_flush(it, level);
   while (_log_iterator_advance(it)) {
     if (level >= it->config->level && _log_enabled(it)) {
       _log_update(it);
@@ -585,6 +616,160 @@ static void _open_log_file(_log_iterator *it)
   }
 }
 
+static void _log_write_all(int fd, const char *buf, size_t len)
+{
+  while (len) {
+    ssize_t written = write(fd, buf, len);
+    if (written == -1) {
+      if (errno == EINTR)
+	continue;
+      // the writer thread cannot log its own errors, so give up on this chunk
+      return;
+    }
+    buf += written;
+    len -= (size_t)written;
+  }
+}
+
+static void *_log_ring_writer(void *UNUSED(context))
+{
+  while (1) {
+    uint64_t head = __atomic_load_n(&_log_ring.head, __ATOMIC_ACQUIRE);
+    uint64_t tail = _log_ring.tail;
+    uint64_t dropped_reported = _log_ring.dropped_reported;
+    uint64_t dropped = __atomic_load_n(&_log_ring.dropped, __ATOMIC_RELAXED);
+    if (head == tail && dropped == dropped_reported) {
+      pthread_mutex_lock(&_log_ring.mutex);
+      __atomic_store_n(&_log_ring.sleeping, 1, __ATOMIC_SEQ_CST);
+      if (   __atomic_load_n(&_log_ring.head, __ATOMIC_SEQ_CST) == tail
+	  && __atomic_load_n(&_log_ring.dropped, __ATOMIC_SEQ_CST) == dropped_reported) {
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += 1;
+	pthread_cond_timedwait(&_log_ring.wakeup, &_log_ring.mutex, &until);
+      }
+      __atomic_store_n(&_log_ring.sleeping, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&_log_ring.mutex);
+      continue;
+    }
+    // the file descriptor is stored before the bytes that are to be written to it are published
+    int fd = __atomic_load_n(&_log_ring.fd, __ATOMIC_ACQUIRE);
+    while (tail != head) {
+      size_t offset = tail & (_log_ring.size - 1);
+      size_t len = head - tail;
+      if (len > _log_ring.size - offset)
+	len = _log_ring.size - offset;
+      _log_write_all(fd, _log_ring.buf + offset, len);
+      tail += len;
+    }
+    if (dropped != dropped_reported) {
+      char note[80];
+      int len = snprintf(note, sizeof note, "LOG OVERRUN: %"PRIu64" messages dropped\n", dropped - dropped_reported);
+      _log_write_all(fd, note, len);
+      __atomic_store_n(&_log_ring.dropped_reported, dropped, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&_log_ring.tail, tail, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static int _log_ring_drained()
+{
+  return __atomic_load_n(&_log_ring.tail, __ATOMIC_ACQUIRE) == _log_ring.head
+      && __atomic_load_n(&_log_ring.dropped_reported, __ATOMIC_ACQUIRE) == _log_ring.dropped;
+}
+
+/* Wait until the writer thread has written every queued message, eg, before closing the file it
+ * is writing to.  Gives up after a second, in case the writer thread is stuck on a dead disk.
+ */
+static void _log_ring_drain()
+{
+  if (!_log_ring.running)
+    return;
+  unsigned waited;
+  for (waited = 0; waited < 1000 && !_log_ring_drained(); ++waited) {
+    pthread_mutex_lock(&_log_ring.mutex);
+    pthread_cond_signal(&_log_ring.wakeup);
+    pthread_mutex_unlock(&_log_ring.mutex);
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+    nanosleep(&delay, NULL);
+  }
+}
+
+static int _log_ring_start()
+{
+  if (_log_ring.running)
+    return 1;
+  size_t size = 1024;
+  while (size < config.log.file.async_buffer)
+    size <<= 1;
+  if (_log_ring.buf && _log_ring.size != size) {
+    free(_log_ring.buf);
+    _log_ring.buf = NULL;
+  }
+  // don't use emalloc(), which would log the failure from inside the logger
+  if (!_log_ring.buf && (_log_ring.buf = malloc(size)) == NULL)
+    return 0;
+  _log_ring.size = size;
+  _log_ring.head = _log_ring.tail = _log_ring.dropped = _log_ring.dropped_reported = 0;
+  // signals must be handled by the thread that is logging
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&_log_ring.thread, NULL, _log_ring_writer, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err)
+    return 0;
+  pthread_detach(_log_ring.thread);
+  _log_ring.running = 1;
+  static bool_t drain_at_exit = 0;
+  if (!drain_at_exit) {
+    atexit(_log_ring_drain);
+    drain_at_exit = 1;
+  }
+  return 1;
+}
+
+static void _log_ring_append(int fd, const_strbuf sb)
+{
+  struct iovec parts[] = {
+    { .iov_base = (char *)strbuf_str(sb), .iov_len = strbuf_len(sb) },
+    { .iov_base = "\n", .iov_len = 1 },
+    { .iov_base = "LOG OVERRUN\n", .iov_len = strbuf_overrun(sb) ? 12 : 0 },
+  };
+  size_t len = 0;
+  unsigned i;
+  for (i = 0; i < NELS(parts); ++i)
+    len += parts[i].iov_len;
+  uint64_t head = _log_ring.head;
+  uint64_t tail = __atomic_load_n(&_log_ring.tail, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&_log_ring.fd, fd, __ATOMIC_RELAXED);
+  if (len > _log_ring.size - (head - tail)) {
+    __atomic_add_fetch(&_log_ring.dropped, 1, __ATOMIC_SEQ_CST);
+  } else {
+    for (i = 0; i < NELS(parts); ++i) {
+      const char *p = parts[i].iov_base;
+      size_t remain = parts[i].iov_len;
+      while (remain) {
+	size_t offset = head & (_log_ring.size - 1);
+	size_t chunk = _log_ring.size - offset;
+	if (chunk > remain)
+	  chunk = remain;
+	memcpy(_log_ring.buf + offset, p, chunk);
+	p += chunk;
+	remain -= chunk;
+	head += chunk;
+      }
+    }
+    __atomic_store_n(&_log_ring.head, head, __ATOMIC_SEQ_CST);
+  }
+  if (__atomic_load_n(&_log_ring.sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&_log_ring.mutex);
+    pthread_cond_signal(&_log_ring.wakeup);
+    pthread_mutex_unlock(&_log_ring.mutex);
+  }
+}
+
 static void _rotate_log_file(_log_iterator *it)
 {
   if (!cf_limbo && _log_file != NO_FILE && _log_file_path == _log_file_path_buf) {
@@ -592,6 +777,7 @@ static void _rotate_log_file(_log_iterator *it)
       _compute_file_start_time(it);
       if (it->file_start_time != _log_file_start_time) {
 	// Close the current log file, which will cause _open_log_file() to open the next one.
+	_log_ring_drain();
 	if (_log_file)
 	  fclose(_log_file);
 	_log_file = NULL;
@@ -601,9 +787,16 @@ static void _rotate_log_file(_log_iterator *it)
   }
 }
 
-static void _flush_log_file()
+static void _flush_log_file(int level)
 {
   if (_log_file && _log_file != NO_FILE && strbuf_len(&_log_file_strbuf) != 0) {
+    if (config.log.file.async && level < LOG_LEVEL_FATAL && _log_ring_start()) {
+      _log_ring_append(fileno(_log_file), &_log_file_strbuf);
+      strbuf_reset(&_log_file_strbuf);
+      return;
+    }
+    // preserve the order of messages, and make sure that a fatal message is written before abort()
+    _log_ring_drain();
     fprintf(_log_file, "%s%s%s",
 	strbuf_len(&_log_file_strbuf) ? strbuf_str(&_log_file_strbuf) : "",
 	strbuf_len(&_log_file_strbuf) ? "\n" : "",
@@ -622,6 +815,13 @@ static void _flush_log_file()
 void close_log_file()
 {
   strbuf_reset(&_log_file_strbuf);
+  // the writer thread does not exist in a child process, and its parent will write the queued messages
+  if (_log_ring.running) {
+    _log_ring.running = 0;
+    _log_ring.head = _log_ring.tail = _log_ring.dropped = _log_ring.dropped_reported = 0;
+    pthread_mutex_init(&_log_ring.mutex, NULL);
+    pthread_cond_init(&_log_ring.wakeup, NULL);
+  }
   if (_log_file && _log_file != NO_FILE)
     fclose(_log_file);
   _log_file = NULL;
@@ -654,7 +854,7 @@ void logFlush()
   _log_iterator it;
   _log_iterator_start(&it);
   while (_log_iterator_advance(&it))
-    _log_flush(&it);
+    _log_flush(&it, LOG_LEVEL_SILENT);
 }
 
 void vlogMessage(int level, struct __sourceloc whence, const char *fmt, va_list ap)
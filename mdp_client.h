@@ -102,6 +102,13 @@ struct mdp_identity_request {
 
 #define MDP_ROUTE_TABLE 5
 
+/* Fetch the daemon's function timing statistics.
+ * The first reply contains the packed uptime and time spent idle (in poll) in nanoseconds, then
+ * each profiled function or alarm is sent in its own reply; a nul terminated name followed by the
+ * packed number of calls, the total and max time, and the p50, p99 and p999 latency estimates.
+*/
+#define MDP_STATS 6
+
 struct overlay_mdp_scan{
   struct in_addr addr;
 };
@@ -18,6 +18,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <string.h>
+#include <inttypes.h>
 #include "mem.h"
 
 void *_emalloc(struct __sourceloc __whence, size_t bytes)
@@ -61,6 +62,48 @@ char *_str_edup(struct __sourceloc __whence, const char *str)
   return _strn_edup(__whence, str, strlen(str));
 }
 
+void *_mem_pool_alloc(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  void *ret = pool->free_list;
+  if (ret) {
+    pool->free_list = *(void **)ret;
+    pool->free_count--;
+    pool->hits++;
+    return ret;
+  }
+  pool->fallbacks++;
+  return _emalloc(__whence, pool->size);
+}
+
+void *_mem_pool_alloc_zero(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  void *ret = _mem_pool_alloc(__whence, pool);
+  if (ret)
+    memset(ret, 0, pool->size);
+  return ret;
+}
+
+void mem_pool_free(struct mem_pool *pool, void *ptr)
+{
+  if (!ptr)
+    return;
+  if (pool->free_count >= pool->max_free) {
+    free(ptr);
+    return;
+  }
+  *(void **)ptr = pool->free_list;
+  pool->free_list = ptr;
+  pool->free_count++;
+}
+
+void mem_pool_log_stats(const struct mem_pool *pool)
+{
+  uint64_t allocs = pool->hits + pool->fallbacks;
+  INFOF("%s pool: %u free, %"PRIu64" hits, %"PRIu64" fallback mallocs (%"PRIu64"%% hit rate)",
+    pool->name, pool->free_count, pool->hits, pool->fallbacks,
+    allocs ? pool->hits * 100 / allocs : 0);
+}
+
 #undef malloc
 #undef calloc
 #undef free
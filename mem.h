@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __SERVAL_DNA__MEM_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include "lang.h"
 #include "log.h"
 
@@ -64,10 +65,37 @@ void *_emalloc_zero(struct __sourceloc, size_t bytes) __attribute__ ((__ATTRIBUT
 char *_str_edup(struct __sourceloc, const char *str) __attribute__ ((__ATTRIBUTE_malloc));
 char *_strn_edup(struct __sourceloc, const char *str, size_t len) __attribute__ ((__ATTRIBUTE_malloc));
 
+/* A free list of fixed size blocks, for objects that are allocated and released
+ * at a high rate on the packet path.  Released blocks are kept for re-use, up
+ * to max_free of them, and anything beyond that is returned to free(3).  The
+ * hits and fallbacks counters record how many allocations were served from the
+ * free list and how many had to fall back to malloc(3).
+ *
+ * The block size must be at least sizeof(void *).
+ */
+struct mem_pool {
+  const char *name;
+  size_t size;
+  unsigned max_free;
+  unsigned free_count;
+  void *free_list;
+  uint64_t hits;
+  uint64_t fallbacks;
+};
+
+#define MEM_POOL_INIT(NAME, SIZE, MAX_FREE) { .name = (NAME), .size = (SIZE), .max_free = (MAX_FREE) }
+
+void *_mem_pool_alloc(struct __sourceloc, struct mem_pool *pool) __attribute__ ((__ATTRIBUTE_malloc));
+void *_mem_pool_alloc_zero(struct __sourceloc, struct mem_pool *pool) __attribute__ ((__ATTRIBUTE_malloc));
+void mem_pool_free(struct mem_pool *pool, void *ptr);
+void mem_pool_log_stats(const struct mem_pool *pool);
+
 #define emalloc(bytes)       _emalloc(__HERE__, (bytes))
 #define erealloc(ptr, bytes) _erealloc(__HERE__, (ptr), (bytes))
 #define emalloc_zero(bytes)  _emalloc_zero(__HERE__, (bytes))
 #define str_edup(str)        _str_edup(__HERE__, (str))
 #define strn_edup(str, len)  _strn_edup(__HERE__, (str), (len))
+#define mem_pool_alloc(pool)      _mem_pool_alloc(__HERE__, (pool))
+#define mem_pool_alloc_zero(pool) _mem_pool_alloc_zero(__HERE__, (pool))
 
 #endif // __SERVAL_DNA__MEM_H
@@ -111,10 +111,7 @@ static enum meshms_status get_database_conversations(const keyring_identity *id,
 {
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id, version, filesize, tail, sender, recipient"
-      " FROM manifests"
-      " WHERE service = ?2"
-      " AND (sender=?1 or recipient=?1)",
+      MESHMS_CONVERSATIONS_SQL,
       SID_T, id->box_pk,
       STATIC_TEXT, RHIZOME_SERVICE_MESHMS2,
       END
@@ -48,6 +48,18 @@ __MESHMS_INLINE int meshms_failed(enum meshms_status status) {
 
 const char *meshms_status_message(enum meshms_status);
 
+/* Finds the MeshMS2 conversation bundles of a SID (?1), sent or received.  A UNION rather than an
+ * OR, so that each half is answered by the (service, sender) or (service, recipient) index.
+ */
+#define MESHMS_CONVERSATIONS_SQL \
+  "SELECT id, version, filesize, tail, sender, recipient" \
+  " FROM manifests" \
+  " WHERE service = ?2 AND sender = ?1" \
+  " UNION" \
+  " SELECT id, version, filesize, tail, sender, recipient" \
+  " FROM manifests" \
+  " WHERE service = ?2 AND recipient = ?1"
+
 struct meshms_metadata{
   // what is the offset of their last message
   uint64_t their_last_message;
@@ -116,3 +116,113 @@ static int app_monitor_cli(const struct cli_parsed *UNUSED(parsed), struct cli_c
   return 0;
 }
 
+struct monitor_benchmark {
+  unsigned received;
+  // writes that had to wait for the server to read our earlier commands
+  unsigned stalls;
+};
+
+static int benchmark_hangup(char *UNUSED(cmd), int UNUSED(argc), char **UNUSED(argv), unsigned char *UNUSED(data), int UNUSED(dataLen), void *context)
+{
+  struct monitor_benchmark *bench = context;
+  bench->received++;
+  return 1;
+}
+
+static int benchmark_ignore(char *UNUSED(cmd), int UNUSED(argc), char **UNUSED(argv), unsigned char *UNUSED(data), int UNUSED(dataLen), void *UNUSED(context))
+{
+  return 1;
+}
+
+static int benchmark_send_audio(int fd, unsigned char *audio, int bytes, unsigned seq)
+{
+  return monitor_client_writeline_and_data(fd, audio, bytes, "audio 0 %d %u %u\n", VOMP_CODEC_16SIGNED, seq * 20, seq);
+}
+
+// how many audio commands to send before waiting for their events
+#define BENCHMARK_WINDOW 64
+// how long a slow reader waits to be able to write, before reading some events (ms)
+#define BENCHMARK_SLOW_READER_WAIT 10
+
+DEFINE_CMD(app_monitor_benchmark, 0,
+  "Measure how many audio commands per second the monitor interface can process.",
+  "monitor","benchmark","[--slow-reader]","[<count>]");
+static int app_monitor_benchmark(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *count_text;
+  if (cli_arg(parsed, "count", &count_text, cli_uint, "10000") == -1)
+    return -1;
+  unsigned count = atoi(count_text);
+  int slow_reader = 0 == cli_arg(parsed, "--slow-reader", NULL, NULL, NULL);
+
+  struct monitor_benchmark bench = {.received = 0, .stalls = 0};
+  struct monitor_command_handler handlers[]={
+    {.command="HANGUP", .handler=benchmark_hangup, .context=&bench},
+    {.command="",       .handler=benchmark_ignore},
+  };
+
+  struct monitor_state *state;
+  int fd = monitor_client_open(&state);
+  if (fd == -1)
+    return WHY("Failed to connect to the monitor interface");
+
+  /* Audio for a call that doesn't exist is answered with a HANGUP event to every vomp client,
+     so each command makes a round trip through the command parser and the event fan out. */
+  unsigned char audio[320];
+  bzero(audio, sizeof audio);
+  monitor_client_writeline(fd, "monitor vomp\n");
+
+  int ret = 0;
+  unsigned sent = 0;
+  time_ms_t start = gettime_ms();
+  while (bench.received < count){
+    /* A slow reader keeps sending commands while the socket will take them, and only reads events
+       once it has been unable to write for a while.  The server must hold back our commands until
+       we catch up. */
+    if (slow_reader && sent < count){
+      struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+      int r = poll(&pfd, 1, BENCHMARK_SLOW_READER_WAIT);
+      if (r == -1){
+	ret = WHY_perror("poll");
+	goto end;
+      }
+      if (r && (pfd.revents & POLLOUT)){
+	if (benchmark_send_audio(fd, audio, sizeof audio, sent) == -1){
+	  ret = WHY_perror("write");
+	  goto end;
+	}
+	sent++;
+	continue;
+      }
+      bench.stalls++;
+    }
+    while (!slow_reader && sent < count && sent - bench.received < BENCHMARK_WINDOW){
+      if (benchmark_send_audio(fd, audio, sizeof audio, sent) == -1){
+	ret = WHY_perror("write");
+	goto end;
+      }
+      sent++;
+    }
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, 5000) <= 0){
+      ret = WHYF("Timed out after %u of %u events", bench.received, count);
+      goto end;
+    }
+    if (monitor_client_read(fd, state, handlers, NELS(handlers)) < 0){
+      ret = WHY("Monitor connection failed");
+      goto end;
+    }
+  }
+
+  time_ms_t elapsed = gettime_ms() - start;
+  if (elapsed < 1)
+    elapsed = 1;
+  cli_printf(context, "%u audio commands of %zu bytes in %"PRId64"ms, %"PRId64" commands/sec\n",
+    count, sizeof audio, (int64_t)elapsed, (int64_t)count * 1000 / elapsed);
+  if (slow_reader)
+    cli_printf(context, "%u writes waited for the server to read\n", bench.stalls);
+end:
+  monitor_client_close(fd, state);
+  return ret;
+}
@@ -84,6 +84,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define MONITOR_LINE_LENGTH 160
 #define MONITOR_DATA_SIZE MAX_AUDIO_BYTES
+// bytes read from the client in one go, before being parsed into commands
+#define MONITOR_INPUT_SIZE 4096
+// events and responses queued for a client that is slow to read them
+#define MONITOR_OUTPUT_SIZE 32768
+// stop reading commands from a client while it has this much unread output
+#define MONITOR_OUTPUT_HIGH_WATER (MONITOR_OUTPUT_SIZE / 2)
 struct monitor_context {
   struct sched_ent alarm;
   // monitor interest bitmask
@@ -102,6 +108,17 @@ struct monitor_context {
   unsigned char buffer[MONITOR_DATA_SIZE];
   int data_expected;
   int data_offset;
+
+  unsigned char input[MONITOR_INPUT_SIZE];
+  size_t input_offset;
+  size_t input_length;
+  // complete commands are waiting in the input buffer until our output drains
+  int held_back;
+
+  // ring buffer of bytes waiting to be written
+  unsigned char output[MONITOR_OUTPUT_SIZE];
+  size_t output_offset;
+  size_t output_length;
 };
 
 #define MAX_MONITOR_SOCKETS 8
@@ -146,12 +163,80 @@ error:
   return -1;
 }
 
+// only poll for commands while the client is keeping up with our output.
+// Output can drain from monitor_write() while another client is being served, so we also poll for
+// POLLOUT while commands are held back, to parse them as soon as the backlog allows.
+static void monitor_update_events(struct monitor_context *c)
+{
+  short events = POLLHUP;
+  if (c->output_length <= MONITOR_OUTPUT_HIGH_WATER)
+    events |= POLLIN;
+  if (c->output_length || c->held_back)
+    events |= POLLOUT;
+  if (events != c->alarm.poll.events){
+    c->alarm.poll.events = events;
+    watch(&c->alarm);
+  }
+}
+
+// write as much queued output as the socket will take, wrapping around the ring buffer with writev
+static int monitor_flush(struct monitor_context *c)
+{
+  while (c->output_length){
+    struct iovec iov[2];
+    int iovcnt = 1;
+    size_t first = MONITOR_OUTPUT_SIZE - c->output_offset;
+    if (first > c->output_length)
+      first = c->output_length;
+    iov[0].iov_base = &c->output[c->output_offset];
+    iov[0].iov_len = first;
+    if (first < c->output_length){
+      iov[1].iov_base = c->output;
+      iov[1].iov_len = c->output_length - first;
+      iovcnt = 2;
+    }
+    ssize_t written = writev_nonblock(c->alarm.poll.fd, iov, iovcnt);
+    if (written == -1)
+      return -1;
+    if (written == 0)
+      break;
+    c->output_offset = (c->output_offset + written) % MONITOR_OUTPUT_SIZE;
+    c->output_length -= written;
+  }
+  if (c->output_length == 0)
+    c->output_offset = 0;
+  return 0;
+}
+
+/* Queue bytes for the client. They are written when the socket is next writable, so every
+   event raised in one pass of the main loop goes out in a single writev. */
+static int monitor_write(struct monitor_context *c, const char *msg, size_t len)
+{
+  if (len > MONITOR_OUTPUT_SIZE - c->output_length){
+    if (monitor_flush(c) == -1)
+      return -1;
+    if (len > MONITOR_OUTPUT_SIZE - c->output_length)
+      return WHYF("Monitor client fd=%d is not reading, %zu bytes queued", c->alarm.poll.fd, c->output_length);
+  }
+  size_t end = (c->output_offset + c->output_length) % MONITOR_OUTPUT_SIZE;
+  size_t first = MONITOR_OUTPUT_SIZE - end;
+  if (first > len)
+    first = len;
+  bcopy(msg, &c->output[end], first);
+  bcopy(msg + first, c->output, len - first);
+  c->output_length += len;
+  monitor_update_events(c);
+  return 0;
+}
+
+#define monitor_write_str(C,S) monitor_write(C, S, strlen(S))
+
 #define monitor_write_error(C,E) _monitor_write_error(__WHENCE__, C, E)
 static int _monitor_write_error(struct __sourceloc __whence, struct monitor_context *c, const char *error){
   char msg[256];
   WHY(error);
   snprintf(msg, sizeof(msg), "\nERROR:%s\n", error);
-  write_str(c->alarm.poll.fd, msg);
+  monitor_write_str(c, msg);
   return -1;
 }
 
@@ -180,109 +265,159 @@ static void monitor_close(struct monitor_context *c){
     INFOF("Stopping server due to client disconnecting");
     serverMode=SERVER_CLOSING;
   }
+  // send any queued output that the socket will still take
+  monitor_flush(c);
   unwatch(&c->alarm);
   close(c->alarm.poll.fd);
   c->alarm.poll.fd=-1;
   c->state=MONITOR_STATE_UNUSED;
   c->flags=0;
+  c->input_offset = c->input_length = 0;
+  c->held_back = 0;
+  c->output_offset = c->output_length = 0;
 }
 
-void monitor_client_poll(struct sched_ent *alarm)
+/* Parse every complete command in the input buffer. The line of each command is collected
+   in c->line, and any binary data that follows in c->buffer. Returns -1 if the client was
+   closed. */
+static int monitor_parse_input(struct monitor_context *c, int ignore_backlog)
 {
-  /* Read available data from a monitor socket */
-  struct monitor_context *c=(struct monitor_context *)alarm;
-  errno=0;
-  int bytes;
+  c->held_back = 0;
+  while (1){
+    unsigned char *p = &c->input[c->input_offset];
+    size_t len = c->input_length - c->input_offset;
 
-  if (alarm->poll.revents & POLLIN) {
-    switch(c->state) {
-    case MONITOR_STATE_UNUSED:
-      FATAL("should not poll unused client");
-
-    case MONITOR_STATE_COMMAND:
-      bytes = 1;
-      while(bytes == 1) {
-	if (c->line_length >= MONITOR_LINE_LENGTH) {
+    if (c->state == MONITOR_STATE_COMMAND){
+      if (len == 0)
+	break;
+      unsigned char *eol = memchr(p, '\n', len);
+      if (eol)
+	len = eol - p;
+      size_t i;
+      for (i = 0; i < len; i++){
+	// silently skip all \r characters
+	if (p[i] == '\r')
+	  continue;
+	if (c->line_length >= MONITOR_LINE_LENGTH - 1) {
 	  c->line_length=0;
 	  monitor_write_error(c,"Command too long");
 	  DEBUG(monitor, "close monitor because command too long");
 	  monitor_close(c);
-	  return;
-	}
-	bytes = read_nonblock(c->alarm.poll.fd, &c->line[c->line_length], 1);
-	if (bytes == -1) {
-	  DEBUG(monitor, "close monitor due to read error");
-	  monitor_close(c);
-	  return;
+	  return -1;
 	}
-	if (bytes == -2 || bytes == 0)
-	  continue; // no bytes available to read
-	
-	// silently skip all \r characters
-	if (c->line[c->line_length] == '\r')
-	  continue;
-	
-	// parse data length as soon as we see the : delimiter, 
+	c->line[c->line_length] = p[i];
+
+	// parse data length as soon as we see the : delimiter,
 	// so we can read the rest of the line into the start of the buffer
-	if (c->data_expected==0 && c->line[0]=='*' && c->line[c->line_length]==':'){
+	if (c->data_expected==0 && c->line[0]=='*' && p[i]==':'){
 	  c->line[c->line_length]=0;
 	  c->data_expected=atoi(c->line +1);
 	  c->line_length=0;
 	  continue;
 	}
-	
-	if (c->line[c->line_length] == '\n') {
-	  // got whole command line, start reading data if required
-	  c->line[c->line_length]=0;
-	  c->state=MONITOR_STATE_DATA;
-	  c->data_offset=0;
-	  break;
-	}
-	
-	c->line_length += bytes;
+	c->line_length++;
       }
-	
-      // if run out of characters to read before reaching the end of a command, then check for HUP
-      // now in case the client terminated abnormally
-      if (c->state != MONITOR_STATE_DATA)
+      c->input_offset += len;
+      if (!eol)
 	break;
-      // else fall through...
-
-    case MONITOR_STATE_DATA:
-      if (c->data_expected - c->data_offset >0){
-	bytes = read_nonblock(c->alarm.poll.fd, &c->buffer[c->data_offset], c->data_expected - c->data_offset);
-	if (bytes == -2 || bytes == 0)
-	  break; // no bytes available to read
-	if (bytes == -1) {
-	  DEBUG(monitor, "close monitor due to read error");
-	  monitor_close(c);
-	  return;
-	}
 
-	c->data_offset += bytes;
+      // got whole command line, start reading data if required
+      c->input_offset++;
+      c->line[c->line_length]=0;
+      if (c->data_expected < 0 || c->data_expected > MONITOR_DATA_SIZE){
+	monitor_write_error(c,"Data too long");
+	DEBUG(monitor, "close monitor because data too long");
+	monitor_close(c);
+	return -1;
       }
-      
-      // if run out of characters to read before reaching the expected number, then check for HUP
-      // now in case the client terminated abnormally
-      if (c->data_offset < c->data_expected)
-	break;
-	
-      // we have received all of the binary data we were expecting
-      monitor_process_command(c);
-	
-      // reset parsing state
-      c->state = MONITOR_STATE_COMMAND;
-      c->data_expected = 0;
-      c->data_offset = 0;
-      c->line_length = 0;
-
-      // poll again to finish processing all queued commands before checking for HUP, so that any
+      c->state=MONITOR_STATE_DATA;
+      c->data_offset=0;
+      continue;
+    }
+
+    size_t want = c->data_expected - c->data_offset;
+    if (want > len)
+      want = len;
+    bcopy(p, &c->buffer[c->data_offset], want);
+    c->data_offset += want;
+    c->input_offset += want;
+    if (c->data_offset < c->data_expected)
+      break;
+
+    // we have received all of the binary data we were expecting
+    monitor_process_command(c);
+    if (c->state == MONITOR_STATE_UNUSED)
+      return -1;
+
+    // reset parsing state
+    c->state = MONITOR_STATE_COMMAND;
+    c->data_expected = 0;
+    c->data_offset = 0;
+    c->line_length = 0;
+
+    // leave the remaining commands until the client has read our responses
+    if (!ignore_backlog && c->output_length > MONITOR_OUTPUT_HIGH_WATER){
+      c->held_back = 1;
+      break;
+    }
+  }
+
+  // keep the unparsed bytes at the start of the buffer
+  if (c->input_offset){
+    c->input_length -= c->input_offset;
+    bcopy(&c->input[c->input_offset], c->input, c->input_length);
+    c->input_offset = 0;
+  }
+  return 0;
+}
+
+void monitor_client_poll(struct sched_ent *alarm)
+{
+  /* Read available data from a monitor socket */
+  struct monitor_context *c=(struct monitor_context *)alarm;
+
+  if (alarm->poll.revents & POLLOUT) {
+    if (monitor_flush(c) == -1){
+      DEBUG(monitor, "close monitor due to write error");
+      monitor_close(c);
+      return;
+    }
+    // parse any commands that were held back while the output was backlogged
+    if (c->output_length <= MONITOR_OUTPUT_HIGH_WATER && monitor_parse_input(c, 0) == -1)
+      return;
+    monitor_update_events(c);
+  }
+
+  // the input buffer is only left full while commands are held back
+  if ((alarm->poll.revents & POLLIN) && c->input_length < MONITOR_INPUT_SIZE) {
+    if (c->state == MONITOR_STATE_UNUSED)
+      FATAL("should not poll unused client");
+
+    ssize_t bytes = read_nonblock(c->alarm.poll.fd, &c->input[c->input_length], MONITOR_INPUT_SIZE - c->input_length);
+    if (bytes == -1) {
+      DEBUG(monitor, "close monitor due to read error");
+      monitor_close(c);
+      return;
+    }
+    if (bytes > 0) {
+      c->input_length += bytes;
+      if (monitor_parse_input(c, 0) == -1)
+	return;
+      monitor_update_events(c);
+      // poll again to finish reading all queued commands before checking for HUP, so that any
       // queued "quit" command (quit on HUP) is processed before the HUP is handled
       return;
     }
+    if (bytes == 0) {
+      DEBUG(monitor, "client end of file");
+      alarm->poll.revents |= POLLHUP;
+    }
   }
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
     DEBUGF(monitor, "client disconnection (%s)", alloca_poll_events(alarm->poll.revents));
+    // process any commands still held back before closing
+    if (monitor_parse_input(c, 1) == -1)
+      return;
     monitor_close(c);
   }
 }
@@ -364,10 +499,14 @@ static void monitor_new_client(int s) {
   c->alarm.poll.fd = s;
   c->alarm.poll.events = POLLIN | POLLHUP;
   c->line_length = 0;
+  c->data_expected = 0;
   c->state = MONITOR_STATE_COMMAND;
-  write_str(s,"\nINFO:You are talking to servald\n");
+  c->input_offset = c->input_length = 0;
+  c->held_back = 0;
+  c->output_offset = c->output_length = 0;
   INFOF("Got %d clients", monitor_socket_count);
   watch(&c->alarm);  
+  monitor_write_str(c, "\nINFO:You are talking to servald\n");
   
   return;
   
@@ -443,7 +582,7 @@ static int monitor_set(const struct cli_parsed *parsed, struct cli_context *cont
 
   char msg[1024];
   snprintf(msg,sizeof(msg),"\nMONITORSTATUS:%d\n",c->flags);
-  write_str(c->alarm.poll.fd,msg);
+  monitor_write_str(c,msg);
   
   return 0;
 }
@@ -471,7 +610,7 @@ static int monitor_clear(const struct cli_parsed *parsed, struct cli_context *co
   
   char msg[1024];
   snprintf(msg,sizeof(msg),"\nINFO:%d\n",c->flags);
-  write_str(c->alarm.poll.fd,msg);
+  monitor_write_str(c,msg);
   
   return 0;
 }
@@ -623,7 +762,7 @@ static int monitor_help(const struct cli_parsed *parsed, struct cli_context *con
   strbuf b = strbuf_alloca(16384);
   strbuf_puts(b, "\nINFO:Usage\n");
   cli_usage_parsed(parsed, XPRINTF_STRBUF(b));
-  (void)write_all(c->alarm.poll.fd, strbuf_str(b), strbuf_len(b));
+  monitor_write(c, strbuf_str(b), strbuf_len(b));
   return 0;
 }
 
@@ -656,8 +795,7 @@ int monitor_tell_clients(char *msg, int msglen, int mask)
   IN();
   for(i=monitor_socket_count -1;i>=0;i--) {
     if (monitor_sockets[i].flags & mask) {
-      // DEBUG("Writing AUDIOPACKET to client");
-      if ( write_all_nonblock(monitor_sockets[i].alarm.poll.fd, msg, msglen) == -1) {
+      if (monitor_write(&monitor_sockets[i], msg, msglen) == -1) {
 	INFOF("Tear down monitor client #%d due to write error", i);
 	monitor_close(&monitor_sockets[i]);
       }
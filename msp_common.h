@@ -6,9 +6,28 @@
 #define FLAG_ACK (1<<1)
 #define FLAG_FIRST (1<<2)
 #define FLAG_STOP (1<<3)
+// the sender understands selective acknowledgements
+#define FLAG_SACK_OK (1<<4)
+// a selective acknowledgement bitmap follows the ack sequence number
+#define FLAG_SACK (1<<5)
+// the sender's receive window follows the ack sequence number and any selective ack bitmap
+#define FLAG_WINDOW (1<<6)
 #define RETRANSMIT_TIME 1500
 #define HANDLER_KEEPALIVE 1000
 
+// Retransmission timeout bounds, in ms.  RETRANSMIT_TIME is used until we have an RTT sample.
+#define MIN_RTO 200
+#define MAX_RTO 6000
+
+// Congestion window limits, in packets.  Losses on a mesh link are as likely to be radio noise as
+// congestion, so the window never shrinks below the fixed window that MSP used to have.  The
+// configured window is clamped well inside the range that compare_wrapped_uint16() can order.
+#define MIN_WINDOW 4
+#define MAX_WINDOW 1024
+
+// Number of later packets that must be selectively acknowledged before we assume a packet was lost
+#define DUPLICATE_THRESHOLD 3
+
 typedef uint16_t msp_state_t;
 
 struct msp_packet{
@@ -17,16 +36,22 @@ struct msp_packet{
   uint8_t flags;
   time_ms_t added;
   time_ms_t sent;
+  uint8_t transmissions;
+  uint8_t sacked;
+  uint8_t lost;
   size_t len;
   size_t offset;
   uint8_t payload[];
 };
 
-#define MAX_WINDOW_SIZE 4
 struct msp_window{
   unsigned packet_count;
   uint32_t base_rtt;
   uint32_t rtt;
+  // smoothed round trip time, variance and retransmission timeout (RFC 6298)
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t rto;
   uint16_t next_seq; // seq of next expected TX or RX packet.
   time_ms_t last_activity;
   time_ms_t last_packet;
@@ -37,6 +62,18 @@ struct msp_stream{
   msp_state_t state;
   struct msp_window tx;
   struct msp_window rx;
+  // maximum number of packets buffered in either direction
+  unsigned window;
+  // number of packets from the first unacknowledged one that the remote party will accept
+  unsigned remote_window;
+  // congestion window & slow start threshold, in packets
+  unsigned cwnd;
+  unsigned ssthresh;
+  unsigned cwnd_acked;
+  // after a loss, don't reduce the window again until this sequence number has been acked
+  uint16_t recover;
+  uint8_t recovering;
+  uint8_t sack_ok;
   uint16_t previous_ack;
   time_ms_t next_ack;
   time_ms_t timeout;
@@ -48,6 +85,16 @@ static void msp_stream_init(struct msp_stream *stream)
   stream->state = MSP_STATE_UNINITIALISED;
   // TODO set base rtt to ensure that we send the first packet a few times before giving up
   stream->tx.base_rtt = stream->tx.rtt = 0xFFFFFFFF;
+  stream->tx.rto = RETRANSMIT_TIME;
+  stream->window = config.msp.window;
+  if (stream->window < MIN_WINDOW)
+    stream->window = MIN_WINDOW;
+  if (stream->window > MAX_WINDOW)
+    stream->window = MAX_WINDOW;
+  // until the remote party advertises its window, assume the fixed window of older versions
+  stream->remote_window = MIN_WINDOW;
+  stream->cwnd = MIN_WINDOW;
+  stream->ssthresh = stream->window;
   stream->tx.last_activity = TIME_MS_NEVER_HAS;
   stream->tx.last_packet = TIME_MS_NEVER_HAS;
   stream->rx.last_activity = TIME_MS_NEVER_HAS;
@@ -69,16 +116,37 @@ static void free_all_packets(struct msp_window *window)
   window->packet_count=0;
 }
 
-static void free_acked_packets(struct msp_window *window, uint16_t seq)
+static void msp_rtt_sample(struct msp_window *window, uint32_t rtt)
+{
+  if (!window->srtt){
+    window->srtt = rtt;
+    window->rttvar = rtt / 2;
+  }else{
+    uint32_t delta = window->srtt > rtt ? window->srtt - rtt : rtt - window->srtt;
+    window->rttvar = (3 * window->rttvar + delta) / 4;
+    window->srtt = (7 * window->srtt + rtt) / 8;
+  }
+  // allow at least half as long again as the smoothed RTT, since queueing delay grows with the window
+  window->rto = window->srtt + (4 * window->rttvar > window->srtt / 2 ? 4 * window->rttvar : window->srtt / 2);
+  if (window->rto < MIN_RTO)
+    window->rto = MIN_RTO;
+  if (window->rto > MAX_RTO)
+    window->rto = MAX_RTO;
+}
+
+// release all packets up to and including seq, returning the number of packets released
+static unsigned free_acked_packets(struct msp_window *window, uint16_t seq)
 {
   if (!window->_head)
-    return;
+    return 0;
   struct msp_packet *p = window->_head;
   uint32_t rtt=0xFFFFFFFF, rtt_max=0;
   time_ms_t now = gettime_ms();
+  unsigned count=0;
 
   while(p && compare_wrapped_uint16(p->seq, seq)<=0){
-    if (p->sent!=TIME_MS_NEVER_HAS){
+    // Only packets that were sent once give an unambiguous RTT sample
+    if (p->sent!=TIME_MS_NEVER_HAS && p->transmissions==1){
       uint32_t this_rtt=now - p->sent;
       if (rtt > this_rtt)
 	rtt = this_rtt;
@@ -89,6 +157,7 @@ static void free_acked_packets(struct msp_window *window, uint16_t seq)
     p=p->_next;
     free(free_me);
     window->packet_count--;
+    count++;
   }
   window->_head = p;
   if (rtt!=0xFFFFFFFF){
@@ -97,10 +166,12 @@ static void free_acked_packets(struct msp_window *window, uint16_t seq)
     window->rtt = rtt;
     if (window->base_rtt > rtt)
       window->base_rtt = rtt;
-    DEBUGF(msp, "ACK %x, RTT %u-%u, base %u", seq, rtt, rtt_max, window->base_rtt);
+    msp_rtt_sample(window, rtt);
+    DEBUGF(msp, "ACK %x, RTT %u-%u, base %u, srtt %u, rto %u", seq, rtt, rtt_max, window->base_rtt, window->srtt, window->rto);
   }
   if (!p)
     window->_tail = NULL;
+  return count;
 }
 
 static int add_packet(struct msp_window *window, uint16_t seq, uint8_t flags, const uint8_t *payload, size_t len)
@@ -155,9 +226,14 @@ static int add_packet(struct msp_window *window, uint16_t seq, uint8_t flags, co
   return 1;
 }
 
+/* Write the ack header into header[], which must have room for MSP_MAX_PREAMBLE_SIZE bytes, and
+ * return its length.  If the remote party understands them, the ack carries a bitmap of the
+ * packets that have arrived beyond the next one we are waiting for, and our receive window.
+ */
 static size_t msp_write_ack_header(uint8_t *header, struct msp_stream *stream)
 {
-  header[0]=0;
+  size_t len = 3;
+  header[0]=FLAG_SACK_OK;
   // if we haven't heard a sequence number, we can't ack data
   // (but we can indicate the existence of the connection)
   if (stream->state & MSP_STATE_RECEIVED_DATA)
@@ -169,26 +245,159 @@ static size_t msp_write_ack_header(uint8_t *header, struct msp_stream *stream)
     
   write_uint16(&header[1], stream->rx.next_seq -1);
   
+  if ((header[0] & FLAG_ACK) && stream->sack_ok){
+    uint32_t sack = 0;
+    struct msp_packet *p = stream->rx._head;
+    while(p){
+      uint16_t offset = p->seq - stream->rx.next_seq;
+      if (offset < MSP_SACK_SIZE * 8)
+	sack |= 1u << offset;
+      p = p->_next;
+    }
+    header[0]|=FLAG_SACK;
+    write_uint32(&header[3], sack);
+    len += MSP_SACK_SIZE;
+  }
+  
+  if (stream->sack_ok){
+    header[0]|=FLAG_WINDOW;
+    write_uint16(&header[len], stream->window);
+    len += MSP_WINDOW_SIZE;
+  }
+  
   stream->previous_ack = stream->rx.next_seq -1;
   stream->tx.last_activity = gettime_ms();
   stream->next_ack = stream->tx.last_activity + RETRANSMIT_TIME;
   
   DEBUGF(msp, "Sending packet flags %02x (acked %02x)", 
     header[0], stream->rx.next_seq -1);
-  return 3;
+  return len;
 }
 
 static size_t msp_write_preamble(uint8_t *header, struct msp_stream *stream, struct msp_packet *packet)
 {
-  msp_write_ack_header(header, stream);
+  size_t len = msp_write_ack_header(header, stream);
   header[0]|=packet->flags;
   
-  write_uint16(&header[3], packet->seq);
+  write_uint16(&header[len], packet->seq);
   
   DEBUGF(msp, "With packet flags %02x seq %02x len %zd", 
     header[0], packet->seq, packet->len);
   packet->sent = stream->tx.last_packet = stream->tx.last_activity;
-  return MSP_PAYLOAD_PREAMBLE_SIZE;
+  if (packet->transmissions < 0xFF)
+    packet->transmissions++;
+  packet->lost = 0;
+  return len + 2;
+}
+
+// A packet has been lost, halve the congestion window, at most once per window of data.
+static void msp_congestion_event(struct msp_stream *stream)
+{
+  if (stream->recovering)
+    return;
+  stream->ssthresh = stream->cwnd / 2;
+  if (stream->ssthresh < MIN_WINDOW)
+    stream->ssthresh = MIN_WINDOW;
+  stream->cwnd = stream->ssthresh;
+  stream->cwnd_acked = 0;
+  stream->recovering = 1;
+  stream->recover = stream->tx.next_seq - 1;
+  DEBUGF(msp, "Packet loss, cwnd %u", stream->cwnd);
+}
+
+// Open the congestion window as packets are acknowledged; exponentially until we reach the slow
+// start threshold, then by one packet per window.
+static void msp_window_acked(struct msp_stream *stream, uint16_t ack_seq, unsigned count)
+{
+  if (stream->recovering){
+    if (compare_wrapped_uint16(ack_seq, stream->recover) < 0)
+      return;
+    stream->recovering = 0;
+  }
+  if (stream->cwnd < stream->ssthresh){
+    stream->cwnd += count;
+  }else{
+    stream->cwnd_acked += count;
+    if (stream->cwnd_acked >= stream->cwnd){
+      stream->cwnd_acked -= stream->cwnd;
+      stream->cwnd++;
+    }
+  }
+  unsigned limit = stream->window < stream->remote_window ? stream->window : stream->remote_window;
+  if (stream->cwnd > limit)
+    stream->cwnd = limit;
+}
+
+/* Mark packets that the remote party has already received beyond the first missing packet.  An
+ * earlier packet is assumed lost once enough packets sent after it have arrived, or once any have
+ * arrived and it is overdue by a quarter of the smoothed RTT, which allows for some reordering.
+ */
+static void msp_process_sack(struct msp_stream *stream, uint16_t ack_seq, uint32_t sack, time_ms_t now)
+{
+  struct msp_packet *p = stream->tx._head;
+  uint16_t first = ack_seq + 1;
+  for (; p && (uint16_t)(p->seq - first) < MSP_SACK_SIZE * 8; p = p->_next){
+    if (sack & (1u << (uint16_t)(p->seq - first)))
+      p->sacked = 1;
+  }
+  time_ms_t overdue = now - stream->tx.srtt - stream->tx.srtt / 4;
+  for (p = stream->tx._head; p && (uint16_t)(p->seq - first) < MSP_SACK_SIZE * 8; p = p->_next){
+    if (p->sacked || p->lost || p->sent == TIME_MS_NEVER_HAS)
+      continue;
+    // count later packets that arrived even though they were sent after this one
+    unsigned overtaken = 0;
+    struct msp_packet *q;
+    for (q = p->_next; q && overtaken < DUPLICATE_THRESHOLD; q = q->_next)
+      if (q->sacked && q->sent >= p->sent)
+	overtaken++;
+    if (overtaken >= DUPLICATE_THRESHOLD || (overtaken && p->sent <= overdue)){
+      DEBUGF(msp, "Packet %02x lost", p->seq);
+      p->lost = 1;
+      msp_congestion_event(stream);
+    }
+  }
+}
+
+/* Should this packet be (re)transmitted now?  Call for each packet in the transmit window in
+ * order, with *in_flight initially zero.  Packets that have been sent and not yet timed out
+ * count against the congestion window; the first unacknowledged packet may always be
+ * retransmitted once it has timed out.  Packets beyond the remote party's receive window would be
+ * dropped, so they wait.
+ */
+static int msp_packet_due(struct msp_stream *stream, struct msp_packet *packet, time_ms_t now, unsigned *in_flight)
+{
+  if (packet->sacked)
+    return 0;
+  if ((uint16_t)(packet->seq - stream->tx._head->seq) >= stream->remote_window)
+    return 0;
+  if (packet->sent != TIME_MS_NEVER_HAS && !packet->lost && packet->sent + stream->tx.rto > now){
+    (*in_flight)++;
+    return 0;
+  }
+  if (packet->sent != TIME_MS_NEVER_HAS && !packet->lost && packet == stream->tx._head){
+    // retransmission timeout, back off and start again from the smallest window
+    stream->tx.rto *= 2;
+    if (stream->tx.rto > MAX_RTO)
+      stream->tx.rto = MAX_RTO;
+    msp_congestion_event(stream);
+    stream->cwnd = MIN_WINDOW;
+    DEBUGF(msp, "Retransmit timeout %02x, rto %u", packet->seq, stream->tx.rto);
+    return 1;
+  }
+  if (packet != stream->tx._head && *in_flight >= stream->cwnd)
+    return 0;
+  if (packet->sent != TIME_MS_NEVER_HAS && !packet->lost)
+    msp_congestion_event(stream);
+  (*in_flight)++;
+  return 1;
+}
+
+// When do we next need to look at this packet?
+static time_ms_t msp_packet_timeout(const struct msp_stream *stream, const struct msp_packet *packet)
+{
+  if (packet->sacked || packet->sent == TIME_MS_NEVER_HAS)
+    return TIME_MS_NEVER_WILL;
+  return packet->sent + stream->tx.rto;
 }
 
 static ssize_t msp_stream_send(struct msp_stream *stream, const uint8_t *payload, size_t len)
@@ -196,16 +405,16 @@ static ssize_t msp_stream_send(struct msp_stream *stream, const uint8_t *payload
   assert(!(stream->state & MSP_STATE_LISTENING));
   assert((stream->state & MSP_STATE_SHUTDOWN_LOCAL)==0);
   
-  if ((stream->state & MSP_STATE_CLOSED) || stream->tx.packet_count > MAX_WINDOW_SIZE)
+  if ((stream->state & MSP_STATE_CLOSED) || stream->tx.packet_count > stream->window)
     return -1;
   if (add_packet(&stream->tx, stream->tx.next_seq, 0, payload, len)==-1)
     return -1;
   
   stream->tx.next_seq++;
-  if (stream->tx.packet_count>=MAX_WINDOW_SIZE)
+  if (stream->tx.packet_count>=stream->window)
     stream->state&=~MSP_STATE_DATAOUT;
-  // make sure we attempt to process packets from this sock soon
-  // TODO calculate based on congestion window
+  // make sure we attempt to process packets from this sock soon,
+  // the congestion window decides whether this packet can be sent yet
   stream->next_action = gettime_ms();
   
   return len;
@@ -309,37 +518,63 @@ static int msp_process_packet(struct msp_stream *stream, const uint8_t *payload,
     return 0;
   }
   
-  if (len<3)
+  size_t ack_len = 3;
+  if (flags & FLAG_SACK)
+    ack_len += MSP_SACK_SIZE;
+  if (flags & FLAG_WINDOW)
+    ack_len += MSP_WINDOW_SIZE;
+  if (len<ack_len)
     return 0;
   
+  if (flags & FLAG_SACK_OK)
+    stream->sack_ok = 1;
+  
+  if (flags & FLAG_WINDOW){
+    unsigned remote_window = read_uint16(&payload[ack_len - MSP_WINDOW_SIZE]);
+    if (remote_window < 1)
+      remote_window = 1;
+    if (remote_window > MAX_WINDOW)
+      remote_window = MAX_WINDOW;
+    if (remote_window != stream->remote_window){
+      DEBUGF(msp, "Remote receive window %u", remote_window);
+      stream->remote_window = remote_window;
+    }
+  }
+  
   if (flags & FLAG_ACK){
     uint16_t ack_seq = read_uint16(&payload[1]);
     // release acknowledged packets
-    free_acked_packets(&stream->tx, ack_seq);
-    
-    // TODO if their ack seq has not advanced, we may need to hurry up and retransmit a packet
+    unsigned acked = free_acked_packets(&stream->tx, ack_seq);
+    if (acked)
+      msp_window_acked(stream, ack_seq, acked);
+    if (flags & FLAG_SACK)
+      msp_process_sack(stream, ack_seq, read_uint32(&payload[3]), now);
   }
   
   // Do we have space for more data now?
-  if (stream->tx.packet_count < MAX_WINDOW_SIZE 
+  if (stream->tx.packet_count < stream->window 
     && !(stream->state & MSP_STATE_SHUTDOWN_LOCAL)
     && !(stream->state & MSP_STATE_CLOSED)){
     stream->state|=MSP_STATE_DATAOUT;
   }
   
   // make sure we attempt to process packets from this sock soon
-  // TODO calculate based on congestion window
   stream->next_action = now;
   
-  if (len<MSP_PAYLOAD_PREAMBLE_SIZE)
+  if (len<ack_len + 2)
     return 0;
   
   stream->state |= MSP_STATE_RECEIVED_DATA;
-  uint16_t seq = read_uint16(&payload[3]);
+  uint16_t seq = read_uint16(&payload[ack_len]);
   stream->rx.last_packet = stream->rx.last_activity;
+  // ack immediately, so that the sender learns about holes and duplicates quickly
+  stream->next_ack = now;
   if (compare_wrapped_uint16(seq, stream->rx.next_seq)>=0){
-    if (add_packet(&stream->rx, seq, flags, &payload[MSP_PAYLOAD_PREAMBLE_SIZE], len - MSP_PAYLOAD_PREAMBLE_SIZE)==1)
-      stream->next_ack = now;
+    if (compare_wrapped_uint16(seq, stream->rx.next_seq + stream->window)>=0){
+      DEBUGF(msp, "Ignore packet %02x beyond receive window", seq);
+      return 0;
+    }
+    add_packet(&stream->rx, seq, flags, &payload[ack_len + 2], len - ack_len - 2);
   }
   
   return 0;
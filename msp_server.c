@@ -127,9 +127,10 @@ static void send_frame(struct msp_server_state *state, struct overlay_buffer *pa
 static void send_packet(struct msp_server_state *state, struct msp_packet *packet)
 {
   struct overlay_buffer *payload = ob_new();
-  uint8_t *msp_header = ob_append_space(payload, MSP_PAYLOAD_PREAMBLE_SIZE);
+  uint8_t msp_header[MSP_MAX_PREAMBLE_SIZE];
   size_t len = msp_write_preamble(msp_header, &state->stream, packet);
-  assert(len == MSP_PAYLOAD_PREAMBLE_SIZE);
+  assert(len <= MSP_MAX_PREAMBLE_SIZE);
+  ob_append_bytes(payload, msp_header, len);
   if (packet->len)
     ob_append_bytes(payload, packet->payload, packet->len);
   ob_flip(payload);
@@ -139,8 +140,9 @@ static void send_packet(struct msp_server_state *state, struct msp_packet *packe
 static void send_ack(struct msp_server_state *state)
 {
   struct overlay_buffer *payload = ob_new();
-  uint8_t *msp_header = ob_append_space(payload, 3);
-  msp_write_ack_header(msp_header, &state->stream);
+  uint8_t msp_header[MSP_MAX_PREAMBLE_SIZE];
+  size_t len = msp_write_ack_header(msp_header, &state->stream);
+  ob_append_bytes(payload, msp_header, len);
   ob_flip(payload);
   send_frame(state, payload);
 }
@@ -154,15 +156,17 @@ struct msp_server_state * msp_process_next(struct msp_iterator *iterator)
     if (ptr){
       struct msp_packet *packet = ptr->stream.tx._head;
       time_ms_t next_packet = TIME_MS_NEVER_WILL;
+      unsigned in_flight = 0;
       
       ptr->stream.next_action = ptr->stream.timeout;
       while(packet){
-	if (packet->sent + RETRANSMIT_TIME <= now)
+	if (msp_packet_due(&ptr->stream, packet, now, &in_flight))
 	  // (re)transmit this packet
 	  send_packet(ptr, packet);
 	
-	if (next_packet > packet->sent + RETRANSMIT_TIME)
-	  next_packet = packet->sent + RETRANSMIT_TIME;
+	time_ms_t timeout = msp_packet_timeout(&ptr->stream, packet);
+	if (next_packet > timeout)
+	  next_packet = timeout;
 	  
 	packet=packet->_next;
       }
@@ -102,6 +102,23 @@ ssize_t _writev_all(int fd, const struct iovec *iov, int iovcnt, struct __source
   return written;
 }
 
+ssize_t _writev_nonblock(int fd, const struct iovec *iov, int iovcnt, struct __sourceloc __whence)
+{
+  ssize_t written = writev(fd, iov, iovcnt);
+  if (written == -1) {
+    switch (errno) {
+      case EINTR:
+      case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+	return 0;
+    }
+    return WHYF_perror("writev_nonblock: writev(%d,%s)", fd, alloca_iovec(iov, iovcnt));
+  }
+  return written;
+}
+
 ssize_t _write_nonblock(int fd, const void *buf, size_t len, struct __sourceloc __whence)
 {
   ssize_t written = write(fd, buf, len);
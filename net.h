@@ -53,6 +53,7 @@ struct in_addr hton_in_addr(in_addr_t);
 #define read_nonblock(fd,buf,len)       (_read_nonblock(fd, buf, len, __WHENCE__))
 #define write_all(fd,buf,len)           (_write_all(fd, buf, len, __WHENCE__))
 #define writev_all(fd,iov,cnt)          (_writev_all(fd, (iov), (cnt), __WHENCE__))
+#define writev_nonblock(fd,iov,cnt)     (_writev_nonblock(fd, (iov), (cnt), __WHENCE__))
 #define write_nonblock(fd,buf,len)      (_write_nonblock(fd, buf, len, __WHENCE__))
 #define write_all_nonblock(fd,buf,len)  (_write_all_nonblock(fd, buf, len, __WHENCE__))
 #define write_str(fd,str)               (_write_str(fd, str, __WHENCE__))
@@ -65,6 +66,7 @@ ssize_t _write_all(int fd, const void *buf, size_t len, struct __sourceloc __whe
 ssize_t _write_nonblock(int fd, const void *buf, size_t len, struct __sourceloc __whence);
 ssize_t _write_all_nonblock(int fd, const void *buf, size_t len, struct __sourceloc __whence);
 ssize_t _writev_all(int fd, const struct iovec *iov, int iovcnt, struct __sourceloc __whence);
+ssize_t _writev_nonblock(int fd, const struct iovec *iov, int iovcnt, struct __sourceloc __whence);
 ssize_t _write_str(int fd, const char *str, struct __sourceloc __whence);
 ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc __whence);
 
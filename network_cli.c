@@ -33,6 +33,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "numeric_str.h"
 #include "uri.h"
 #include "overlay_buffer.h"
+#include "overlay_address.h"
+#include "crypto.h"
 
 DEFINE_FEATURE(cli_network);
 
@@ -610,6 +612,101 @@ end:
   return ret;
 }
 
+DEFINE_CMD(app_stats_print, 0,
+  "Print the running daemon's function timing statistics, in nanoseconds",
+  "stats","print");
+static int app_stats_print(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  int mdp_sockfd;
+  DEBUG_cli_parsed(verbose, parsed);
+
+  if ((mdp_sockfd = mdp_socket()) < 0)
+    return WHY("Cannot create MDP socket");
+
+  struct mdp_header mdp_header;
+  bzero(&mdp_header, sizeof mdp_header);
+
+  mdp_header.local.sid = SID_INTERNAL;
+  mdp_header.local.port = MDP_STATS;
+  mdp_header.remote.sid = SID_ANY;
+  mdp_header.remote.port = MDP_STATS;
+
+  int ret=-1;
+
+  if (mdp_send(mdp_sockfd, &mdp_header, NULL, 0))
+    goto end;
+
+  const char *names[]={
+    "name",
+    "calls",
+    "total",
+    "max",
+    "p50",
+    "p99",
+    "p999"
+  };
+  size_t rowcount=0;
+  int started=0;
+  time_ms_t timeout = gettime_ms() + 5000;
+
+  uint8_t payload[MDP_MTU];
+  struct overlay_buffer *buff = ob_static(payload, sizeof payload);
+  while(1){
+    ssize_t recv_len = mdp_poll_recv(mdp_sockfd, gettime_ms()+1000, &mdp_header, payload, sizeof payload);
+    if (recv_len == -1)
+      break;
+    if (mdp_header.flags & MDP_FLAG_ERROR){
+      WHY("Daemon could not send stats");
+      break;
+    }
+    if (recv_len>0){
+      ob_clear(buff);
+      ob_limitsize(buff, recv_len);
+      if (!started){
+	// the first reply is the time spent running and idle
+	uint64_t uptime = ob_get_packed_ui64(buff);
+	uint64_t idle = ob_get_packed_ui64(buff);
+	if (ob_overrun(buff))
+	  break;
+	cli_field_name(context, "uptime", ":");
+	cli_put_long(context, uptime, "\n");
+	cli_field_name(context, "idle", ":");
+	cli_put_long(context, idle, "\n");
+	cli_field_name(context, "busy", ":");
+	cli_put_long(context, uptime - idle, "\n");
+	cli_start_table(context, NELS(names), names);
+	started=1;
+      }else{
+	const char *name = ob_get_str_ptr(buff);
+	uint64_t values[NELS(names) - 1];
+	unsigned i;
+	for (i=0;i<NELS(values);i++)
+	  values[i] = ob_get_packed_ui64(buff);
+	if (!name || ob_overrun(buff))
+	  break;
+	cli_put_string(context, name, ":");
+	for (i=0;i<NELS(values);i++)
+	  cli_put_long(context, values[i], i == NELS(values) - 1 ? "\n" : ":");
+	rowcount++;
+      }
+    }
+    if ((mdp_header.flags & MDP_FLAG_CLOSE) || gettime_ms() > timeout){
+      if (started)
+	ret = 0;
+      break;
+    }
+  }
+  ob_free(buff);
+  if (started)
+    cli_end_table(context, rowcount);
+  else
+    WHY("No stats received from the daemon");
+
+end:
+  mdp_close(mdp_sockfd);
+  return ret;
+}
+
 DEFINE_CMD(app_network_scan, 0,
   "Scan the network for serval peers. If no argument is supplied, all local addresses will be scanned.",
   "scan","[<address>]");
@@ -941,3 +1038,152 @@ static int app_reverse_lookup(const struct cli_parsed *parsed, struct cli_contex
   overlay_mdp_client_close(mdp_sockfd);
   return 1;
 }
+
+/* Each kind of MDP frame protection, as a sender would seal a frame and its recipient
+   would open it again. */
+struct frame_bench {
+  const char *name;
+  int (*seal)(struct frame_bench *b, uint8_t *frame, const uint8_t *payload, size_t len);
+  int (*open)(struct frame_bench *b, uint8_t *payload, const uint8_t *frame, size_t len);
+  size_t overhead;
+  uint8_t nonce[crypto_box_NONCEBYTES];
+  uint8_t nm[crypto_box_BEFORENMBYTES];
+  uint8_t session_key[SESSION_KEY_BYTES];
+  sign_keypair_t sign;
+};
+
+static int bench_plain_seal(struct frame_bench *UNUSED(b), uint8_t *frame, const uint8_t *payload, size_t len)
+{
+  bcopy(payload, frame, len);
+  return 0;
+}
+
+static int bench_plain_open(struct frame_bench *UNUSED(b), uint8_t *payload, const uint8_t *frame, size_t len)
+{
+  bcopy(frame, payload, len);
+  return 0;
+}
+
+static int bench_signed_seal(struct frame_bench *b, uint8_t *frame, const uint8_t *payload, size_t len)
+{
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  bcopy(payload, frame, len);
+  crypto_hash_sha512(hash, frame, len);
+  return crypto_sign_detached(&frame[len], NULL, hash, sizeof hash, b->sign.binary);
+}
+
+static int bench_signed_open(struct frame_bench *b, uint8_t *payload, const uint8_t *frame, size_t len)
+{
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  crypto_hash_sha512(hash, frame, len);
+  if (crypto_sign_verify_detached(&frame[len], hash, sizeof hash, b->sign.public_key.binary))
+    return -1;
+  bcopy(frame, payload, len);
+  return 0;
+}
+
+static int bench_box_seal(struct frame_bench *b, uint8_t *frame, const uint8_t *payload, size_t len)
+{
+  b->nonce[0]++;
+  bcopy(b->nonce, frame, crypto_box_NONCEBYTES);
+  return crypto_box_easy_afternm(&frame[crypto_box_NONCEBYTES], payload, len, frame, b->nm);
+}
+
+static int bench_box_open(struct frame_bench *b, uint8_t *payload, const uint8_t *frame, size_t len)
+{
+  return crypto_box_open_easy_afternm(payload, &frame[crypto_box_NONCEBYTES], len + crypto_box_MACBYTES, frame, b->nm);
+}
+
+static int bench_session_seal(struct frame_bench *b, uint8_t *frame, const uint8_t *payload, size_t len)
+{
+  b->nonce[0]++;
+  frame[0] = 0x80;
+  bcopy(b->nonce, &frame[1], SESSION_NONCE_BYTES);
+  return crypto_session_seal(&frame[1 + SESSION_NONCE_BYTES], payload, len, frame, 1, &frame[1], b->session_key);
+}
+
+static int bench_session_open(struct frame_bench *b, uint8_t *payload, const uint8_t *frame, size_t len)
+{
+  return crypto_session_open(payload, &frame[1 + SESSION_NONCE_BYTES], len + SESSION_MAC_BYTES, frame, 1, &frame[1], b->session_key);
+}
+
+static int bench_session_mac_seal(struct frame_bench *b, uint8_t *frame, const uint8_t *payload, size_t len)
+{
+  size_t ad_len = 1 + SESSION_NONCE_BYTES + len;
+  b->nonce[0]++;
+  frame[0] = 0xC0;
+  bcopy(b->nonce, &frame[1], SESSION_NONCE_BYTES);
+  bcopy(payload, &frame[1 + SESSION_NONCE_BYTES], len);
+  return crypto_session_seal(&frame[ad_len], NULL, 0, frame, ad_len, &frame[1], b->session_key);
+}
+
+static int bench_session_mac_open(struct frame_bench *b, uint8_t *payload, const uint8_t *frame, size_t len)
+{
+  size_t ad_len = 1 + SESSION_NONCE_BYTES + len;
+  if (crypto_session_open(NULL, &frame[ad_len], SESSION_MAC_BYTES, frame, ad_len, &frame[1], b->session_key))
+    return -1;
+  bcopy(&frame[1 + SESSION_NONCE_BYTES], payload, len);
+  return 0;
+}
+
+DEFINE_CMD(app_mdp_crypt_test, 0,
+   "Run MDP frame encryption and signing speed test",
+   "test","mdp","crypt","[<size>]");
+static int app_mdp_crypt_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *size_text;
+  if (cli_arg(parsed, "size", &size_text, cli_uint, "256") == -1)
+    return -1;
+  size_t len = atoi(size_text);
+  if (len < 1 || len > 1024)
+    return WHY("Frame size must be between 1 and 1024 bytes");
+
+  struct frame_bench benches[] = {
+    {.name = "plaintext",         .seal = bench_plain_seal,       .open = bench_plain_open,       .overhead = 0},
+    {.name = "signed",            .seal = bench_signed_seal,      .open = bench_signed_open,      .overhead = SIGNATURE_BYTES},
+    {.name = "encrypted",         .seal = bench_box_seal,         .open = bench_box_open,         .overhead = crypto_box_NONCEBYTES + crypto_box_MACBYTES},
+    {.name = "session signed",    .seal = bench_session_mac_seal, .open = bench_session_mac_open, .overhead = 1 + SESSION_NONCE_BYTES + SESSION_MAC_BYTES},
+    {.name = "session encrypted", .seal = bench_session_seal,     .open = bench_session_open,     .overhead = 1 + SESSION_NONCE_BYTES + SESSION_MAC_BYTES},
+  };
+
+  // the keys of a sender and recipient
+  sid_t sender_pk, recipient_pk;
+  uint8_t sender_sk[crypto_box_SECRETKEYBYTES], recipient_sk[crypto_box_SECRETKEYBYTES];
+  crypto_box_keypair(sender_pk.binary, sender_sk);
+  crypto_box_keypair(recipient_pk.binary, recipient_sk);
+
+  uint8_t payload[1024], frame[1024 + 128], opened[1024];
+  randombytes_buf(payload, len);
+
+  cli_printf(context, "Benchmarking %zu byte MDP frames:\n", len);
+  unsigned i;
+  for (i = 0; i < NELS(benches); i++){
+    struct frame_bench *b = &benches[i];
+    randombytes_buf(b->nonce, sizeof b->nonce);
+    b->nonce[0] &= 0x7f;
+    if (crypto_box_beforenm(b->nm, recipient_pk.binary, sender_sk)
+      || crypto_session_key(b->session_key, b->nm, &sender_pk, &recipient_pk) == -1
+      || crypto_sign_keypair(b->sign.public_key.binary, b->sign.binary))
+      return WHY("Failed to generate keys");
+
+    // seal and open frames for a fixed time
+    uint64_t frames = 0;
+    time_ms_t start = gettime_ms();
+    time_ms_t end;
+    do {
+      unsigned j;
+      for (j = 0; j < 16; j++, frames++){
+	if (b->seal(b, frame, payload, len))
+	  return WHYF("Failed to seal %s frame", b->name);
+	if (b->open(b, opened, frame, len) || memcmp(opened, payload, len) != 0)
+	  return WHYF("Failed to open %s frame", b->name);
+      }
+      end = gettime_ms();
+    } while (end - start < 200);
+
+    cli_printf(context, "%s - %"PRIu64" frames/sec, %zu bytes overhead\n",
+      b->name, frames * 1000 / (end - start), b->overhead);
+  }
+  return 0;
+}
@@ -167,3 +167,18 @@ int tree_walk_prefix(struct tree_root *root, const uint8_t *binary, size_t bin_l
   uint8_t ignore;
   return walk(node, pos+1, &ignore, NULL, 0, callback, context);
 }
+
+static size_t node_memory(struct tree_node *node)
+{
+  size_t ret = 0;
+  unsigned i;
+  for (i=0;i<16;i++)
+    if (node->is_tree & (1<<i))
+      ret += sizeof(struct tree_node) + node_memory((struct tree_node *)node->tree_nodes[i]);
+  return ret;
+}
+
+size_t tree_memory(struct tree_root *root)
+{
+  return sizeof *root + node_memory(&root->_root_node);
+}
@@ -71,4 +71,7 @@ int tree_walk(struct tree_root *root, const uint8_t *binary, size_t bin_length,
 // walk the tree where nodes match the prefix binary / bin_length
 int tree_walk_prefix(struct tree_root *root, const uint8_t *binary, size_t bin_length, walk_callback callback, void *context);
 
+// bytes of memory used by the tree itself, not counting the records
+size_t tree_memory(struct tree_root *root);
+
 #endif // __SERVAL_DNA__NIBBLE_TREE_H
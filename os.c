@@ -138,6 +138,14 @@ time_s_t gettime()
   return nowtv.tv_sec;
 }
 
+time_ns_t gettime_ns()
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    FATAL_perror("clock_gettime");
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
 // Returns sleep time remaining.
 time_ms_t sleep_ms(time_ms_t milliseconds)
 {
@@ -70,6 +70,14 @@ typedef uint32_t time_s_t;
 
 time_ms_t gettime_ms();
 time_s_t gettime();
+
+/* Short intervals, like the time spent in a function, are measured in
+ * nanoseconds from an arbitrary starting point using a monotonic clock, so
+ * they are not affected by changes to the wall clock.
+ */
+typedef int64_t time_ns_t;
+#define PRItime_ns_t PRId64
+time_ns_t gettime_ns();
 time_ms_t sleep_ms(time_ms_t milliseconds);
 struct timeval time_ms_to_timeval(time_ms_t);
 
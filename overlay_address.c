@@ -40,9 +40,21 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "route_link.h"
 #include "commandline.h"
 
-#define MAX_BPIS 1024
-#define BPI_MASK 0x3ff
-static struct broadcast bpilist[MAX_BPIS];
+/* Recently seen BPIs are kept in a set-associative table. Each BPI hashes to a set of BPI_WAYS
+   entries, and a new BPI takes an empty or expired entry in its set, or else replaces the entry
+   seen longest ago. So colliding BPIs only evict each other when a whole set is busy. */
+#define BPI_WAYS 4
+struct bpi_entry {
+  struct broadcast id;
+  // zero if unused
+  time_ms_t seen;
+};
+static struct bpi_entry *bpi_table = NULL;
+static unsigned bpi_sets = 0;
+
+static uint64_t bpi_new = 0;
+static uint64_t bpi_duplicates = 0;
+static uint64_t bpi_evictions = 0;
 
 #define OA_CODE_SELF 0xff
 #define OA_CODE_PREVIOUS 0xfe
@@ -50,7 +62,7 @@ static struct broadcast bpilist[MAX_BPIS];
 #define OA_CODE_P2P_ME 0xfc
 #define OA_CODE_SIGNKEY 0xfb // full sign key of an identity, from which a SID can be derived
 
-static __thread struct tree_root root={.binary_length=SID_SIZE};
+static __thread struct prefix_index root={.binary_length=SID_SIZE};
 
 static __thread struct subscriber *my_subscriber=NULL;
 
@@ -94,6 +106,8 @@ static int free_node(void **record, void *UNUSED(context))
     FATAL("Can't free a subscriber that is being used by rhizome");
   if (subscriber->identity)
     FATAL("Can't free a subscriber that is unlocked in the keyring");
+  if (subscriber->fetch_stats)
+    free(subscriber->fetch_stats);
   free(subscriber);
   *record=NULL;
   return 0;
@@ -105,7 +119,7 @@ void free_subscribers()
   // who knows where subscriber ptr's may have leaked to.
   if (serverMode)
     FATAL("Freeing subscribers from a running daemon is not supported");
-  tree_walk(&root, NULL, 0, free_node, NULL);
+  prefix_index_walk(&root, NULL, 0, free_node, NULL);
 }
 
 /* Free the subscribers tree after every CLI command.
@@ -133,7 +147,7 @@ static void *create_subscriber(void *UNUSED(context), const uint8_t *binary, siz
 struct subscriber *find_subscriber(const uint8_t *sidp, int len, int create)
 {
   struct subscriber *result;
-  tree_find(&root, (void**)&result, sidp, len, create && len == SID_SIZE ? create_subscriber : NULL, NULL);
+  prefix_index_find(&root, (void**)&result, sidp, len, create && len == SID_SIZE ? create_subscriber : NULL, NULL);
   // ignore return code, just return the result
   return result;
 }
@@ -143,7 +157,7 @@ struct subscriber *find_subscriber(const uint8_t *sidp, int len, int create)
  */
 void enum_subscribers(struct subscriber *start, walk_callback callback, void *context)
 {
-  tree_walk(&root, start?start->sid.binary:NULL, SID_SIZE, callback, context);
+  prefix_index_walk(&root, start?start->sid.binary:NULL, SID_SIZE, callback, context);
 }
 
 // generate a new random broadcast address
@@ -154,6 +168,21 @@ int overlay_broadcast_generate_address(struct broadcast *addr)
   return 0;
 }
 
+// size the table for mdp.broadcast_filter_size entries, forgetting all BPIs if it changes
+static void bpi_table_resize()
+{
+  unsigned sets = 1;
+  while (sets * BPI_WAYS < config.mdp.broadcast_filter_size)
+    sets <<= 1;
+  if (sets == bpi_sets)
+    return;
+  free(bpi_table);
+  bpi_table = emalloc_zero(sizeof(struct bpi_entry) * BPI_WAYS * sets);
+  if (!bpi_table)
+    FATAL("Cannot allocate broadcast filter");
+  bpi_sets = sets;
+}
+
 // test if the broadcast address has been seen
 int overlay_broadcast_drop_check(struct broadcast *addr)
 {
@@ -162,24 +191,51 @@ int overlay_broadcast_drop_check(struct broadcast *addr)
      The occassional failure to supress a broadcast frame is not
      something we are going to worry about just yet.  For byzantine
      robustness it is however required. */
-  int bpi_index=0;
-  int i;
-  for(i=0;i<BROADCAST_LEN;i++)
-    {
-      bpi_index=((bpi_index<<3)&0xfff8)+((bpi_index>>13)&0x7);
-      bpi_index^=addr->id[i];
+  bpi_table_resize();
+
+  uint64_t h;
+  memcpy(&h, addr->id, sizeof h);
+  unsigned set = (unsigned)((h * 0x9E3779B97F4A7C15ULL) >> 32) & (bpi_sets - 1);
+  struct bpi_entry *entries = &bpi_table[set * BPI_WAYS];
+
+  time_ms_t now = gettime_ms();
+  struct bpi_entry *victim = NULL;
+  unsigned i;
+  for (i = 0; i < BPI_WAYS; i++){
+    struct bpi_entry *e = &entries[i];
+    if (e->seen && now - e->seen < config.mdp.broadcast_filter_ms){
+      if (memcmp(e->id.id, addr->id, BROADCAST_LEN) == 0){
+	// keep suppressing it while copies are still arriving
+	e->seen = now;
+	bpi_duplicates++;
+	DEBUGF(broadcasts, "BPI %s is a duplicate", alloca_tohex(addr->id, BROADCAST_LEN));
+	return 1; /* drop frame because we have seen this BPI recently */
+      }
+      if (!victim || (victim->seen && e->seen < victim->seen))
+	victim = e;
+    }else{
+      // forget expired entries
+      e->seen = 0;
+      if (!victim || victim->seen)
+	victim = e;
     }
-  bpi_index&=BPI_MASK;
-  
-  if (memcmp(bpilist[bpi_index].id, addr->id, BROADCAST_LEN)){
-    DEBUGF(broadcasts, "BPI %s is new", alloca_tohex(addr->id, BROADCAST_LEN));
-    bcopy(addr->id, bpilist[bpi_index].id, BROADCAST_LEN);
-    return 0; /* don't drop */
-  }else{
-    DEBUGF(broadcasts, "BPI %s is a duplicate", alloca_tohex(addr->id, BROADCAST_LEN));
-    return 1; /* drop frame because we have seen this BPI recently */
   }
+
+  if (victim->seen)
+    bpi_evictions++;
+  bpi_new++;
+  DEBUGF(broadcasts, "BPI %s is new", alloca_tohex(addr->id, BROADCAST_LEN));
+  victim->id = *addr;
+  victim->seen = now;
+  return 0; /* don't drop */
+}
+
+static void bpi_show_stats()
+{
+  INFOF("broadcast filter: %u entries, %"PRIu64" new, %"PRIu64" duplicates suppressed, %"PRIu64" evictions",
+    bpi_sets * BPI_WAYS, bpi_new, bpi_duplicates, bpi_evictions);
 }
+DEFINE_TRIGGER(show_stats, bpi_show_stats);
 
 void overlay_broadcast_append(struct overlay_buffer *b, struct broadcast *broadcast)
 {
@@ -235,10 +291,10 @@ static int add_explain_response(void **record, void *context)
   subscriber->last_explained = now;
 
   if (!response->please_explain){
-    if ((response->please_explain = emalloc_zero(sizeof(struct overlay_frame))) == NULL)
+    if ((response->please_explain = op_new()) == NULL)
       return 1; // stop walking
     if ((response->please_explain->payload = ob_new()) == NULL) {
-      free(response->please_explain);
+      op_free(response->please_explain);
       response->please_explain = NULL;
       return 1; // stop walking
     }
@@ -302,7 +358,7 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
       
       // add the abbreviation you told me about
       if (!context->please_explain){
-	context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	context->please_explain = op_new();
 	if ((context->please_explain->payload = ob_new()) == NULL)
 	  return -1;
 	ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -310,7 +366,7 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
       
       // And I'll tell you about any subscribers I know that match this abbreviation, 
       // so you don't try to use an abbreviation that's too short in future.
-      tree_walk_prefix(&root, id, len, add_explain_response, context);
+      prefix_index_walk_prefix(&root, id, len, add_explain_response, context);
       
       DEBUGF(subscriber, "Asking for explanation of %s", alloca_tohex(id, len));
       ob_append_byte(context->please_explain->payload, len);
@@ -377,7 +433,7 @@ int overlay_address_parse(struct decode_context *context, struct overlay_buffer
 	if ((context->flags & DECODE_FLAG_DONT_EXPLAIN) == 0){
 	  // add the abbreviation you told me about
 	  if (!context->please_explain){
-	    context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	    context->please_explain = op_new();
 	    if ((context->please_explain->payload = ob_new()) == NULL)
 	      return -1;
 	    ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -503,7 +559,7 @@ int process_explain(struct overlay_frame *frame)
 	uint8_t *sid = ob_get_bytes_ptr(b, len);
 	// reply to the sender with all subscribers that match this abbreviation
 	DEBUGF(subscriber, "Sending explain responses for %s", alloca_tohex(sid, len));
-	tree_walk_prefix(&root, sid, len, add_explain_response, &context);
+	prefix_index_walk_prefix(&root, sid, len, add_explain_response, &context);
       }
     }
   }
@@ -24,7 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval_types.h" // for sid_t
 #include "os.h" // for time_ms_t
 #include "socket.h"
-#include "nibble_tree.h"
+#include "prefix_index.h"
 
 // not reachable
 #define REACHABLE_NONE 0
@@ -68,6 +68,8 @@ struct subscriber{
   struct rhizome_sync *sync_state;
   struct rhizome_sync_keys *sync_keys_state;
   uint8_t sync_version;
+  // payload throughput observed by rhizome fetches
+  struct rhizome_fetch_peer_stats *fetch_stats;
 
   // result of routing calculations;
   int reachable;
@@ -93,6 +95,9 @@ struct subscriber{
   // should we send the full address once?
   uint8_t send_full:1;
 
+  // has this peer sent us frames sealed with a session key?
+  uint8_t session_frames:1;
+
   // private keys for local identities
   struct keyring_identity *identity;
 };
@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "mem.h"
 #include "str.h"
 #include "overlay_buffer.h"
+#include "fdqueue.h"
 
 /*
  When writing to a buffer, sizeLimit may place an upper bound on the amount of space to use
@@ -32,9 +33,45 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  In either case, functions that don't take an offset use and advance the position.
  */
 
+/*
+ Every packet parsed or built allocates a handful of buffer headers, and the
+ bytes behind them.  Keep free lists of headers, and of small and MTU sized
+ byte blocks, so that the packet path doesn't need to call malloc() once the
+ pools have warmed up.
+ */
+
+#define OB_POOL_MAX_FREE 256
+
+static struct mem_pool header_pool = MEM_POOL_INIT("overlay_buffer", sizeof(struct overlay_buffer), OB_POOL_MAX_FREE);
+static struct mem_pool block_pools[] = {
+  MEM_POOL_INIT("overlay_buffer 256 byte", 256, OB_POOL_MAX_FREE),
+  MEM_POOL_INIT("overlay_buffer 2048 byte", 2048, OB_POOL_MAX_FREE),
+};
+
+static void ob_show_pool_stats()
+{
+  mem_pool_log_stats(&header_pool);
+  unsigned i;
+  for (i = 0; i < NELS(block_pools); ++i)
+    mem_pool_log_stats(&block_pools[i]);
+}
+DEFINE_TRIGGER(show_stats, ob_show_pool_stats);
+
+static void ob_release_bytes(struct overlay_buffer *b)
+{
+  if (!b->allocated)
+    return;
+  if (b->pool)
+    mem_pool_free(&block_pools[b->pool - 1], b->allocated);
+  else
+    free(b->allocated);
+  b->allocated = NULL;
+  b->pool = 0;
+}
+
 struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = mem_pool_alloc_zero(&header_pool);
   DEBUGF(overlaybuffer, "ob_new() return %p", ret);
   if (ret == NULL)
     return NULL;
@@ -46,7 +83,7 @@ struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, size_t size)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = mem_pool_alloc_zero(&header_pool);
   DEBUGF(overlaybuffer, "ob_static(bytes=%p, size=%zu) return %p", bytes, size, ret);
   if (ret == NULL)
     return NULL;
@@ -66,7 +103,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
     WHY("Buffer isn't long enough to slice");
     return NULL;
   }
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = mem_pool_alloc_zero(&header_pool);
   DEBUGF(overlaybuffer, "ob_slice(b=%p, offset=%zu, length=%zu) return %p", b, offset, length, ret);
   if (ret == NULL)
       return NULL;
@@ -79,7 +116,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
 
 struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffer *b)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = mem_pool_alloc_zero(&header_pool);
   DEBUGF(overlaybuffer, "ob_dup(b=%p) return %p", b, ret);
   if (ret == NULL)
     return NULL;
@@ -105,9 +142,8 @@ void _ob_free(struct __sourceloc __whence, struct overlay_buffer *b)
 {
   assert(b != NULL);
   DEBUGF(overlaybuffer, "ob_free(b=%p)", b);
-  if (b->allocated)
-    free(b->allocated);
-  free(b);
+  ob_release_bytes(b);
+  mem_pool_free(&header_pool, b);
 }
 
 int _ob_checkpoint(struct __sourceloc __whence, struct overlay_buffer *b)
@@ -182,25 +218,39 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     return 0;
   }
   size_t newSize = b->position + bytes;
-  if (newSize<64) newSize=64;
-  if (newSize&63) newSize+=64-(newSize&63);
-  if (newSize>1024 && (newSize&1023))
-    newSize+=1024-(newSize&1023);
-  if (newSize>65536 && (newSize&65535))
-    newSize+=65536-(newSize&65535);
-  DEBUGF(overlaybuffer, "realloc(b->bytes=%p, newSize=%zu)", b->bytes, newSize);
-  unsigned char *new = emalloc(newSize);
+  // If the buffer is limited to a packet sized region, allocate all of it from a block pool up front
+  // so that it never needs to grow again.
+  size_t wantSize = b->sizeLimit != SIZE_MAX ? b->sizeLimit : newSize;
+  unsigned char *new = NULL;
+  unsigned pool;
+  for (pool = 0; pool < NELS(block_pools) && wantSize > block_pools[pool].size; ++pool)
+    ;
+  if (pool == NELS(block_pools))
+    for (pool = 0; pool < NELS(block_pools) && newSize > block_pools[pool].size; ++pool)
+      ;
+  if (pool < NELS(block_pools)) {
+    newSize = block_pools[pool].size;
+    DEBUGF(overlaybuffer, "pool alloc(b->bytes=%p, newSize=%zu)", b->bytes, newSize);
+    new = mem_pool_alloc(&block_pools[pool]);
+  } else {
+    if (newSize&1023)
+      newSize+=1024-(newSize&1023);
+    if (newSize>65536 && (newSize&65535))
+      newSize+=65536-(newSize&65535);
+    DEBUGF(overlaybuffer, "realloc(b->bytes=%p, newSize=%zu)", b->bytes, newSize);
+    new = emalloc(newSize);
+  }
   if (!new)
     return 0;
   if (b->position)
     bcopy(b->bytes,new,b->position);
-  if (b->allocated) {
+  if (b->allocated)
     assert(b->allocated == b->bytes);
-    free(b->allocated);
-  }
+  ob_release_bytes(b);
   b->bytes=new;
   b->allocated=new;
   b->allocSize=newSize;
+  b->pool = pool < NELS(block_pools) ? pool + 1 : 0;
   return 1;
 }
 
@@ -566,7 +616,7 @@ uint64_t ob_get_packed_ui64(struct overlay_buffer *b)
     byte = ob_get(b);
     if (byte<0)
       return WHY("Failed to unpack integer");
-    ret |= (byte&0x7f)<<shift;
+    ret |= (uint64_t)(byte&0x7f)<<shift;
     shift+=7;
   }while(byte & 0x80);
   return ret;
@@ -41,6 +41,9 @@ struct overlay_buffer {
   
   // is this an allocated buffer? can it be resized? Should it be freed?
   unsigned char * allocated;
+
+  // which block pool (counting from 1) the allocated bytes came from, or 0 if they came from malloc()
+  unsigned char pool;
 };
 
 struct overlay_buffer *_ob_new(struct __sourceloc __whence);
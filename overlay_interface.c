@@ -91,6 +91,8 @@ void overlay_interface_close(overlay_interface *interface)
   if (interface->radio_link_state)
     radio_link_free(interface);
   interface->state=INTERFACE_STATE_DOWN;
+  // discard any datagrams still waiting to be sent
+  overlay_interface_flush(interface);
   
   INFOF("Interface %s addr %s is down", 
 	interface->name, alloca_socket_address(&interface->address));
@@ -164,6 +166,24 @@ void interface_state_html(struct strbuf *b, struct overlay_interface *interface)
   }
   strbuf_sprintf(b, "TX: %d<br>", interface->tx_count);
   strbuf_sprintf(b, "RX: %d<br>", interface->recv_count);
+  if (interface->ifconfig.socket_type == SOCK_DGRAM){
+    strbuf_sprintf(b, "TX batches: %d, average %.1f, max %d<br>",
+      interface->tx_batches,
+      interface->tx_batches ? (double)interface->tx_count / interface->tx_batches : 0.0,
+      interface->tx_batch_max);
+    strbuf_sprintf(b, "RX batches: %d, average %.1f, max %d<br>",
+      interface->recv_batches,
+      interface->recv_batches ? (double)interface->recv_count / interface->recv_batches : 0.0,
+      interface->recv_batch_max);
+  }
+}
+
+static unsigned interface_batch_size(const struct overlay_interface *interface)
+{
+  unsigned size = interface->ifconfig.batch_size;
+  if (size > OVERLAY_INTERFACE_MAX_BATCH)
+    return OVERLAY_INTERFACE_MAX_BATCH;
+  return size ? size : 1;
 }
 
 // create a socket with options common to all our UDP sockets
@@ -663,22 +683,74 @@ cleanup:
   return cleanup_ret;
 }
 
+#define DGRAM_BUFFER_SIZE 8096
+
+#ifdef HAVE_RECVMMSG
+static void interface_read_dgram_batch(struct overlay_interface *interface, unsigned batch)
+{
+  static unsigned char packets[OVERLAY_INTERFACE_MAX_BATCH][DGRAM_BUFFER_SIZE];
+  struct socket_address addrs[OVERLAY_INTERFACE_MAX_BATCH];
+  struct iovec iov[OVERLAY_INTERFACE_MAX_BATCH];
+  struct mmsghdr msgs[OVERLAY_INTERFACE_MAX_BATCH];
+  unsigned i;
+  
+  bzero(msgs, batch * sizeof *msgs);
+  for (i = 0; i < batch; i++) {
+    iov[i].iov_base = packets[i];
+    iov[i].iov_len = sizeof packets[i];
+    msgs[i].msg_hdr.msg_name = (void *)&addrs[i].addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof addrs[i].raw;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  
+  int count = recvmmsg(interface->alarm.poll.fd, msgs, batch, 0, NULL);
+  if (count == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return;
+    WHYF_perror("recvmmsg(%d,%u)", interface->alarm.poll.fd, batch);
+    overlay_interface_close(interface);
+    return;
+  }
+  DEBUGF(verbose_io, "recvmmsg(%d,%u) -> %d", interface->alarm.poll.fd, batch, count);
+  interface->recv_batches++;
+  if (count > interface->recv_batch_max)
+    interface->recv_batch_max = count;
+  
+  // each packet is still passed individually, so packetOkOverlay() counts them all
+  for (i = 0; i < (unsigned)count && interface->state == INTERFACE_STATE_UP; i++) {
+    addrs[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    packetOkOverlay(interface, packets[i], msgs[i].msg_len, &addrs[i]);
+  }
+}
+#endif
+
 static void interface_read_dgram(struct overlay_interface *interface)
 {
+  /* Read at most batch_size UDP packets per call to share resources more fairly */
+#ifdef HAVE_RECVMMSG
+  unsigned batch = interface_batch_size(interface);
+  if (batch > 1) {
+    interface_read_dgram_batch(interface, batch);
+    return;
+  }
+#endif
+  
   int plen=0;
-  unsigned char packet[8096];
+  unsigned char packet[DGRAM_BUFFER_SIZE];
   
   struct socket_address recvaddr;
   recvaddr.addrlen = sizeof recvaddr.store;
 
-  /* Read only one UDP packet per call to share resources more fairly, and also
-   enable stats to accurately count packets received */
   int recvttl=1;
   plen = recv_message(interface->alarm.poll.fd, &recvaddr, &recvttl, packet, sizeof(packet));
   if (plen == -1) {
     overlay_interface_close(interface);
     return;
   }
+  interface->recv_batches++;
+  if (interface->recv_batch_max < 1)
+    interface->recv_batch_max = 1;
   packetOkOverlay(interface, packet, plen, &recvaddr);
 }
 
@@ -944,6 +1016,110 @@ static int send_local_broadcast(int fd, const uint8_t *bytes, size_t len, const
   return 0;
 }
 
+/* Deal with a failure to send a datagram on a dgram interface.  Returns 1 if no more packets
+ * should be sent to the socket for now.
+ */
+static int dgram_send_failed(struct overlay_interface *interface, struct network_destination *destination, size_t len, const char *syscall)
+{
+  if (errno==EAGAIN || errno==EWOULDBLOCK)
+    return 1;
+  if (errno==ENOENT || errno==ENOTDIR)
+    return 0;
+  WHYF_perror("%s(fd=%d,len=%zu,addr=%s) on interface %s",
+      syscall,
+      interface->alarm.poll.fd,
+      len,
+      alloca_socket_address(&destination->address),
+      interface->name
+    );
+  
+  // if we had any error while sending broadcast packets,
+  // it could be because the interface is coming down
+  // or there might be some socket error that we can't fix.
+  // So bring the interface down, and scan for network changes soon
+  if (destination == interface->destination){
+    overlay_interface_close(interface);
+    rescan_soon(gettime_ms()+100);
+    return 1;
+  }
+  return 0;
+}
+
+/* Send all datagrams queued by overlay_broadcast_ensemble() on this interface, using a single
+ * sendmmsg(2) call where possible.  If the interface is down, the datagrams are discarded.
+ */
+void overlay_interface_flush(struct overlay_interface *interface)
+{
+  unsigned count = interface->tx_batch_count;
+  if (count == 0)
+    return;
+  
+  struct overlay_buffer *buffers[OVERLAY_INTERFACE_MAX_BATCH];
+  struct network_destination *destinations[OVERLAY_INTERFACE_MAX_BATCH];
+  bcopy(interface->tx_batch_buffers, buffers, count * sizeof *buffers);
+  bcopy(interface->tx_batch_destinations, destinations, count * sizeof *destinations);
+  // a send error may close the interface, which must not see these packets again
+  interface->tx_batch_count = 0;
+  
+  unsigned i;
+  if (interface->state == INTERFACE_STATE_UP && interface->alarm.poll.fd != -1) {
+#ifdef HAVE_SENDMMSG
+    struct iovec iov[OVERLAY_INTERFACE_MAX_BATCH];
+    struct mmsghdr msgs[OVERLAY_INTERFACE_MAX_BATCH];
+    bzero(msgs, count * sizeof *msgs);
+    for (i = 0; i < count; i++) {
+      iov[i].iov_base = ob_ptr(buffers[i]);
+      iov[i].iov_len = ob_position(buffers[i]);
+      msgs[i].msg_hdr.msg_name = (void *)&destinations[i]->address.addr;
+      msgs[i].msg_hdr.msg_namelen = destinations[i]->address.addrlen;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    i = 0;
+    while (i < count) {
+      int sent = sendmmsg(interface->alarm.poll.fd, &msgs[i], count - i, 0);
+      if (sent == -1) {
+	// the first remaining packet failed; skip it and carry on unless the socket is unusable
+	if (dgram_send_failed(interface, destinations[i], iov[i].iov_len, "sendmmsg"))
+	  break;
+	i++;
+	continue;
+      }
+      DEBUGF(verbose_io, "sendmmsg(%d,%u) -> %d", interface->alarm.poll.fd, count - i, sent);
+      interface->tx_batches++;
+      if (sent > interface->tx_batch_max)
+	interface->tx_batch_max = sent;
+      i += sent;
+    }
+#else
+    for (i = 0; i < count; i++) {
+      size_t len = ob_position(buffers[i]);
+      if (sendto(interface->alarm.poll.fd, ob_ptr(buffers[i]), len, 0,
+	    &destinations[i]->address.addr, destinations[i]->address.addrlen) == -1) {
+	if (dgram_send_failed(interface, destinations[i], len, "sendto"))
+	  break;
+	continue;
+      }
+      interface->tx_batches++;
+      if (interface->tx_batch_max < 1)
+	interface->tx_batch_max = 1;
+    }
+#endif
+  }
+  
+  for (i = 0; i < count; i++) {
+    ob_free(buffers[i]);
+    release_destination_ref(destinations[i]);
+  }
+}
+
+void overlay_interface_flush_all()
+{
+  unsigned i;
+  for (i=0;i<OVERLAY_MAX_INTERFACES;i++)
+    overlay_interface_flush(&overlay_interfaces[i]);
+}
+
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer)
 {
   assert(destination && destination->interface);
@@ -1041,31 +1217,26 @@ int overlay_broadcast_ensemble(struct network_destination *destination, struct o
 	// find all sockets in this folder and send to them
 	send_local_broadcast(interface->alarm.poll.fd, 
 		  bytes, (size_t)len, destination->address.local.sun_path);
+      }else if (interface_batch_size(interface) > 1){
+	// hold the packet until overlay_interface_flush() sends the whole batch
+	unsigned n = interface->tx_batch_count++;
+	interface->tx_batch_buffers[n] = buffer;
+	interface->tx_batch_destinations[n] = add_destination_ref(destination);
+	if (interface->tx_batch_count >= interface_batch_size(interface))
+	  overlay_interface_flush(interface);
+	return 0;
       }else{
 	ssize_t sent = sendto(interface->alarm.poll.fd, 
 		  bytes, (size_t)len, 0, 
 		  &destination->address.addr, destination->address.addrlen);
 	if (sent == -1){
-	  if (errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=ENOENT && errno!=ENOTDIR){
-	    WHYF_perror("sendto(fd=%d,len=%zu,addr=%s) on interface %s",
-		interface->alarm.poll.fd,
-		(size_t)len,
-		alloca_socket_address(&destination->address),
-		interface->name
-	      );
-	    
-	    // if we had any error while sending broadcast packets,
-	    // it could be because the interface is coming down
-	    // or there might be some socket error that we can't fix.
-	    // So bring the interface down, and scan for network changes soon
-	    if (destination == interface->destination){
-	      overlay_interface_close(interface);
-	      rescan_soon(gettime_ms()+100);
-	    }
-	  }
+	  dgram_send_failed(interface, destination, len, "sendto");
 	  ob_free(buffer);
 	  return -1;
 	}
+	interface->tx_batches++;
+	if (interface->tx_batch_max < 1)
+	  interface->tx_batch_max = 1;
       }
       ob_free(buffer);
       return 0;
@@ -27,6 +27,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define INTERFACE_STATE_DOWN 0
 #define INTERFACE_STATE_UP 1
 
+// Upper limit on interfaces.N.batch_size; datagrams received or sent by one system call
+#define OVERLAY_INTERFACE_MAX_BATCH 32
+
 struct overlay_interface;
 
 // where should packets be sent to?
@@ -74,6 +77,17 @@ typedef struct overlay_interface {
   int recv_count;
   int tx_count;
   
+  // number of system calls that received or sent datagrams, and the largest batch of each
+  int recv_batches;
+  int recv_batch_max;
+  int tx_batches;
+  int tx_batch_max;
+  
+  // datagrams waiting to be sent together by overlay_interface_flush()
+  unsigned tx_batch_count;
+  struct overlay_buffer *tx_batch_buffers[OVERLAY_INTERFACE_MAX_BATCH];
+  struct network_destination *tx_batch_destinations[OVERLAY_INTERFACE_MAX_BATCH];
+  
   struct radio_link_state *radio_link_state;
 
   struct config_network_interface ifconfig;
@@ -132,6 +146,8 @@ overlay_interface * overlay_interface_find(struct in_addr addr, int return_defau
 overlay_interface * overlay_interface_find_name_addr(const char *name, struct socket_address *addr);
 int overlay_interface_compare(overlay_interface *one, overlay_interface *two);
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer);
+void overlay_interface_flush(struct overlay_interface *interface);
+void overlay_interface_flush_all();
 void interface_state_html(struct strbuf *b, struct overlay_interface *interface);
 void overlay_interface_monitor_up();
 
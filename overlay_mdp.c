@@ -407,6 +407,68 @@ static void overlay_mdp_decode_header(struct internal_mdp_header *header, struct
   header->source_port = port;
 }
 
+/* Frames sealed with a session key start with a flags byte with the high bit set, which is
+   never set in the first byte of a crypto_box nonce, followed by a short counter nonce. */
+#define MDP_SESSION_FRAME 0x80
+// the payload follows in the clear, authenticated by a trailing mac
+#define MDP_SESSION_PLAINTEXT 0x40
+
+static struct overlay_buffer *overlay_mdp_open_session(struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  unsigned char *k=keyring_get_session_key(header->destination->identity->box_sk,
+    header->destination->identity->box_pk,
+    &header->source->sid, 0);
+  if (!k){
+    WHY("I don't have the private key required to decrypt that");
+    return NULL;
+  }
+
+  unsigned char *start = ob_current_ptr(payload);
+  int flags = ob_get(payload);
+  unsigned char *nonce = ob_get_bytes_ptr(payload, SESSION_NONCE_BYTES);
+  if (!nonce){
+    WHYF("Expected %d bytes of nonce", SESSION_NONCE_BYTES);
+    return NULL;
+  }
+
+  size_t len = ob_remaining(payload);
+  if (len < SESSION_MAC_BYTES){
+    WHYF("Expected at least %d bytes of mac", SESSION_MAC_BYTES);
+    return NULL;
+  }
+  len -= SESSION_MAC_BYTES;
+
+  struct overlay_buffer *ret;
+  if (flags & MDP_SESSION_PLAINTEXT){
+    // the mac authenticates everything before it
+    unsigned char *mac = ob_current_ptr(payload) + len;
+    if (crypto_session_open(NULL, mac, SESSION_MAC_BYTES, start, mac - start, nonce, k))
+      return NULL;
+    ret = ob_slice(payload, ob_position(payload), len);
+    ob_limitsize(ret, len);
+    header->crypt_flags = MDP_FLAG_NO_CRYPT;
+  }else{
+    ret = ob_new();
+    if (!ob_makespace(ret, len)){
+      ob_free(ret);
+      return NULL;
+    }
+    ob_limitsize(ret, len);
+    if (crypto_session_open(ob_ptr(ret), ob_current_ptr(payload), len + SESSION_MAC_BYTES, start, 1, nonce, k)){
+      ob_free(ret);
+      WHYF("Failed to open session frame (from %s, to %s, len %zu)",
+	alloca_tohex_sid_t(header->source->sid), alloca_tohex_sid_t(header->destination->sid), len);
+      return NULL;
+    }
+  }
+
+  DEBUGF(mdprequests, "Opened session frame from %s", alloca_tohex_sid_t(header->source->sid));
+  // they can open our session frames too
+  header->source->session_frames = 1;
+  overlay_mdp_decode_header(header, ret);
+  return ret;
+}
+
 static struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
   IN();
@@ -440,6 +502,11 @@ static struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *he
       
   case 0:
     {
+      if (ob_remaining(payload) && (ob_peek(payload) & MDP_SESSION_FRAME)){
+	ret = overlay_mdp_open_session(header, payload);
+	break;
+      }
+
       unsigned char *k=keyring_get_nm_bytes(header->destination->identity->box_sk,
 	header->destination->identity->box_pk,
 	&header->source->sid);
@@ -782,6 +849,54 @@ static struct overlay_buffer * encrypt_payload(
   return ret;
 }
 
+/* Seal a frame for a single recipient with the symmetric session key of the pair, which
+   costs far less than a public key signature, and a shorter nonce than crypto_box. */
+static struct overlay_buffer * seal_session_payload(
+  struct subscriber *source,
+  struct subscriber *dest,
+  const unsigned char *buffer,
+  size_t msg_len,
+  int encrypt)
+{
+  unsigned char *k=keyring_get_session_key(source->identity->box_sk, source->identity->box_pk, &dest->sid, 1);
+  if (!k) {
+    WHY("could not derive session key");
+    return NULL;
+  }
+
+  struct overlay_buffer *ret = ob_new();
+  if (ret == NULL)
+    return NULL;
+
+  unsigned char *start = ob_append_space(ret, 1 + SESSION_NONCE_BYTES + msg_len + SESSION_MAC_BYTES);
+  if (!start){
+    ob_free(ret);
+    return NULL;
+  }
+  unsigned char *nonce = start + 1;
+  unsigned char *body = nonce + SESSION_NONCE_BYTES;
+
+  start[0] = MDP_SESSION_FRAME | (encrypt ? 0 : MDP_SESSION_PLAINTEXT);
+  if (generate_nonce(nonce, SESSION_NONCE_BYTES)){
+    ob_free(ret);
+    WHY("generate_nonce() failed to generate nonce");
+    return NULL;
+  }
+
+  int r;
+  if (encrypt)
+    r = crypto_session_seal(body, buffer, msg_len, start, 1, nonce, k);
+  else{
+    bcopy(buffer, body, msg_len);
+    r = crypto_session_seal(body + msg_len, NULL, 0, start, body + msg_len - start, nonce, k);
+  }
+  if (r){
+    ob_free(ret);
+    return NULL;
+  }
+  return ret;
+}
+
 // encrypt or sign the plaintext, then queue the frame for transmission.
 // Note, the position of the payload MUST be at the start of the data, the limit MUST be used to specify the end
 int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *header, struct overlay_buffer *payload)
@@ -816,7 +931,7 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
          header->destination?alloca_tohex_sid_t(header->destination->sid):"broadcast", header->destination_port);
       
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame)
     return -1;
   
@@ -861,6 +976,7 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
      about the crypto matters, and not compression that may be applied
      before encryption (since applying it after is useless as ciphered
      text should have maximum entropy). */
+  int session = frame->destination && (config.mdp.session_frames || frame->destination->session_frames);
   switch(header->crypt_flags) {
   case 0:
     if (!frame->destination){
@@ -869,10 +985,13 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
       return WHY("Cannot encrypt to broadcast destinations");
     }
   
-    /* crypted and signed (using CryptoBox authcryption primitive) */
-    frame->payload = encrypt_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext));
+    /* crypted and signed (using CryptoBox authcryption primitive, or a session key) */
+    if (session)
+      frame->payload = seal_session_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext), 1);
+    else
+      frame->payload = encrypt_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext));
+    ob_free(plaintext);
     if (!frame->payload){
-      ob_free(plaintext);
       op_free(frame);
       return -1;
     }
@@ -883,6 +1002,18 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
     break;
       
   case MDP_FLAG_NO_CRYPT:
+    if (session){
+      /* authenticated with a session mac instead of a signature, which only the
+         recipient can verify, so the frame is marked as ciphered */
+      frame->payload = seal_session_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext), 0);
+      ob_free(plaintext);
+      if (!frame->payload){
+	op_free(frame);
+	return -1;
+      }
+      frame->modifiers |= OF_CRYPTO_CIPHERED;
+      break;
+    }
     // Lets just append some space into the existing payload buffer for the signature, without copying it.
     frame->payload = plaintext;
     if (   !ob_makespace(frame->payload, SIGNATURE_BYTES)
@@ -1110,6 +1241,33 @@ static int routing_table(void **record, void *context)
   return 0;
 }
 
+static void send_stats(struct socket_address *client, struct mdp_header *header)
+{
+  uint8_t payload[MDP_MTU];
+  struct overlay_buffer *b = ob_static(payload, sizeof payload);
+  ob_limitsize(b, sizeof payload);
+  ob_append_packed_ui64(b, fd_stats_uptime());
+  ob_append_packed_ui64(b, poll_stats.latency.total);
+  mdp_reply2(__WHENCE__, client, header, 0, payload, ob_position(b));
+
+  struct profile_total *stats;
+  for (stats = stats_head; stats; stats = stats->_next){
+    if (!stats->latency.count)
+      continue;
+    ob_clear(b);
+    ob_append_strn(b, stats->name, 256);
+    ob_append_packed_ui64(b, stats->latency.count);
+    ob_append_packed_ui64(b, stats->latency.total);
+    ob_append_packed_ui64(b, stats->latency.max);
+    ob_append_packed_ui64(b, latency_percentile(&stats->latency, 500));
+    ob_append_packed_ui64(b, latency_percentile(&stats->latency, 990));
+    ob_append_packed_ui64(b, latency_percentile(&stats->latency, 999));
+    assert(!ob_overrun(b));
+    mdp_reply2(__WHENCE__, client, header, 0, payload, ob_position(b));
+  }
+  ob_free(b);
+}
+
 static void send_route_changed(struct subscriber *subscriber, int UNUSED(prior_reachable)){
   struct mdp_header header;
   bzero(&header, sizeof(header));
@@ -1589,6 +1747,11 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
 	  mdp_reply_ok(client, header);
 	}
 	break;
+      case MDP_STATS:
+	DEBUGF(mdprequests, "Processing MDP_STATS from %s", alloca_socket_address(client));
+	send_stats(client, header);
+	mdp_reply_ok(client, header);
+	break;
       default:
 	WHYF("Unknown command port %d", header->remote.port);
 	mdp_reply_error(client, header);
@@ -122,7 +122,7 @@ static int overlay_mdp_service_rhizomerequest(struct internal_mdp_header *header
 }
 
 DEFINE_BINDING(MDP_PORT_RHIZOME_RESPONSE, overlay_mdp_service_rhizomeresponse);
-static int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *UNUSED(header), struct overlay_buffer *payload)
+static int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
   IN();
   
@@ -152,7 +152,7 @@ static int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *UNUSE
 	 a slot to capture this files as it is being requested
 	 by someone else.
       */
-      rhizome_received_content(bidprefix,version,offset, count, bytes);
+      rhizome_received_content(header->source, bidprefix,version,offset, count, bytes);
 
       RETURN(0);
     }
@@ -121,6 +121,7 @@ struct internal_mdp_header{
 };
 
 
+struct overlay_frame *op_new();
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
 
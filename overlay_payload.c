@@ -20,6 +20,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
+#include "mem.h"
+#include "fdqueue.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 
@@ -114,6 +116,21 @@ cleanup:
   return -1;
 }
 
+/* Frames are queued and released at the packet rate, so keep a free list of them.
+ */
+static struct mem_pool frame_pool = MEM_POOL_INIT("overlay_frame", sizeof(struct overlay_frame), 256);
+
+static void op_show_pool_stats()
+{
+  mem_pool_log_stats(&frame_pool);
+}
+DEFINE_TRIGGER(show_stats, op_show_pool_stats);
+
+struct overlay_frame *op_new()
+{
+  return mem_pool_alloc_zero(&frame_pool);
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -123,7 +140,7 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  mem_pool_free(&frame_pool, p);
   return 0;
 }
 
@@ -132,7 +149,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out = emalloc(sizeof(struct overlay_frame));
+  struct overlay_frame *out = mem_pool_alloc(&frame_pool);
   if (out == NULL)
     return NULL;
 
@@ -141,7 +158,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
 
   if (in->payload) {
     if ((out->payload = ob_dup(in->payload)) == NULL) {
-      free(out);
+      mem_pool_free(&frame_pool, out);
       return NULL;
     }
   }
@@ -562,14 +562,23 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now, strbuf d
   OUT();
 }
 
-// when the queue timer elapses, send a packet
+// when the queue timer elapses, send every packet that is ready, so that each interface can write
+// them with a single system call
 static void overlay_send_packet(struct sched_ent *UNUSED(alarm))
 {
-  struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
-  packet.seq=-1;
+  time_ms_t now = gettime_ms();
   strbuf debug = IF_DEBUG(packets_sent) ? strbuf_alloca(256) : NULL;
-  overlay_fill_send_packet(&packet, gettime_ms(), debug);
+  unsigned count;
+  for (count = 0; count < OVERLAY_INTERFACE_MAX_BATCH; count++){
+    struct outgoing_packet packet;
+    bzero(&packet, sizeof(struct outgoing_packet));
+    packet.seq=-1;
+    if (debug)
+      strbuf_reset(debug);
+    if (!overlay_fill_send_packet(&packet, now, debug))
+      break;
+  }
+  overlay_interface_flush_all();
 }
 
 int overlay_send_tick_packet(struct network_destination *destination)
@@ -586,6 +595,7 @@ int overlay_send_tick_packet(struct network_destination *destination)
 	packet.seq);
     }
     overlay_fill_send_packet(&packet, gettime_ms(), debug);
+    overlay_interface_flush(destination->interface);
     // This debug statement is used for testing; do not remove or alter.
     DEBUGF(overlaytick, "TICK name=%s destination=%s seq=%d",
 	packet.destination->interface->name,
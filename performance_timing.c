@@ -49,10 +49,18 @@
 #include <inttypes.h> // for PRIu64 on Android
 #include "fdqueue.h"
 #include "conf.h"
+#include "strbuf.h"
+#include "strbuf_helpers.h"
 
 __thread struct profile_total *stats_head=NULL;
 __thread struct call_stats *current_call=NULL;
 
+// when the first and the current stats period started
+static time_ns_t stats_started=0;
+static time_ns_t period_started=0;
+
+#define NS_TO_MS(T) ((T) / 1000000.0)
+
 void fd_clearstat(struct profile_total *s){
   s->max_time = 0;
   s->total_time = 0;
@@ -60,6 +68,52 @@ void fd_clearstat(struct profile_total *s){
   s->calls = 0;
 }
 
+static unsigned latency_bucket(time_ns_t elapsed)
+{
+  uint64_t v = elapsed < 0 ? 0 : elapsed;
+  if (v < (1 << LATENCY_SUB_BITS))
+    return v;
+  unsigned bits = 63 - __builtin_clzll(v);
+  if (bits >= LATENCY_MAX_BITS)
+    return LATENCY_BUCKETS - 1;
+  // the top LATENCY_SUB_BITS bits after the leading one choose the bucket within its power of two
+  return ((bits - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+    | ((v >> (bits - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+static void latency_record(struct latency_histogram *h, time_ns_t elapsed)
+{
+  h->count++;
+  h->total += elapsed;
+  if (elapsed > h->max)
+    h->max = elapsed;
+  h->buckets[latency_bucket(elapsed)]++;
+}
+
+// estimate the latency that per_mille/1000 of all calls did not exceed
+time_ns_t latency_percentile(const struct latency_histogram *h, unsigned per_mille)
+{
+  if (!h->count)
+    return 0;
+  uint64_t rank = (h->count * per_mille + 999) / 1000;
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  unsigned i;
+  for (i = 0; i < LATENCY_BUCKETS - 1; i++){
+    seen += h->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i < (2 << LATENCY_SUB_BITS))
+    return i;
+  // report the middle of the bucket, but never more than the slowest call
+  unsigned shift = (i >> LATENCY_SUB_BITS) - 1;
+  time_ns_t low = (time_ns_t)((1 << LATENCY_SUB_BITS) | (i & ((1 << LATENCY_SUB_BITS) - 1))) << shift;
+  time_ns_t mid = low + ((time_ns_t)1 << shift) / 2;
+  return mid < h->max ? mid : h->max;
+}
+
 int fd_tallystats(struct profile_total *total,struct profile_total *a)
 {
   total->total_time+=a->total_time;
@@ -70,13 +124,20 @@ int fd_tallystats(struct profile_total *total,struct profile_total *a)
 
 int fd_showstat(struct profile_total *total, struct profile_total *a)
 {
-  INFOF("%"PRId64"ms (%2.1f%%) in %d calls (max %"PRId64"ms, avg %.1fms, +child avg %.1fms) : %s",
-       (int64_t) a->total_time,
+  strbuf percentiles = strbuf_alloca(80);
+  if (a->latency.count)
+    strbuf_sprintf(percentiles, "; since start p50 %.3fms, p99 %.3fms, p999 %.3fms",
+       NS_TO_MS(latency_percentile(&a->latency, 500)),
+       NS_TO_MS(latency_percentile(&a->latency, 990)),
+       NS_TO_MS(latency_percentile(&a->latency, 999)));
+  INFOF("%.3fms (%2.1f%%) in %d calls (max %.3fms, avg %.3fms, +child avg %.3fms%s) : %s",
+       NS_TO_MS(a->total_time),
        a->total_time*100.0/total->total_time,
        a->calls,
-       (int64_t) a->max_time,
-       a->total_time*1.00/a->calls,
-       (a->total_time+a->child_time)*1.00/a->calls,
+       NS_TO_MS(a->max_time),
+       NS_TO_MS(a->total_time)/a->calls,
+       NS_TO_MS(a->total_time+a->child_time)/a->calls,
+       strbuf_str(percentiles),
        a->name);
   return 0;
 }
@@ -161,6 +222,9 @@ struct profile_total *sort(struct profile_total *list){
 
 int fd_clearstats()
 {
+  period_started = gettime_ns();
+  if (!stats_started)
+    stats_started = period_started;
   struct profile_total *stats = stats_head;
   while(stats!=NULL){
     fd_clearstat(stats);
@@ -171,7 +235,7 @@ int fd_clearstats()
 
 int fd_showstats()
 {
-  struct profile_total total={NULL, 0, "Total", 0,0,0,0};
+  struct profile_total total={.name="Total"};
   
   stats_head = sort(stats_head);
   
@@ -189,7 +253,7 @@ int fd_showstats()
       while(stats!=NULL){
 	/* If a function spends more than 1 second in any 
 	   notionally 3 second period, then dob on it */
-	if ((stats->total_time>1000 || stats->calls > 10000)
+	if ((stats->total_time>1000000000 || stats->calls > 10000)
 	    && strcmp(stats->name,"Idle (in poll)"))
 	  fd_showstat(&total,stats);
 	stats = stats->_next;
@@ -205,11 +269,58 @@ int fd_showstats()
       stats = stats->_next;
     }    
     fd_showstat(&total,&total);
+    time_ns_t elapsed = gettime_ns() - period_started;
+    if (poll_stats.calls && elapsed > 0)
+      INFOF("Idle %2.1f%%, busy %2.1f%% of the last %.3fms",
+	poll_stats.total_time*100.0/elapsed,
+	(elapsed - poll_stats.total_time)*100.0/elapsed,
+	NS_TO_MS(elapsed));
+    CALL_TRIGGER(show_stats);
   }
   
   return 0;
 }
 
+time_ns_t fd_stats_uptime()
+{
+  return gettime_ns() - stats_started;
+}
+
+// Every function and alarm called since the process started, with the estimated latency
+// percentiles of each one, for scraping by monitoring tools.
+void fd_stats_json(strbuf b)
+{
+  time_ns_t uptime = fd_stats_uptime();
+  time_ns_t idle = poll_stats.latency.total;
+  strbuf_sprintf(b, "{\n\"uptime_ns\":%"PRItime_ns_t",\n\"idle_ns\":%"PRItime_ns_t",\n\"busy_ns\":%"PRItime_ns_t",\n",
+    uptime, idle, uptime - idle);
+  strbuf_puts(b, "\"header\":[\"name\",\"calls\",\"total_ns\",\"max_ns\",\"p50_ns\",\"p99_ns\",\"p999_ns\"],\n\"rows\":[");
+  const char *sep = "";
+  struct profile_total *stats;
+  for (stats = stats_head; stats; stats = stats->_next){
+    if (!stats->latency.count)
+      continue;
+    strbuf_puts(b, sep);
+    strbuf_puts(b, "\n[");
+    strbuf_json_string(b, stats->name);
+    strbuf_sprintf(b, ",%"PRIu64",%"PRItime_ns_t",%"PRItime_ns_t",%"PRItime_ns_t",%"PRItime_ns_t",%"PRItime_ns_t"]",
+      stats->latency.count,
+      stats->latency.total,
+      stats->latency.max,
+      latency_percentile(&stats->latency, 500),
+      latency_percentile(&stats->latency, 990),
+      latency_percentile(&stats->latency, 999));
+    sep = ",";
+  }
+  strbuf_puts(b, "\n]\n}\n");
+}
+
+// Put a dummy no-op trigger callback into the "show_stats" trigger section,
+// otherwise if no other object provides one, the link will fail.
+static void __dummy_on_show_stats();
+DEFINE_TRIGGER(show_stats, __dummy_on_show_stats);
+static void __dummy_on_show_stats() {}
+
 DEFINE_ALARM(fd_periodicstats);
 void fd_periodicstats(struct sched_ent *UNUSED(alarm))
 {
@@ -242,7 +353,7 @@ int fd_func_enter(struct __sourceloc __whence, struct call_stats *this_call)
 {
   DEBUGF(profiling, "%s called from %s() %s:%d",
 	  __FUNCTION__,__whence.function,__whence.file,__whence.line); 
-  this_call->enter_time=gettime_ms();
+  this_call->enter_time=gettime_ns();
   this_call->child_time=0;
   this_call->prev = current_call;
   current_call = this_call;
@@ -260,8 +371,8 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
   if (current_call != this_call)
     FATAL("performance timing stack trace corrupted");
   
-  time_ms_t now = gettime_ms();
-  time_ms_t elapsed = now - this_call->enter_time;
+  time_ns_t now = gettime_ns();
+  time_ns_t elapsed = now - this_call->enter_time;
   current_call = this_call->prev;
   
   if (this_call->totals && !this_call->totals->_initialised){
@@ -282,6 +393,7 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
     this_call->totals->calls++;
     
     if (elapsed>this_call->totals->max_time) this_call->totals->max_time=elapsed;
+    latency_record(&this_call->totals->latency, elapsed);
   }
   
   return 0;
@@ -0,0 +1,373 @@
+/*
+Serval DNA
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "mem.h"
+#include "prefix_index.h"
+
+// Split the buckets when they hold this many entries on average
+#define BUCKET_SIZE 32u
+#define MAX_BUCKET_BITS 24
+
+static uint64_t get_key(const uint8_t *binary, size_t bin_length)
+{
+  uint64_t key=0;
+  unsigned i;
+  for (i=0;i<8;i++)
+    key = (key<<8) | (i<bin_length ? binary[i] : 0);
+  return key;
+}
+
+static uint64_t get_key_mask(size_t bin_length)
+{
+  if (bin_length == 0)
+    return 0;
+  if (bin_length >= 8)
+    return UINT64_MAX;
+  return UINT64_MAX << (64 - bin_length*8);
+}
+
+static unsigned bucket_count(const struct prefix_index *index)
+{
+  return index->buckets ? 1u << index->bucket_bits : 0;
+}
+
+static unsigned bucket_of(const struct prefix_index *index, uint64_t key)
+{
+  return index->bucket_bits ? (unsigned)(key >> (64 - index->bucket_bits)) : 0;
+}
+
+// does the value of this entry begin with binary / bin_length?
+static int entry_matches(const struct prefix_entry *entry, uint64_t key, uint64_t mask,
+  const uint8_t *binary, size_t bin_length)
+{
+  if ((entry->key & mask) != key)
+    return 0;
+  return bin_length <= 8 || memcmp(entry->record->binary + 8, binary + 8, bin_length - 8) == 0;
+}
+
+static int entry_less(const struct prefix_entry *entry, uint64_t key, const uint8_t *binary, size_t bin_length)
+{
+  if (entry->key != key)
+    return entry->key < key;
+  return bin_length > 8 && memcmp(entry->record->binary + 8, binary + 8, bin_length - 8) < 0;
+}
+
+// Find the first entry in the bucket that is not less than binary / bin_length.
+// Subscriber ids are public keys, so their values are spread evenly across each
+// bucket. Guessing the position from the key, then stepping to the exact place,
+// usually touches one or two cache lines, where a binary search would touch many.
+static unsigned lower_bound(const struct prefix_index *index, const struct prefix_bucket *bucket, uint64_t key,
+  const uint8_t *binary, size_t bin_length)
+{
+  uint64_t fraction = (key << index->bucket_bits) >> 32;
+  unsigned i = (unsigned)((fraction * bucket->count) >> 32);
+  while (i > 0 && !entry_less(&bucket->entries[i-1], key, binary, bin_length))
+    i--;
+  while (i < bucket->count && entry_less(&bucket->entries[i], key, binary, bin_length))
+    i++;
+  return i;
+}
+
+// the number of leading 4 bit nibbles that two values have in common
+static unsigned common_nibbles(const uint8_t *a, const uint8_t *b, size_t length)
+{
+  unsigned i;
+  for (i=0;i<length && a[i]==b[i];i++)
+    ;
+  if (i==length)
+    return i*2;
+  return i*2 + (((a[i]^b[i]) & 0xF0) ? 0 : 1);
+}
+
+// Record how many bits are needed to tell these two records apart.
+// To keep abbreviations identical to the nibble tree, depths are a whole number
+// of nibbles, and never shrink when records are removed.
+static void separate_records(struct tree_record *a, struct tree_record *b, size_t bin_length)
+{
+  unsigned depth = (common_nibbles(a->binary, b->binary, bin_length) + 1) * 4;
+  if (a->tree_depth < depth)
+    a->tree_depth = depth;
+  if (b->tree_depth < depth)
+    b->tree_depth = depth;
+}
+
+// The neighbours of a new record in sort order are the records it shares the
+// most leading bits with. When the record goes at either end of its bucket,
+// the closest neighbour may be in another bucket, but only the buckets that
+// share the same first nibble can affect its depth.
+static int same_nibble(const struct prefix_index *index, unsigned a, unsigned b)
+{
+  if (index->bucket_bits <= 4)
+    return 1;
+  return (a >> (index->bucket_bits - 4)) == (b >> (index->bucket_bits - 4));
+}
+
+static struct tree_record *previous_record(struct prefix_index *index, unsigned b, unsigned i)
+{
+  if (i>0)
+    return index->buckets[b].entries[i-1].record;
+  unsigned p;
+  for (p=b; p>0 && same_nibble(index, p-1, b); p--){
+    struct prefix_bucket *bucket = &index->buckets[p-1];
+    if (bucket->count)
+      return bucket->entries[bucket->count - 1].record;
+  }
+  return NULL;
+}
+
+static struct tree_record *next_record(struct prefix_index *index, unsigned b, unsigned i)
+{
+  if (i<index->buckets[b].count)
+    return index->buckets[b].entries[i].record;
+  unsigned n;
+  for (n=b+1; n<bucket_count(index) && same_nibble(index, n, b); n++){
+    struct prefix_bucket *bucket = &index->buckets[n];
+    if (bucket->count)
+      return bucket->entries[0].record;
+  }
+  return NULL;
+}
+
+// make sure there is room to insert one more entry
+static int grow_bucket(struct prefix_bucket *bucket)
+{
+  if (bucket->count < bucket->alloc)
+    return 0;
+  unsigned alloc = bucket->alloc ? bucket->alloc * 2 : 4;
+  struct prefix_entry *entries = erealloc(bucket->entries, alloc * sizeof(struct prefix_entry));
+  if (!entries)
+    return -1;
+  bucket->entries = entries;
+  bucket->alloc = alloc;
+  return 0;
+}
+
+static int fill_bucket(struct prefix_bucket *bucket, const struct prefix_entry *entries, unsigned count)
+{
+  if (count == 0)
+    return 0;
+  unsigned alloc = 4;
+  while (alloc < count)
+    alloc *= 2;
+  if ((bucket->entries = emalloc(alloc * sizeof(struct prefix_entry))) == NULL)
+    return -1;
+  memcpy(bucket->entries, entries, count * sizeof(struct prefix_entry));
+  bucket->count = count;
+  bucket->alloc = alloc;
+  return 0;
+}
+
+static void free_buckets(struct prefix_bucket *buckets, unsigned count)
+{
+  unsigned b;
+  for (b=0; b<count; b++)
+    free(buckets[b].entries);
+  free(buckets);
+}
+
+// Use one more bit of the key to choose a bucket, splitting every bucket in two.
+// If memory runs out, the index keeps working with fewer, larger buckets.
+static void split_buckets(struct prefix_index *index)
+{
+  unsigned count = bucket_count(index);
+  struct prefix_bucket *buckets = emalloc_zero(count * 2 * sizeof(struct prefix_bucket));
+  if (!buckets)
+    return;
+  unsigned shift = 63 - index->bucket_bits;
+  unsigned b;
+  for (b=0; b<count; b++){
+    struct prefix_bucket *bucket = &index->buckets[b];
+    unsigned split = 0;
+    while (split < bucket->count && ((bucket->entries[split].key >> shift) & 1) == 0)
+      split++;
+    if (fill_bucket(&buckets[b*2], bucket->entries, split) == -1
+      || fill_bucket(&buckets[b*2+1], bucket->entries + split, bucket->count - split) == -1){
+      free_buckets(buckets, count * 2);
+      return;
+    }
+  }
+  free_buckets(index->buckets, count);
+  index->buckets = buckets;
+  index->bucket_bits++;
+}
+
+static void remove_entry(struct prefix_index *index, struct prefix_bucket *bucket, unsigned i)
+{
+  bucket->count--;
+  memmove(&bucket->entries[i], &bucket->entries[i+1], (bucket->count - i) * sizeof(struct prefix_entry));
+  if (bucket->count == 0){
+    free(bucket->entries);
+    bucket->entries = NULL;
+    bucket->alloc = 0;
+  }
+  index->count--;
+}
+
+enum tree_error_reason prefix_index_find(struct prefix_index *index, void **result, const uint8_t *binary, size_t bin_length,
+  tree_create_callback create_node, void *context)
+{
+  assert(bin_length <= index->binary_length);
+
+  if (result)
+    *result = NULL;
+
+  if (bin_length == 0)
+    return TREE_NOT_UNIQUE;
+
+  uint64_t key = get_key(binary, bin_length);
+  uint64_t mask = get_key_mask(bin_length);
+  unsigned b = 0, i = 0;
+
+  if (index->buckets){
+    b = bucket_of(index, key);
+    i = lower_bound(index, &index->buckets[b], key, binary, bin_length);
+
+    // A value shorter than the bits that choose a bucket may match records in
+    // every bucket up to the last one it covers, so keep looking past the end
+    // of this bucket until a second match proves that it is not unique.
+    unsigned last = bucket_of(index, key | ~mask);
+    unsigned mb = b, mi = i;
+    struct tree_record *match = NULL;
+    while (mb <= last){
+      struct prefix_bucket *bucket = &index->buckets[mb];
+      if (mi >= bucket->count){
+	mb++;
+	mi = 0;
+	continue;
+      }
+      if (!entry_matches(&bucket->entries[mi], key, mask, binary, bin_length))
+	break;
+      if (match)
+	return TREE_NOT_UNIQUE;
+      match = bucket->entries[mi++].record;
+    }
+    if (match){
+      if (result)
+	*result = match;
+      return TREE_FOUND;
+    }
+  }
+
+  // allow caller to provide a node constructor
+  if (!create_node || bin_length != index->binary_length)
+    return TREE_NOT_FOUND;
+
+  if (!index->buckets){
+    if ((index->buckets = emalloc_zero(sizeof(struct prefix_bucket))) == NULL)
+      return TREE_ERROR;
+    index->bucket_bits = 0;
+  }
+  struct prefix_bucket *bucket = &index->buckets[b];
+  if (grow_bucket(bucket))
+    return TREE_ERROR;
+  struct tree_record *record = (struct tree_record *)create_node(context, binary, bin_length);
+  if (!record)
+    return TREE_ERROR;
+
+  record->tree_depth = 4;
+  struct tree_record *neighbour = previous_record(index, b, i);
+  if (neighbour)
+    separate_records(neighbour, record, bin_length);
+  neighbour = next_record(index, b, i);
+  if (neighbour)
+    separate_records(neighbour, record, bin_length);
+
+  memmove(&bucket->entries[i+1], &bucket->entries[i], (bucket->count - i) * sizeof(struct prefix_entry));
+  bucket->entries[i] = (struct prefix_entry){.key = key, .record = record};
+  bucket->count++;
+  index->count++;
+
+  if (index->count > (BUCKET_SIZE << index->bucket_bits) && index->bucket_bits < MAX_BUCKET_BITS)
+    split_buckets(index);
+
+  if (result)
+    *result = record;
+  return TREE_FOUND;
+}
+
+// call the callback for each entry from bucket b, entry i onwards,
+// stopping at the first entry that doesn't begin with prefix / prefix_length
+static int walk(struct prefix_index *index, unsigned b, unsigned i,
+  const uint8_t *prefix, size_t prefix_length, walk_callback callback, void *context)
+{
+  uint64_t key = get_key(prefix, prefix_length);
+  uint64_t mask = get_key_mask(prefix_length);
+  int ret=0;
+
+  for (; b<bucket_count(index); b++, i=0){
+    struct prefix_bucket *bucket = &index->buckets[b];
+    while (i < bucket->count){
+      if (prefix_length && !entry_matches(&bucket->entries[i], key, mask, prefix, prefix_length))
+	goto done;
+      void *record = bucket->entries[i].record;
+      ret = callback(&record, context);
+      if (record){
+	bucket->entries[i].record = (struct tree_record *)record;
+	i++;
+      }else{
+	remove_entry(index, bucket, i);
+      }
+      if (ret)
+	goto done;
+    }
+  }
+done:
+  // release everything once the last record has been removed
+  if (index->buckets && index->count == 0){
+    free_buckets(index->buckets, bucket_count(index));
+    index->buckets = NULL;
+    index->bucket_bits = 0;
+  }
+  return ret;
+}
+
+int prefix_index_walk(struct prefix_index *index, const uint8_t *binary, size_t bin_length, walk_callback callback, void *context)
+{
+  assert(!binary || bin_length <= index->binary_length);
+  if (!index->buckets || !binary || bin_length == 0)
+    return walk(index, 0, 0, NULL, 0, callback, context);
+  uint64_t key = get_key(binary, bin_length);
+  unsigned b = bucket_of(index, key);
+  unsigned i = lower_bound(index, &index->buckets[b], key, binary, bin_length);
+  return walk(index, b, i, NULL, 0, callback, context);
+}
+
+int prefix_index_walk_prefix(struct prefix_index *index, const uint8_t *binary, size_t bin_length, walk_callback callback, void *context)
+{
+  assert(bin_length <= index->binary_length);
+  if (!index->buckets || bin_length == 0)
+    return walk(index, 0, 0, NULL, 0, callback, context);
+  uint64_t key = get_key(binary, bin_length);
+  unsigned b = bucket_of(index, key);
+  unsigned i = lower_bound(index, &index->buckets[b], key, binary, bin_length);
+  return walk(index, b, i, binary, bin_length, callback, context);
+}
+
+size_t prefix_index_memory(const struct prefix_index *index)
+{
+  size_t ret = sizeof *index + bucket_count(index) * sizeof(struct prefix_bucket);
+  unsigned b;
+  for (b=0; b<bucket_count(index); b++)
+    ret += index->buckets[b].alloc * sizeof(struct prefix_entry);
+  return ret;
+}
@@ -0,0 +1,71 @@
+/*
+Serval DNA
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVAL_DNA__PREFIX_INDEX_H
+#define __SERVAL_DNA__PREFIX_INDEX_H
+
+#include "nibble_tree.h"
+
+// A compact replacement for the nibble tree, with the same record layout,
+// callbacks and return codes.
+// Records are kept in sorted arrays, with the leading bits of their binary value
+// choosing which array. As the index grows, more bits are used, so each array
+// stays short. Each array element carries the first 8 bytes of the value, so a
+// lookup only dereferences the record it finds, unless 8 bytes are not enough
+// to tell two values apart.
+
+struct prefix_entry{
+  // the first 8 bytes of the record's binary value, most significant first
+  uint64_t key;
+  struct tree_record *record;
+};
+
+struct prefix_bucket{
+  unsigned count;
+  unsigned alloc;
+  struct prefix_entry *entries;
+};
+
+struct prefix_index{
+  size_t binary_length;
+  unsigned count;
+  // there are 1<<bucket_bits buckets, chosen by the leading bits of the value
+  unsigned bucket_bits;
+  struct prefix_bucket *buckets;
+};
+
+// find the record related to the given binary value, or a unique record that begins with it
+// if not found, and the whole binary value was supplied, the create_node function will be called
+// and any record it returns will be inserted
+// returns TREE_NOT_UNIQUE if more than one record begins with the given value
+enum tree_error_reason prefix_index_find(struct prefix_index *index, void **result, const uint8_t *binary, size_t bin_length,
+  tree_create_callback create_node, void *context);
+
+// call walk_callback for each record in ascending order, releasing all memory once the index is empty.
+// if binary & bin_length have been supplied, skip all records < this binary value
+// the callback must not insert new records
+int prefix_index_walk(struct prefix_index *index, const uint8_t *binary, size_t bin_length, walk_callback callback, void *context);
+
+// call walk_callback for each record that begins with binary / bin_length
+int prefix_index_walk_prefix(struct prefix_index *index, const uint8_t *binary, size_t bin_length, walk_callback callback, void *context);
+
+// bytes of memory used by the index itself, not counting the records
+size_t prefix_index_memory(const struct prefix_index *index);
+
+#endif // __SERVAL_DNA__PREFIX_INDEX_H
@@ -367,6 +367,17 @@ struct rhizome_cleanup_report {
     unsigned deleted_orphan_manifests;
 };
 
+struct rhizome_store_usage {
+    uint64_t internal_bytes;
+    uint64_t external_bytes;
+    uint64_t db_page_size;
+    uint64_t db_page_count;
+    uint64_t db_free_page_count;
+    uint64_t used_bytes;
+    uint64_t limit_bytes;
+};
+
+int rhizome_store_usage(sqlite_retry_state *retry, struct rhizome_store_usage *usage);
 int rhizome_cleanup(struct rhizome_cleanup_report *report);
 int rhizome_store_cleanup(struct rhizome_cleanup_report *report);
 void rhizome_vacuum_db(sqlite_retry_state *retry);
@@ -548,6 +559,10 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc, int log_level, sqlite_retry_st
 int _sqlite_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, ...);
 int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, va_list ap);
 sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext, ...);
+sqlite3_stmt *_sqlite_prepare_cached(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext);
+sqlite3_stmt *_sqlite_prepare_bind_cached(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext, ...);
+void sqlite_release(sqlite3_stmt *statement);
+void sqlite_statement_cache_flush();
 int _sqlite_retry(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 void _sqlite_retry_done(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 int _sqlite_step(struct __sourceloc, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement);
@@ -581,6 +596,7 @@ int _sqlite_blob_write_retry(
   int offset
 );
 int _sqlite_blob_close(struct __sourceloc, int log_level, sqlite3_blob *blob);
+int rhizome_query_plan(sqlite3_stmt *statement, strbuf plan);
 
 // The 'arg' arguments in the following macros appear to be unnecessary, but
 // they serve a very useful purpose, so don't remove them!  They ensure that
@@ -590,6 +606,7 @@ int _sqlite_blob_close(struct __sourceloc, int log_level, sqlite3_blob *blob);
 #define sqlite_prepare_loglevel(ll,rs,sql)              _sqlite_prepare(__WHENCE__, (ll), (rs), (sql))
 #define sqlite_prepare_bind(rs,sql,arg,...)             _sqlite_prepare_bind(__WHENCE__, LOG_LEVEL_ERROR, (rs), (sql), arg, ##__VA_ARGS__)
 #define sqlite_prepare_bind_loglevel(ll,rs,sql,arg,...) _sqlite_prepare_bind(__WHENCE__, (ll), (rs), (sql), arg, ##__VA_ARGS__)
+#define sqlite_prepare_bind_cached(rs,sql,arg,...)      _sqlite_prepare_bind_cached(__WHENCE__, LOG_LEVEL_ERROR, (rs), (sql), arg, ##__VA_ARGS__)
 #define sqlite_bind(rs,stmt,arg,...)                    _sqlite_bind(__WHENCE__, LOG_LEVEL_ERROR, (rs), (stmt), arg, ##__VA_ARGS__)
 #define sqlite_bind_loglevel(ll,rs,stmt,arg,...)        _sqlite_bind(__WHENCE__, (ll), (rs), (stmt), arg, ##__VA_ARGS__)
 #define sqlite_retry(rs,action)                         _sqlite_retry(__WHENCE__, (rs), (action))
@@ -673,7 +690,7 @@ void rhizome_list_release(struct rhizome_list_cursor *);
 
 int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct socket_address *addr, const struct subscriber *peer);
 rhizome_manifest * rhizome_fetch_search(const unsigned char *id, int prefix_length);
-int rhizome_fetch_bar_queued(const rhizome_bar_t *bar);
+int rhizome_fetch_bar_queued(const rhizome_bar_t *bar, const struct subscriber *peer);
 
 /* Rhizome file storage api */
 struct rhizome_write_buffer
@@ -722,6 +739,8 @@ struct rhizome_read
   
   uint64_t blob_rowid;
   int blob_fd;
+  // external blob files are mapped into memory, NULL if they could not be
+  const unsigned char *blob_map;
   
   uint64_t tail;
   uint64_t offset;
@@ -734,7 +753,7 @@ struct rhizome_read
   unsigned char nonce[crypto_box_NONCEBYTES];
 };
 
-int rhizome_received_content(const unsigned char *bidprefix,uint64_t version, 
+int rhizome_received_content(const struct subscriber *peer, const unsigned char *bidprefix,uint64_t version, 
 			     uint64_t offset, size_t count,unsigned char *bytes);
 
 int is_rhizome_enabled();
@@ -860,6 +879,17 @@ rhizome_fetch_request_manifest_by_prefix(const struct socket_address *addr,
 int rhizome_any_fetch_active();
 int rhizome_any_fetch_queued();
 int rhizome_fetch_status_html(struct strbuf *b);
+
+/* Payload bytes that fetches have received from one peer, and the smoothed rate at which they
+ * arrived.  Kept in the peer's subscriber struct.
+ */
+struct rhizome_fetch_peer_stats {
+  uint64_t bytes;
+  uint64_t bytes_per_sec;
+  uint64_t interval_bytes;
+  time_ms_t interval_start;
+};
+void rhizome_fetch_peer_received(const struct subscriber *peer, size_t bytes, time_ms_t now);
 int rhizome_fetch_has_queue_space(unsigned char log2_size);
 
 /* Rhizome storage methods */
@@ -889,6 +919,7 @@ int rhizome_crypt_xor_block(unsigned char *buffer, size_t buffer_size, uint64_t
 enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp);
 ssize_t rhizome_read(struct rhizome_read *read, unsigned char *buffer, size_t buffer_length);
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len);
+ssize_t rhizome_read_direct(struct rhizome_read *read, int *fdp, uint64_t *offsetp, size_t len);
 void rhizome_read_close(struct rhizome_read *read);
 enum rhizome_payload_status rhizome_open_decrypt_read(rhizome_manifest *m, struct rhizome_read *read_state);
 enum rhizome_payload_status rhizome_extract_file(rhizome_manifest *m, const char *filepath);
@@ -900,6 +931,7 @@ int rhizome_cache_close();
 int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t version, rhizome_filehash_t *hashp);
 
 void rhizome_sync_status();
+void rhizome_sync_keys_save();
 
 DECLARE_ALARM(rhizome_fetch_status);
 
@@ -23,7 +23,9 @@
 #include "keyring.h"
 #include "commandline.h"
 #include "rhizome.h"
+#include "meshms.h"
 #include "instance.h"
+#include "mem.h"
 
 DEFINE_FEATURE(cli_rhizome);
 
@@ -493,6 +495,42 @@ static int app_rhizome_clean(const struct cli_parsed *parsed, struct cli_context
   return 0;
 }
 
+DEFINE_CMD(app_rhizome_status, 0,
+  "Display the space used by the Rhizome store",
+  "rhizome","status");
+static int app_rhizome_status(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  if (rhizome_opendb() == -1)
+    return -1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  struct rhizome_store_usage usage;
+  if (rhizome_store_usage(&retry, &usage) == -1)
+    return -1;
+  cli_field_name(context, "internal_bytes", ":");
+  cli_put_long(context, usage.internal_bytes, "\n");
+  cli_field_name(context, "external_bytes", ":");
+  cli_put_long(context, usage.external_bytes, "\n");
+  cli_field_name(context, "database_bytes", ":");
+  cli_put_long(context, usage.db_page_size * usage.db_page_count, "\n");
+  cli_field_name(context, "database_free_bytes", ":");
+  cli_put_long(context, usage.db_page_size * usage.db_free_page_count, "\n");
+  cli_field_name(context, "used_bytes", ":");
+  cli_put_long(context, usage.used_bytes, "\n");
+  if (usage.limit_bytes != UINT64_MAX) {
+    cli_field_name(context, "limit_bytes", ":");
+    cli_put_long(context, usage.limit_bytes, "\n");
+  }
+  uint64_t journal_entries = 0;
+  if (sqlite_exec_uint64_retry(&retry, &journal_entries, "SELECT COUNT(*) FROM SYNC_JOURNAL;", END) == -1)
+    return -1;
+  cli_field_name(context, "sync_journal_entries", ":");
+  cli_put_long(context, journal_entries, "\n");
+  return 0;
+}
+
 DEFINE_CMD(app_rhizome_extract, 0,
   "Export a manifest and payload file to the given paths, without decrypting.",
   "rhizome","export","bundle" KEYRING_PIN_OPTIONS,
@@ -779,3 +817,214 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
   return 0;
 }
 
+
+/* The original page at a time XSalsa20 implementation of rhizome_crypt_xor_block(), kept as a
+ * reference for correctness and speed comparison.
+ */
+static void rhizome_crypt_xor_block_reference(unsigned char *buffer, size_t buffer_size, uint64_t stream_offset,
+					      const unsigned char *key, const unsigned char *nonce)
+{
+  uint64_t nonce_offset = stream_offset & ~(RHIZOME_CRYPT_PAGE_SIZE -1);
+  size_t offset=0;
+  unsigned char block_nonce[crypto_box_NONCEBYTES];
+  bcopy(nonce, block_nonce, sizeof(block_nonce));
+  uint64_t value = nonce_offset;
+  int i;
+  for (i = crypto_box_NONCEBYTES - 1; i >= 0 && value; --i) {
+    int x = block_nonce[i] + (value & 0xFF);
+    block_nonce[i] = x & 0xFF;
+    value = (value >> 8) + (x >> 8);
+  }
+  while (offset < buffer_size) {
+    size_t padding = offset == 0 ? stream_offset & (RHIZOME_CRYPT_PAGE_SIZE -1) : 0;
+    size_t size = RHIZOME_CRYPT_PAGE_SIZE - padding;
+    if (size > buffer_size - offset)
+      size = buffer_size - offset;
+    unsigned char temp[RHIZOME_CRYPT_PAGE_SIZE];
+    bcopy(buffer + offset, temp + padding, size);
+    crypto_stream_xsalsa20_xor(temp, temp, size + padding, block_nonce, key);
+    bcopy(temp + padding, buffer + offset, size);
+    for (i = crypto_box_NONCEBYTES - 1, value = RHIZOME_CRYPT_PAGE_SIZE; i >= 0 && value; --i) {
+      int x = block_nonce[i] + (value & 0xFF);
+      block_nonce[i] = x & 0xFF;
+      value = (value >> 8) + (x >> 8);
+    }
+    offset += size;
+  }
+}
+
+static int put_query_plan(struct cli_context *context, const char *name, sqlite3_stmt *statement)
+{
+  strbuf plan = strbuf_alloca(1024);
+  if (rhizome_query_plan(statement, plan) == -1)
+    return -1;
+  const char *line = strbuf_str(plan);
+  const char *eol;
+  while ((eol = strchr(line, '\n'))) {
+    cli_field_name(context, name, ":");
+    cli_put_string(context, alloca_strndup(line, eol - line), "\n");
+    line = eol + 1;
+  }
+  return 0;
+}
+
+static int put_list_query_plan(struct cli_context *context, const char *name, struct rhizome_list_cursor *cursor)
+{
+  if (rhizome_list_open(cursor) == -1)
+    return -1;
+  int ret = put_query_plan(context, name, cursor->_statement);
+  rhizome_list_release(cursor);
+  return ret;
+}
+
+DEFINE_CMD(app_rhizome_query_plan, 0,
+   "Show the SQLite query plans used to list bundles and MeshMS conversations",
+   "test","rhizome","queryplan");
+static int app_rhizome_query_plan(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  if (rhizome_opendb() == -1)
+    return -1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare(&retry, MESHMS_CONVERSATIONS_SQL);
+  if (!statement)
+    return -1;
+  int ret = put_query_plan(context, "meshms_conversations", statement);
+  sqlite3_finalize(statement);
+  if (ret == -1)
+    return -1;
+
+  struct rhizome_list_cursor cursor;
+  bzero(&cursor, sizeof cursor);
+  cursor.service = RHIZOME_SERVICE_MESHMS2;
+  if (put_list_query_plan(context, "list_service", &cursor) == -1)
+    return -1;
+  bzero(&cursor, sizeof cursor);
+  cursor.service = RHIZOME_SERVICE_MESHMS2;
+  cursor.is_sender_set = 1;
+  if (put_list_query_plan(context, "list_service_sender", &cursor) == -1)
+    return -1;
+  bzero(&cursor, sizeof cursor);
+  cursor.service = RHIZOME_SERVICE_MESHMS2;
+  cursor.is_recipient_set = 1;
+  cursor.rowid_since = 1;
+  cursor.oldest_first = 1;
+  if (put_list_query_plan(context, "list_service_recipient_since", &cursor) == -1)
+    return -1;
+  return 0;
+}
+
+DEFINE_CMD(app_rhizome_crypt_test, 0,
+   "Run rhizome payload encryption speed test",
+   "test","rhizome","crypt");
+static int app_rhizome_crypt_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  unsigned char key[RHIZOME_CRYPT_KEY_BYTES];
+  unsigned char nonce[crypto_box_NONCEBYTES];
+  randombytes_buf(key, sizeof key);
+  randombytes_buf(nonce, sizeof nonce);
+  // make the page offset carry into the first 16 bytes of the nonce
+  memset(&nonce[crypto_box_NONCEBYTES - 8], 0xFF, 6);
+
+  const size_t max_len = 1024*1024;
+  unsigned char *plain = emalloc(max_len);
+  unsigned char *expect = emalloc(max_len);
+  unsigned char *actual = emalloc(max_len);
+  if (!plain || !expect || !actual) {
+    free(plain);
+    free(expect);
+    free(actual);
+    return -1;
+  }
+  randombytes_buf(plain, max_len);
+
+  static const uint64_t offsets[] = {0, 1, 100, 4095, 4096, 12345};
+  static const size_t lengths[] = {1, 63, 100, 4096, 5000, 65536, 1024*1024 - 12345};
+  unsigned o, l;
+  int ret = 0;
+  for (o = 0; o < NELS(offsets); ++o) {
+    for (l = 0; l < NELS(lengths); ++l) {
+      size_t len = lengths[l];
+      bcopy(plain, expect, len);
+      bcopy(plain, actual, len);
+      rhizome_crypt_xor_block_reference(expect, len, offsets[o], key, nonce);
+      rhizome_crypt_xor_block(actual, len, offsets[o], key, nonce);
+      if (memcmp(expect, actual, len) != 0) {
+	ret = WHYF("rhizome_crypt_xor_block() mismatch, offset=%"PRIu64" length=%zu", offsets[o], len);
+	goto end;
+      }
+    }
+  }
+  cli_printf(context, "Rhizome payload encryption matches reference implementation.\n");
+
+  cli_printf(context, "Benchmarking rhizome payload encryption:\n");
+  static const size_t sizes[] = {4096, 65536, 1024*1024};
+  unsigned s;
+  for (s = 0; s < NELS(sizes); ++s) {
+    size_t len = sizes[s];
+    uint64_t offset;
+    for (offset = 0; offset <= 100; offset += 100) {
+      int count = (int)(64*1024*1024 / len);
+      int i;
+      time_ms_t start = gettime_ms();
+      for (i = 0; i < count; ++i)
+	rhizome_crypt_xor_block_reference(actual, len, offset, key, nonce);
+      time_ms_t mid = gettime_ms();
+      for (i = 0; i < count; ++i)
+	rhizome_crypt_xor_block(actual, len, offset, key, nonce);
+      time_ms_t end = gettime_ms();
+      double mbytes = (double)len * count / (1024*1024);
+      cli_printf(context, "%zu bytes at offset %"PRIu64" - reference %.1fMB/s, current %.1fMB/s\n",
+	  len, offset,
+	  mbytes * 1000 / (mid > start ? mid - start : 1),
+	  mbytes * 1000 / (end > mid ? end - mid : 1));
+    }
+  }
+end:
+  free(plain);
+  free(expect);
+  free(actual);
+  return ret;
+}
+
+DEFINE_CMD(app_rhizome_fetch_stats_test, 0,
+   "Feed a fixed sequence of received payload bytes into the per-peer fetch counters and show them",
+   "test","rhizome","fetchstats");
+static int app_rhizome_fetch_stats_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  sid_t sids[2];
+  struct subscriber *peers[2];
+  unsigned i;
+  for (i = 0; i < NELS(peers); ++i) {
+    randombytes_buf(sids[i].binary, sizeof sids[i].binary);
+    if ((peers[i] = find_subscriber(sids[i].binary, sizeof sids[i].binary, 1)) == NULL)
+      return -1;
+  }
+  // received bytes and the milliseconds after the first reception when they arrived
+  static const struct {
+    unsigned peer;
+    size_t bytes;
+    time_ms_t offset;
+  } received[] = {
+    {0, 1000, 0},
+    {1, 500, 0},
+    {0, 3000, 500},
+    {0, 2000, 1000},
+    {1, 500, 2000},
+    {0, 4000, 3000},
+  };
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < NELS(received); ++i)
+    rhizome_fetch_peer_received(peers[received[i].peer], received[i].bytes, start + received[i].offset);
+  for (i = 0; i < NELS(peers); ++i) {
+    const struct rhizome_fetch_peer_stats *ps = peers[i]->fetch_stats;
+    if (!ps)
+      return WHYF("No fetch counters for peer %u", i);
+    cli_printf(context, "peer %u: %"PRIu64" bytes received, %"PRIu64" bytes/sec\n", i, ps->bytes, ps->bytes_per_sec);
+  }
+  return 0;
+}
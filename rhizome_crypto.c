@@ -498,43 +498,66 @@ static void add_nonce(unsigned char *nonce, uint64_t value)
 
 /* Encrypt a block of a stream in-place, allowing for offsets that don't align perfectly to block
  * boundaries for efficiency the caller should use a buffer size of (n*RHIZOME_CRYPT_PAGE_SIZE).
+ *
+ * Each page is XSalsa20 encrypted with the payload nonce plus the page's stream offset.  XSalsa20
+ * derives a Salsa20 key from the key and the first 16 bytes of the nonce, and the page offset only
+ * alters the last 8 bytes, so we derive that key once per call and run Salsa20 directly over each
+ * page.  Unaligned starts skip whole 64 byte Salsa20 blocks using the initial block counter, so at
+ * most one partial block is copied.
  */
 int rhizome_crypt_xor_block(unsigned char *buffer, size_t buffer_size, uint64_t stream_offset, 
 			    const unsigned char *key, const unsigned char *nonce)
 {
   uint64_t nonce_offset = stream_offset & ~(RHIZOME_CRYPT_PAGE_SIZE -1);
+  size_t padding = stream_offset & (RHIZOME_CRYPT_PAGE_SIZE -1);
   size_t offset=0;
   
   unsigned char block_nonce[crypto_box_NONCEBYTES];
   bcopy(nonce, block_nonce, sizeof(block_nonce));
   add_nonce(block_nonce, nonce_offset);
   
-  if (nonce_offset < stream_offset){
-    size_t padding = stream_offset & (RHIZOME_CRYPT_PAGE_SIZE -1);
-    size_t size = RHIZOME_CRYPT_PAGE_SIZE - padding;
-    if (size>buffer_size)
-      size=buffer_size;
-    
-    unsigned char temp[RHIZOME_CRYPT_PAGE_SIZE];
-    bcopy(buffer, temp + padding, size);
-    crypto_stream_xsalsa20_xor(temp, temp, size+padding, block_nonce, key);
-    bcopy(temp + padding, buffer, size);
-    
-    add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
-    offset+=size;
-  }
+  unsigned char subkey[crypto_core_hsalsa20_OUTPUTBYTES];
+  unsigned char subkey_nonce[crypto_core_hsalsa20_INPUTBYTES];
+  crypto_core_hsalsa20(subkey, block_nonce, key, NULL);
+  bcopy(block_nonce, subkey_nonce, sizeof subkey_nonce);
   
   while(offset < buffer_size){
-    size_t size = buffer_size - offset;
-    if (size>RHIZOME_CRYPT_PAGE_SIZE)
-      size=RHIZOME_CRYPT_PAGE_SIZE;
+    size_t size = RHIZOME_CRYPT_PAGE_SIZE - padding;
+    if (size > buffer_size - offset)
+      size = buffer_size - offset;
     
-    crypto_stream_xsalsa20_xor(buffer+offset, buffer+offset, (unsigned long long) size, block_nonce, key);
+    // adding the page offset may carry into the first 16 bytes of the nonce
+    if (memcmp(subkey_nonce, block_nonce, sizeof subkey_nonce)!=0){
+      crypto_core_hsalsa20(subkey, block_nonce, key, NULL);
+      bcopy(block_nonce, subkey_nonce, sizeof subkey_nonce);
+    }
+    
+    const unsigned char *page_nonce = block_nonce + crypto_core_hsalsa20_INPUTBYTES;
+    unsigned char *p = buffer + offset;
+    size_t len = size;
+    uint64_t ic = padding / 64;
+    size_t skip = padding % 64;
+    if (skip){
+      unsigned char temp[64];
+      size_t n = 64 - skip;
+      if (n > len)
+	n = len;
+      bcopy(p, temp + skip, n);
+      crypto_stream_salsa20_xor_ic(temp, temp, skip + n, page_nonce, ic, subkey);
+      bcopy(temp + skip, p, n);
+      p += n;
+      len -= n;
+      ic++;
+    }
+    if (len)
+      crypto_stream_salsa20_xor_ic(p, p, (unsigned long long) len, page_nonce, ic, subkey);
     
     add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
     offset+=size;
+    padding=0;
   }
   
+  sodium_memzero(subkey, sizeof subkey);
   return 0;
 }
 
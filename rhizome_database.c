@@ -31,6 +31,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "keyring.h"
 #include "server.h"
 #include "commandline.h"
+#include "fdqueue.h"
 
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp);
 
@@ -193,6 +194,117 @@ void verify_bundles()
  * -- Andrew Bettison <andrew@servalproject.com>, October 2012
  */
 
+/* Apply the rhizome.db page cache, memory-mapped I/O and synchronous settings to a newly opened
+ * connection.  PRAGMA arguments cannot be bound as parameters, but these are all numbers, so
+ * formatting them into the SQL text is safe.
+ */
+static void rhizome_db_configure_connection()
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  char sql[80];
+  uint64_t value;
+  // a negative cache_size is in KiB instead of pages
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+      strbuf_str(strbuf_sprintf(strbuf_local_buf(sql), "PRAGMA cache_size=-%"PRIu64";", config.rhizome.db.cache_size / 1024)), END);
+  // returns the new limit, which SQLite may have capped
+  if (sqlite_exec_uint64_retry(&retry, &value,
+      strbuf_str(strbuf_sprintf(strbuf_local_buf(sql), "PRAGMA mmap_size=%"PRIu64";", config.rhizome.db.mmap_size)), END) == 1)
+    DEBUGF(rhizome, "Rhizome database mmap_size=%"PRIu64, value);
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+      strbuf_str(strbuf_sprintf(strbuf_local_buf(sql), "PRAGMA synchronous=%d;", config.rhizome.db.synchronous)), END);
+}
+
+DEFINE_ALARM(rhizome_wal_checkpoint);
+
+/* In write-ahead log mode the server checkpoints the log from its own schedule, rather than
+ * SQLite doing so in whichever commit happens to push the log over its limit.  A passive
+ * checkpoint never waits for readers or writers, so it cannot cause BUSY errors elsewhere.
+ */
+void rhizome_wal_checkpoint(struct sched_ent *alarm)
+{
+  if (!rhizome_db)
+    return;
+  int log_frames = 0, checkpointed_frames = 0;
+  int r = sqlite3_wal_checkpoint_v2(rhizome_db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed_frames);
+  if (r == SQLITE_OK)
+    DEBUGF(rhizome, "WAL checkpoint, %d of %d frames copied", checkpointed_frames, log_frames);
+  else if (r != SQLITE_BUSY && r != SQLITE_LOCKED)
+    WARNF("WAL checkpoint failed: %s", sqlite3_errmsg(rhizome_db));
+  time_ms_t next = gettime_ms() + config.rhizome.db.checkpoint_interval;
+  RESCHEDULE(alarm, next, next, TIME_MS_NEVER_WILL);
+}
+
+static void rhizome_db_configure_journal(sqlite_retry_state *retry)
+{
+  char mode[16];
+  if (sqlite_exec_strbuf_retry(retry, strbuf_local_buf(mode),
+	config.rhizome.db.wal ? "PRAGMA journal_mode=WAL;" : "PRAGMA journal_mode=DELETE;", END) != 1) {
+    WARN("Could not set Rhizome database journal mode");
+    return;
+  }
+  DEBUGF(rhizome, "Rhizome database journal_mode=%s", mode);
+  if (strcasecmp(mode, "wal") != 0 || !serverMode)
+    return;
+  uint64_t pages;
+  sqlite_exec_uint64_retry(retry, &pages, "PRAGMA wal_autocheckpoint=0;", END);
+  time_ms_t next = gettime_ms() + config.rhizome.db.checkpoint_interval;
+  RESCHEDULE(&ALARM_STRUCT(rhizome_wal_checkpoint), next, next, TIME_MS_NEVER_WILL);
+}
+
+/* Journal every change to the set of bundles that we can offer to sync peers, so the sync tree
+ * snapshot can be brought up to date without scanning every manifest.  Note that INSERT OR REPLACE
+ * does not fire delete triggers, so we also journal the old manifest hash before an insert.
+ *
+ * Nothing is journaled until the server has built a sync tree and recorded it in SYNC_SNAPSHOT,
+ * so a store that is only used from the command line does not grow a journal.  If the journal
+ * grows too far past the snapshot, it is discarded and journaling stops until the server rebuilds
+ * its tree from MANIFESTS.
+ */
+static void create_sync_journal_triggers()
+{
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS SYNC_SNAPSHOT("
+      "id integer primary key, "
+      "journal_id integer not null"
+    ");", END);
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_MANIFEST_REPLACE BEFORE INSERT ON MANIFESTS "
+	"WHEN EXISTS(SELECT 1 FROM SYNC_SNAPSHOT) BEGIN "
+	"INSERT INTO SYNC_JOURNAL(manifest_hash, present) "
+	  "SELECT manifest_hash, 0 FROM MANIFESTS WHERE id = NEW.id AND manifest_hash IS NOT NULL; "
+      "END;", END);
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_MANIFEST_INSERT AFTER INSERT ON MANIFESTS "
+	"WHEN EXISTS(SELECT 1 FROM SYNC_SNAPSHOT) AND NEW.manifest_hash IS NOT NULL "
+	"AND (NEW.filehash IS NULL OR EXISTS(SELECT 1 FROM FILES WHERE FILES.id = NEW.filehash)) BEGIN "
+	"INSERT INTO SYNC_JOURNAL(manifest_hash, present) VALUES (NEW.manifest_hash, 1); "
+      "END;", END);
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_MANIFEST_UPDATE AFTER UPDATE OF manifest_hash, filehash ON MANIFESTS "
+	"WHEN EXISTS(SELECT 1 FROM SYNC_SNAPSHOT) BEGIN "
+	"INSERT INTO SYNC_JOURNAL(manifest_hash, present) "
+	  "SELECT OLD.manifest_hash, 0 WHERE OLD.manifest_hash IS NOT NULL; "
+	"INSERT INTO SYNC_JOURNAL(manifest_hash, present) "
+	  "SELECT NEW.manifest_hash, 1 WHERE NEW.manifest_hash IS NOT NULL "
+	  "AND (NEW.filehash IS NULL OR EXISTS(SELECT 1 FROM FILES WHERE FILES.id = NEW.filehash)); "
+      "END;", END);
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_MANIFEST_DELETE AFTER DELETE ON MANIFESTS "
+	"WHEN EXISTS(SELECT 1 FROM SYNC_SNAPSHOT) AND OLD.manifest_hash IS NOT NULL BEGIN "
+	"INSERT INTO SYNC_JOURNAL(manifest_hash, present) VALUES (OLD.manifest_hash, 0); "
+      "END;", END);
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_FILE_INSERT AFTER INSERT ON FILES "
+	"WHEN EXISTS(SELECT 1 FROM SYNC_SNAPSHOT) BEGIN "
+	"INSERT INTO SYNC_JOURNAL(manifest_hash, present) "
+	  "SELECT manifest_hash, 1 FROM MANIFESTS WHERE filehash = NEW.id AND manifest_hash IS NOT NULL; "
+      "END;", END);
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_FILE_DELETE AFTER DELETE ON FILES "
+	"WHEN EXISTS(SELECT 1 FROM SYNC_SNAPSHOT) BEGIN "
+	"INSERT INTO SYNC_JOURNAL(manifest_hash, present) "
+	  "SELECT manifest_hash, 0 FROM MANIFESTS WHERE filehash = OLD.id AND manifest_hash IS NOT NULL; "
+      "END;", END);
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_JOURNAL_LIMIT AFTER INSERT ON SYNC_JOURNAL "
+      "WHEN NEW.id > (SELECT journal_id FROM SYNC_SNAPSHOT) + 65536 BEGIN "
+      "DELETE FROM SYNC_JOURNAL; "
+      "DELETE FROM SYNC_SNAPSHOT; "
+    "END;", END);
+}
+
 int rhizome_opendb()
 {
   if (rhizome_db) {
@@ -241,6 +353,8 @@ int rhizome_opendb()
   const char *env = getenv("SERVALD_RHIZOME_DB_RETRY_LIMIT_MS");
   rhizomeRetryLimit = env ? atoi(env) : -1;
 
+  rhizome_db_configure_connection();
+
   /* Read Rhizome configuration */
   DEBUGF(rhizome, "Rhizome will use %"PRIu64"B of storage for its database.", (uint64_t) config.rhizome.database_size);
   
@@ -340,12 +454,106 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=8;", END);
   }
   
+  if (version<9){
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS SYNC_JOURNAL("
+	"id integer primary key autoincrement, "
+	"manifest_hash text not null, "
+	"present integer not null"
+      ");", END);
+    create_sync_journal_triggers();
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=9;", END);
+  }
+  
+  if (version<10){
+    // Keep running totals of payload bytes stored inside and outside the database, so that
+    // store_make_space() does not need to scan every file.  A payload is internal if it has a
+    // FILEBLOBS row with the same id, so totals move between the two columns as blobs come and go.
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS STORE_USAGE("
+	"internal_bytes integer not null, "
+	"external_bytes integer not null"
+      ");", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM STORE_USAGE;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "INSERT INTO STORE_USAGE(internal_bytes, external_bytes) "
+	"SELECT "
+	  "IFNULL(SUM(CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE FILEBLOBS.id = FILES.id) THEN length ELSE 0 END), 0), "
+	  "IFNULL(SUM(CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE FILEBLOBS.id = FILES.id) THEN 0 ELSE length END), 0) "
+	"FROM FILES;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS STORE_FILE_INSERT AFTER INSERT ON FILES BEGIN "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes + CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = NEW.id) THEN IFNULL(NEW.length, 0) ELSE 0 END, "
+	  "external_bytes = external_bytes + CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = NEW.id) THEN 0 ELSE IFNULL(NEW.length, 0) END; "
+      "END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS STORE_FILE_DELETE AFTER DELETE ON FILES BEGIN "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes - CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = OLD.id) THEN IFNULL(OLD.length, 0) ELSE 0 END, "
+	  "external_bytes = external_bytes - CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = OLD.id) THEN 0 ELSE IFNULL(OLD.length, 0) END; "
+      "END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS STORE_FILE_UPDATE AFTER UPDATE OF id, length ON FILES BEGIN "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes - CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = OLD.id) THEN IFNULL(OLD.length, 0) ELSE 0 END, "
+	  "external_bytes = external_bytes - CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = OLD.id) THEN 0 ELSE IFNULL(OLD.length, 0) END; "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes + CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = NEW.id) THEN IFNULL(NEW.length, 0) ELSE 0 END, "
+	  "external_bytes = external_bytes + CASE WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = NEW.id) THEN 0 ELSE IFNULL(NEW.length, 0) END; "
+      "END;", END);
+    // INSERT OR REPLACE does not fire delete triggers, so move any replaced blob out first
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS STORE_BLOB_REPLACE BEFORE INSERT ON FILEBLOBS "
+	"WHEN EXISTS(SELECT 1 FROM FILEBLOBS WHERE id = NEW.id) BEGIN "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes - (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = NEW.id), "
+	  "external_bytes = external_bytes + (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = NEW.id); "
+      "END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS STORE_BLOB_INSERT AFTER INSERT ON FILEBLOBS BEGIN "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes + (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = NEW.id), "
+	  "external_bytes = external_bytes - (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = NEW.id); "
+      "END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS STORE_BLOB_DELETE AFTER DELETE ON FILEBLOBS BEGIN "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes - (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = OLD.id), "
+	  "external_bytes = external_bytes + (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = OLD.id); "
+      "END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS STORE_BLOB_UPDATE AFTER UPDATE OF id ON FILEBLOBS BEGIN "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes - (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = OLD.id), "
+	  "external_bytes = external_bytes + (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = OLD.id); "
+	"UPDATE STORE_USAGE SET "
+	  "internal_bytes = internal_bytes + (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = NEW.id), "
+	  "external_bytes = external_bytes - (SELECT IFNULL(SUM(length), 0) FROM FILES WHERE id = NEW.id); "
+      "END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=10;", END);
+  }
+  if (version<11){
+    // Conversation discovery and bundle lists filter on service and sender or recipient.  SQLite
+    // appends the rowid to every index entry, so these also return rows in rowid order.
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE ON MANIFESTS(service);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE_SENDER ON MANIFESTS(service, sender);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE_RECIPIENT ON MANIFESTS(service, recipient);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=11;", END);
+  }
+  if (version<12){
+    // Only journal changes once the server keeps a sync tree, and cap the journal's length.
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DROP TRIGGER IF EXISTS SYNC_MANIFEST_REPLACE;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DROP TRIGGER IF EXISTS SYNC_MANIFEST_INSERT;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DROP TRIGGER IF EXISTS SYNC_MANIFEST_UPDATE;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DROP TRIGGER IF EXISTS SYNC_MANIFEST_DELETE;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DROP TRIGGER IF EXISTS SYNC_FILE_INSERT;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DROP TRIGGER IF EXISTS SYNC_FILE_DELETE;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM SYNC_JOURNAL;", END);
+    create_sync_journal_triggers();
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=12;", END);
+  }
+  
   // TODO recreate tables with collate nocase on all hex columns
 
   /* Future schema updates should be performed here. 
    The above schema can be assumed to exist, no matter which version we upgraded from.
    All changes should attempt to preserve all existing interesting data */
 
+  // Change the journal mode once the schema exists, as auto_vacuum can only be set on a database
+  // without any tables.
+  rhizome_db_configure_journal(&retry);
+
   char buf[UUID_STRLEN + 1];
   int r = sqlite_exec_strbuf_retry(&retry, strbuf_local_buf(buf), "SELECT uuid from IDENTITY LIMIT 1;", END);
   if (r == -1)
@@ -370,6 +578,8 @@ int rhizome_opendb()
   // We can't delete a file that is being transferred in another process at this very moment...
   if (config.rhizome.clean_on_open)
     rhizome_cleanup(NULL);
+  // Don't keep statements that were only needed to create or upgrade the schema.
+  sqlite_statement_cache_flush();
   INFOF("Opened Rhizome database %s, UUID=%s", dbpath, alloca_uuid_str(rhizome_db_uuid));
   RETURN(0);
   OUT();
@@ -379,12 +589,16 @@ int rhizome_close_db()
 {
   IN();
   if (rhizome_db) {
+    if (is_scheduled(&ALARM_STRUCT(rhizome_wal_checkpoint)))
+      unschedule(&ALARM_STRUCT(rhizome_wal_checkpoint));
     rhizome_cache_close();
+    rhizome_sync_keys_save();
     
     if (!sqlite3_get_autocommit(rhizome_db)){
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;", END);
     }
+    sqlite_statement_cache_flush();
     sqlite3_stmt *stmt = NULL;
     while ((stmt = sqlite3_next_stmt(rhizome_db, stmt))) {
       const char *sql = sqlite3_sql(stmt);
@@ -444,10 +658,10 @@ static void rhizome_on_cmd_cleanup()
    timeout, giving a greater chance of success at the expense of potentially greater latency.
  */
 
-/* In the servald server process, by default we retry every 10 ms for up to 50 ms, so as to not
-   introduce too much latency into server responsiveness.  In other processes (eg, Batphone MeshMS
-   thread), by default we allow busy retries to go for over a second, waiting 100 ms between each
-   retry.
+/* In the servald server process, by default we retry at most every 10 ms for up to 50 ms, so as to
+   not introduce too much latency into server responsiveness.  In other processes (eg, Batphone
+   MeshMS thread), by default we allow busy retries to go for over a second, waiting at most 100 ms
+   between each retry.  The first retries sleep for only a few milliseconds; see _sqlite_retry().
  */
 sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int otherLimit, int otherSleep)
 {
@@ -484,8 +698,16 @@ int _sqlite_retry(struct __sourceloc __whence, sqlite_retry_state *retry, const
     return 0; // tell caller to stop trying
   }
   
-  if (retry->sleep)
-    sleep_ms(retry->sleep);
+  // Most locks are released quickly (in WAL mode only another writer can hold one), so start with
+  // a short sleep and back off exponentially up to the configured interval, without overshooting
+  // the limit.
+  unsigned sleep = retry->sleep;
+  if (retry->busytries < 16 && (1u << retry->busytries) < sleep)
+    sleep = 1u << retry->busytries;
+  if (retry->elapsed + sleep > retry->limit)
+    sleep = retry->limit - retry->elapsed;
+  if (sleep)
+    sleep_ms(sleep);
   return 1; // tell caller to try again
 }
 
@@ -547,7 +769,8 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite
 }
 
 /* Bind some parameters to a prepared SQL statement.  Returns -1 if an error occurs (logged as an
- * error), otherwise zero with the prepared statement in *statement.
+ * error), otherwise zero with the prepared statement in *statement.  The statement is not finalised
+ * on error; that is left to the caller.
  *
  * Developed as part of GitHub issue #69.
  *
@@ -607,7 +830,6 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 		continue; \
 	    default: \
 	      LOGF(log_level, #FUNC "(%d) failed, %s: %s", index, sqlite3_errmsg(rhizome_db), sqlite3_sql(statement)); \
-	      sqlite3_finalize(statement); \
 	      return -1; \
 	  } \
 	  break; \
@@ -618,7 +840,6 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	  BIND_RETRY(sqlite3_bind_null); \
 	} else { \
 	  LOGF(log_level, "at bind arg %u, %s%s parameter is NULL: %s", argnum, #TYP, strbuf_str(ext), sqlite3_sql(statement)); \
-	  sqlite3_finalize(statement); \
 	  return -1; \
 	}
     switch (typ) {
@@ -888,6 +1109,118 @@ sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc __whence, int log_level, s
   return statement;
 }
 
+/* Prepared statement cache.
+ *
+ * Compiling SQL is a large part of the cost of the small queries that are made for every advert
+ * received, eg, is_interesting() and rhizome_exists().  Statements obtained from
+ * sqlite_prepare_cached() or sqlite_prepare_bind_cached() are handed back by sqlite_release()
+ * instead of being finalised, and are reset and re-bound the next time the same SQL text is
+ * prepared.  A statement is taken out of the cache while it is in use, so the same query may be
+ * nested within itself (it just gets prepared afresh).
+ *
+ * Like rhizome_db itself, the cache is per-thread.  It is direct-mapped by a hash of the SQL text; a statement released into an occupied slot
+ * evicts (finalises) the previous occupant.  sqlite3_prepare_v2() statements re-compile themselves
+ * if the schema changes, but the cache is flushed after the schema is created or upgraded in
+ * rhizome_opendb() and before the database is closed.
+ */
+
+#define SQLITE_STATEMENT_CACHE_SIZE 64
+
+static __thread struct sqlite_statement_cache_entry {
+  uint32_t hash;
+  sqlite3_stmt *statement;
+} statement_cache[SQLITE_STATEMENT_CACHE_SIZE];
+
+static __thread struct {
+  uint64_t prepares;
+  uint64_t hits;
+  uint64_t evictions;
+} statement_cache_stats;
+
+static uint32_t sqltext_hash(const char *sqltext)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (; *sqltext; ++sqltext)
+    hash = (hash ^ (unsigned char)*sqltext) * 16777619u;
+  return hash;
+}
+
+sqlite3_stmt *_sqlite_prepare_cached(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sqltext)
+{
+  uint32_t hash = sqltext_hash(sqltext);
+  struct sqlite_statement_cache_entry *entry = &statement_cache[hash % SQLITE_STATEMENT_CACHE_SIZE];
+  if (entry->statement && entry->hash == hash && strcmp(sqlite3_sql(entry->statement), sqltext) == 0) {
+    sqlite3_stmt *statement = entry->statement;
+    entry->statement = NULL;
+    statement_cache_stats.hits++;
+    sqlite_trace_done = 0;
+    return statement;
+  }
+  statement_cache_stats.prepares++;
+  return _sqlite_prepare(__whence, log_level, retry, sqltext);
+}
+
+sqlite3_stmt *_sqlite_prepare_bind_cached(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sqltext, ...)
+{
+  sqlite3_stmt *statement = _sqlite_prepare_cached(__whence, log_level, retry, sqltext);
+  if (statement != NULL) {
+    va_list ap;
+    va_start(ap, sqltext);
+    int ret = _sqlite_vbind(__whence, log_level, retry, statement, ap);
+    va_end(ap);
+    if (ret == -1) {
+      sqlite_release(statement);
+      statement = NULL;
+    }
+  }
+  return statement;
+}
+
+/* Return a statement to the prepared statement cache, in place of sqlite3_finalize().
+ */
+void sqlite_release(sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  const char *sqltext = sqlite3_sql(statement);
+  if (!sqltext || !rhizome_db) {
+    sqlite3_finalize(statement);
+    return;
+  }
+  sqlite3_reset(statement);
+  sqlite3_clear_bindings(statement);
+  uint32_t hash = sqltext_hash(sqltext);
+  struct sqlite_statement_cache_entry *entry = &statement_cache[hash % SQLITE_STATEMENT_CACHE_SIZE];
+  if (entry->statement) {
+    sqlite3_finalize(entry->statement);
+    statement_cache_stats.evictions++;
+  }
+  entry->hash = hash;
+  entry->statement = statement;
+}
+
+void sqlite_statement_cache_flush()
+{
+  unsigned i;
+  for (i = 0; i < NELS(statement_cache); ++i) {
+    if (statement_cache[i].statement) {
+      sqlite3_finalize(statement_cache[i].statement);
+      statement_cache[i].statement = NULL;
+    }
+  }
+}
+
+static void sqlite_show_statement_cache_stats()
+{
+  uint64_t lookups = statement_cache_stats.hits + statement_cache_stats.prepares;
+  INFOF("sqlite statement cache: %"PRIu64" prepares saved, %"PRIu64" prepared (%"PRIu64"%% hit rate), %"PRIu64" evictions",
+    statement_cache_stats.hits, statement_cache_stats.prepares,
+    lookups ? statement_cache_stats.hits * 100 / lookups : 0,
+    statement_cache_stats.evictions);
+}
+DEFINE_TRIGGER(show_stats, sqlite_show_statement_cache_stats);
+
 int _sqlite_step(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement)
 {
   IN();
@@ -921,20 +1254,26 @@ int _sqlite_step(struct __sourceloc __whence, int log_level, sqlite_retry_state
   return ret;
 }
 
-int _sqlite_exec_code(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, int *rowcount)
+static int _sqlite_exec_steps(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, int *rowcount)
 {
-  *rowcount = 0;
-  if (!statement)
-    return SQLITE_ERROR;
   int stepcode;
   while ((stepcode = _sqlite_step(__whence, log_level, retry, statement)) == SQLITE_ROW)
     ++(*rowcount);
-  sqlite3_finalize(statement);
   if (sqlite_trace_func())
     _DEBUGF("rowcount=%d changes=%d", *rowcount, sqlite3_changes(rhizome_db));
   return stepcode;
 }
 
+int _sqlite_exec_code(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, int *rowcount)
+{
+  *rowcount = 0;
+  if (!statement)
+    return SQLITE_ERROR;
+  int stepcode = _sqlite_exec_steps(__whence, log_level, retry, statement, rowcount);
+  sqlite3_finalize(statement);
+  return stepcode;
+}
+
 /*
  * Convenience wrapper for executing a prepared SQL statement where the row outputs are not wanted.
  * Always finalises the statement before returning.
@@ -961,15 +1300,18 @@ static int _sqlite_vexec_void_code(struct __sourceloc __whence, int log_level, s
 {
   *changes=0;
   *rowcount=0;
-  sqlite3_stmt *statement = _sqlite_prepare(__whence, log_level, retry, sqltext);
+  sqlite3_stmt *statement = _sqlite_prepare_cached(__whence, log_level, retry, sqltext);
   if (!statement)
     return SQLITE_ERROR;
-  if (_sqlite_vbind(__whence, log_level, retry, statement, ap) == -1)
+  if (_sqlite_vbind(__whence, log_level, retry, statement, ap) == -1) {
+    sqlite_release(statement);
     return SQLITE_ERROR;
-  int stepcode = _sqlite_exec_code(__whence, log_level, retry, statement, rowcount);
+  }
+  int stepcode = _sqlite_exec_steps(__whence, log_level, retry, statement, rowcount);
   if (sqlite_code_ok(stepcode)){
     *changes = sqlite3_changes(rhizome_db);
   }
+  sqlite_release(statement);
   return stepcode;
 }
 
@@ -1026,11 +1368,13 @@ int _sqlite_exec_changes_retry(struct __sourceloc __whence, int log_level, sqlit
 
 static int _sqlite_vexec_uint64(struct __sourceloc __whence, sqlite_retry_state *retry, uint64_t *result, const char *sqltext, va_list ap)
 {
-  sqlite3_stmt *statement = _sqlite_prepare(__whence, LOG_LEVEL_ERROR, retry, sqltext);
+  sqlite3_stmt *statement = _sqlite_prepare_cached(__whence, LOG_LEVEL_ERROR, retry, sqltext);
   if (!statement)
     return -1;
-  if (_sqlite_vbind(__whence, LOG_LEVEL_ERROR, retry, statement, ap) == -1)
+  if (_sqlite_vbind(__whence, LOG_LEVEL_ERROR, retry, statement, ap) == -1) {
+    sqlite_release(statement);
     return -1;
+  }
   int ret = 0;
   int rowcount = 0;
   int stepcode;
@@ -1043,7 +1387,7 @@ static int _sqlite_vexec_uint64(struct __sourceloc __whence, sqlite_retry_state
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (!sqlite_code_ok(stepcode) || ret == -1)
     return -1;
   if (sqlite_trace_func())
@@ -1116,11 +1460,13 @@ int _sqlite_exec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *r
 
 int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, const char *sqltext, va_list ap)
 {
-  sqlite3_stmt *statement = _sqlite_prepare(__whence, LOG_LEVEL_ERROR, retry, sqltext);
+  sqlite3_stmt *statement = _sqlite_prepare_cached(__whence, LOG_LEVEL_ERROR, retry, sqltext);
   if (!statement)
     return -1;
-  if (_sqlite_vbind(__whence, LOG_LEVEL_ERROR, retry, statement, ap) == -1)
+  if (_sqlite_vbind(__whence, LOG_LEVEL_ERROR, retry, statement, ap) == -1) {
+    sqlite_release(statement);
     return -1;
+  }
   int ret = 0;
   int rowcount = 0;
   int stepcode;
@@ -1133,10 +1479,34 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
+/* Append the query plan that SQLite has chosen for a prepared statement to the given strbuf, as
+ * one line per step.  Used to check that the listing queries make use of the MANIFESTS indexes.
+ */
+int rhizome_query_plan(sqlite3_stmt *statement, strbuf plan)
+{
+  strbuf sql = strbuf_alloca(1024);
+  strbuf_puts(sql, "EXPLAIN QUERY PLAN ");
+  strbuf_puts(sql, sqlite3_sql(statement));
+  if (strbuf_overrun(sql))
+    return WHYF("SQL command too long: %s", strbuf_str(sql));
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *explain = sqlite_prepare(&retry, strbuf_str(sql));
+  if (!explain)
+    return -1;
+  int r;
+  while ((r = sqlite_step_retry(&retry, explain)) == SQLITE_ROW) {
+    const char *detail = (const char *) sqlite3_column_text(explain, 3);
+    strbuf_puts(plan, detail ? detail : "");
+    strbuf_putc(plan, '\n');
+  }
+  sqlite3_finalize(explain);
+  return sqlite_code_ok(r) ? 0 : -1;
+}
+
 int _sqlite_blob_open_retry(
   struct __sourceloc __whence,
   int log_level,
@@ -1757,14 +2127,14 @@ enum rhizome_bundle_status rhizome_retrieve_manifest(const rhizome_bid_t *bidp,
 {
   DEBUGF(rhizome, "retrieve manifest bid=%s", bidp ? alloca_tohex_rhizome_bid_t(*bidp) : "<NULL>");
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+  sqlite3_stmt *statement = sqlite_prepare_bind_cached(&retry,
       "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE id = ?",
       RHIZOME_BID_T, bidp,
       END);
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return ret;
 }
 
@@ -1911,7 +2281,7 @@ static int is_interesting(const char *id_hex, uint64_t version)
 
   // do we have this bundle [or later]?
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+  sqlite3_stmt *statement = sqlite_prepare_bind_cached(&retry,
     "SELECT filehash FROM MANIFESTS WHERE id LIKE ? AND version >= ?",
     TEXT_TOUPPER, id_hex,
     INT64, version,
@@ -1934,7 +2304,7 @@ static int is_interesting(const char *id_hex, uint64_t version)
     ret=1;
   else
     ret=-1;
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   RETURN(ret);
   OUT();
 }
@@ -44,6 +44,19 @@ struct rhizome_fetch_candidate {
   const struct subscriber *peer;
 };
 
+/* A peer that an MDP fetch is requesting blocks from.  When several peers advertise the same
+ * bundle version, each is asked for a different window of the payload, so a large payload can be
+ * fetched from all of them at once.
+ */
+struct rhizome_fetch_source {
+  const struct subscriber *peer;
+  int responses_outstanding;
+  time_ms_t last_request_time;
+  time_ms_t last_rx_time;
+};
+
+#define RHIZOME_FETCH_MAX_SOURCES 8
+
 /* Represents an active fetch (in progress) of a bundle payload (.manifest != NULL) or of a bundle
  * manifest (.manifest == NULL).
  */
@@ -83,11 +96,9 @@ struct rhizome_fetch_slot {
   uint64_t bidVersion;
   int prefix_length;
   int mdpIdleTimeout;
-  time_ms_t mdp_last_request_time;
-  uint64_t mdp_last_request_offset;
-  int mdpResponsesOutstanding;
   int mdpRXBlockLength;
-  unsigned char mdpRXWindow[32*200];
+  unsigned source_count;
+  struct rhizome_fetch_source sources[RHIZOME_FETCH_MAX_SOURCES];
 };
 
 static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot);
@@ -96,6 +107,9 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
 /* Represents a queue of fetch candidates and a single active fetch for bundle payloads whose size
  * is less than a given threshold.
  *
+ * Candidate queues start at candidate_queue_initial entries and double in size whenever they fill,
+ * up to rhizome.fetch_queue_limit entries.
+ *
  * TODO: If the queues ever get much larger, use pointer-linked queue instead of physically ordered
  * in memory, to avoid the need for memory copies when deleting or inserting queue entries.
  *
@@ -104,34 +118,111 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
 struct rhizome_fetch_queue {
   struct rhizome_fetch_slot active; // must be first element in struct
   unsigned candidate_queue_size;
+  unsigned candidate_queue_initial;
   struct rhizome_fetch_candidate *candidate_queue;
   unsigned char log_size_threshold; // will only queue payloads smaller than this.
 };
 
-/* Static allocation of the candidate queues.
- */
-struct rhizome_fetch_candidate queue0[10];
-struct rhizome_fetch_candidate queue1[8];
-struct rhizome_fetch_candidate queue2[6];
-struct rhizome_fetch_candidate queue3[4];
-struct rhizome_fetch_candidate queue4[2];
-struct rhizome_fetch_candidate queue5[2];
-
 #define slotno(slot) (int)((struct rhizome_fetch_queue *)(slot) - &rhizome_fetch_queues[0])
 
 /* Static allocation of the queue structures.  Must be in order of ascending log_size_threshold.
  */
 struct rhizome_fetch_queue rhizome_fetch_queues[] = {
-  { .candidate_queue_size = NELS(queue0), .candidate_queue = queue0, .log_size_threshold =   10, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue1), .candidate_queue = queue1, .log_size_threshold =   13, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue2), .candidate_queue = queue2, .log_size_threshold =   16, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue3), .candidate_queue = queue3, .log_size_threshold =   19, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue4), .candidate_queue = queue4, .log_size_threshold =   22, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue5), .candidate_queue = queue5, .log_size_threshold = 0xFF, .active = { .state = RHIZOME_FETCH_FREE } }
+  { .candidate_queue_initial = 10, .log_size_threshold =   10, .active = { .state = RHIZOME_FETCH_FREE } },
+  { .candidate_queue_initial =  8, .log_size_threshold =   13, .active = { .state = RHIZOME_FETCH_FREE } },
+  { .candidate_queue_initial =  6, .log_size_threshold =   16, .active = { .state = RHIZOME_FETCH_FREE } },
+  { .candidate_queue_initial =  4, .log_size_threshold =   19, .active = { .state = RHIZOME_FETCH_FREE } },
+  { .candidate_queue_initial =  2, .log_size_threshold =   22, .active = { .state = RHIZOME_FETCH_FREE } },
+  { .candidate_queue_initial =  2, .log_size_threshold = 0xFF, .active = { .state = RHIZOME_FETCH_FREE } }
 };
 
 #define NQUEUES	    NELS(rhizome_fetch_queues)
 
+// fold the bytes received since the start of the current interval into the smoothed rate
+static void fetch_peer_update(struct rhizome_fetch_peer_stats *ps, time_ms_t now)
+{
+  time_ms_t elapsed = now - ps->interval_start;
+  if (elapsed < 1000)
+    return;
+  uint64_t rate = ps->interval_bytes * 1000 / elapsed;
+  ps->bytes_per_sec = (ps->bytes_per_sec + rate) / 2;
+  ps->interval_bytes = 0;
+  ps->interval_start = now;
+}
+
+/* Count payload bytes received from a peer.  The counters hang off the peer's subscriber, so there
+ * is one set per peer that has ever sent us payload content, and finding them costs nothing.
+ */
+void rhizome_fetch_peer_received(const struct subscriber *peer, size_t bytes, time_ms_t now)
+{
+  if (!peer)
+    return;
+  struct rhizome_fetch_peer_stats *ps = peer->fetch_stats;
+  if (!ps) {
+    if ((ps = emalloc_zero(sizeof *ps)) == NULL)
+      return;
+    ps->interval_start = now;
+    ((struct subscriber *)peer)->fetch_stats = ps;
+  }
+  ps->bytes += bytes;
+  ps->interval_bytes += bytes;
+  fetch_peer_update(ps, now);
+}
+
+static uint64_t fetch_peer_rate(const struct subscriber *peer)
+{
+  if (!peer->fetch_stats)
+    return 0;
+  fetch_peer_update(peer->fetch_stats, gettime_ms());
+  return peer->fetch_stats->bytes_per_sec;
+}
+
+static int fetch_peer_status(void **record, void *context)
+{
+  struct subscriber *peer = *record;
+  strbuf b = context;
+  if (!peer->fetch_stats)
+    return 0;
+  fetch_peer_update(peer->fetch_stats, gettime_ms());
+  if (b)
+    strbuf_sprintf(b, "<p>Peer %s*: %"PRIu64" bytes received, %"PRIu64" bytes/sec",
+	alloca_tohex_sid_t_trunc(peer->sid, 16),
+	peer->fetch_stats->bytes, peer->fetch_stats->bytes_per_sec);
+  else
+    DEBUGF(rhizome_rx, "Fetch peer %s*, received %"PRIu64" bytes, %"PRIu64" bytes/sec",
+	alloca_tohex_sid_t_trunc(peer->sid, 16),
+	peer->fetch_stats->bytes, peer->fetch_stats->bytes_per_sec);
+  return 0;
+}
+
+static unsigned rhizome_fetch_queue_limit(const struct rhizome_fetch_queue *q)
+{
+  unsigned limit = config.rhizome.fetch_queue_limit;
+  return limit < q->candidate_queue_initial ? q->candidate_queue_initial : limit;
+}
+
+/* Grow a candidate queue that has no empty entries, unless it has already reached its limit.
+ * Returns the index of the first new (empty) entry, or -1 if the queue cannot grow.
+ */
+static int rhizome_fetch_queue_grow(struct rhizome_fetch_queue *q)
+{
+  unsigned limit = rhizome_fetch_queue_limit(q);
+  if (q->candidate_queue_size >= limit)
+    return -1;
+  unsigned size = q->candidate_queue_size ? q->candidate_queue_size * 2 : q->candidate_queue_initial;
+  if (size > limit)
+    size = limit;
+  struct rhizome_fetch_candidate *queue = erealloc(q->candidate_queue, size * sizeof *queue);
+  if (!queue)
+    return -1;
+  unsigned first = q->candidate_queue_size;
+  bzero(&queue[first], (size - first) * sizeof *queue);
+  q->candidate_queue = queue;
+  q->candidate_queue_size = size;
+  DEBUGF(rhizome_rx, "grow queue[%d] to %u candidates", (int)(q - rhizome_fetch_queues), size);
+  return first;
+}
+
 static const char * fetch_state(int state)
 {
   switch (state){
@@ -179,7 +270,14 @@ void rhizome_fetch_status(struct sched_ent *alarm)
 	   q->active.state==RHIZOME_FETCH_FREE?0:q->active.write_state.file_offset,
 	   q->active.manifest?q->active.manifest->filesize:0
 	  );
+    if (q->active.state == RHIZOME_FETCH_RXFILEMDP) {
+      for (j = 0; j < q->active.source_count; ++j)
+	DEBUGF(rhizome_rx, "  source %s*, %d responses outstanding",
+	       alloca_tohex_sid_t_trunc(q->active.sources[j].peer->sid, 16),
+	       q->active.sources[j].responses_outstanding);
+    }
   }
+  enum_subscribers(NULL, fetch_peer_status, NULL);
   rhizome_sync_status();
   time_ms_t now = gettime_ms();
   RESCHEDULE(alarm, now + 3000, TIME_MS_NEVER_WILL, TIME_MS_NEVER_WILL);
@@ -207,10 +305,13 @@ int rhizome_fetch_status_html(strbuf b)
 	q->active.write_state.file_offset,
 	q->active.manifest->filesize,
 	q->active.peer?alloca_tohex_sid_t_trunc(q->active.peer->sid, 16):"unknown");
+      if (q->active.state == RHIZOME_FETCH_RXFILEMDP && q->active.source_count > 1)
+	strbuf_sprintf(b, " and %u other peers", q->active.source_count - 1);
     }else{
       strbuf_puts(b, "inactive");
     }
   }
+  enum_subscribers(NULL, fetch_peer_status, b);
   return 0;
 }
 
@@ -261,7 +362,7 @@ static struct rhizome_fetch_slot *fetch_search_slot(const unsigned char *id, int
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
     
-    if (q->active.state != RHIZOME_FETCH_FREE && 
+    if (q->active.state != RHIZOME_FETCH_FREE && q->active.manifest &&
 	memcmp(id, q->active.manifest->keypair.public_key.binary, prefix_length) == 0)
       return &q->active;
   }
@@ -298,11 +399,51 @@ rhizome_manifest * rhizome_fetch_search(const unsigned char *id, int prefix_leng
   return NULL;
 }
 
-int rhizome_fetch_bar_queued(const rhizome_bar_t *bar)
+/* Add a peer to an MDP fetch, if it is not already a source.  Returns 1 if added.
+ */
+static int fetch_add_source(struct rhizome_fetch_slot *slot, const struct subscriber *peer)
+{
+  unsigned max_sources = config.rhizome.mdp.max_sources;
+  if (max_sources > RHIZOME_FETCH_MAX_SOURCES)
+    max_sources = RHIZOME_FETCH_MAX_SOURCES;
+  if (slot->source_count >= max_sources)
+    return 0;
+  unsigned i;
+  for (i = 0; i < slot->source_count; ++i)
+    if (slot->sources[i].peer == peer)
+      return 0;
+  struct rhizome_fetch_source *src = &slot->sources[slot->source_count++];
+  bzero(src, sizeof *src);
+  src->peer = peer;
+  src->last_rx_time = gettime_ms();
+  DEBUGF(rhizome_rx, "Added source %s to fetch slot=%d, now %u sources",
+	 alloca_tohex_sid_t(peer->sid), slotno(slot), slot->source_count);
+  return 1;
+}
+
+static void fetch_remove_source(struct rhizome_fetch_slot *slot, unsigned i)
+{
+  assert(i < slot->source_count);
+  DEBUGF(rhizome_rx, "Dropping stalled source %s from fetch slot=%d",
+	 alloca_tohex_sid_t(slot->sources[i].peer->sid), slotno(slot));
+  slot->sources[i] = slot->sources[--slot->source_count];
+}
+
+/* Returns true if a fetch of this bundle version or a later one is already queued or active.  If
+ * an MDP fetch of the same version is active, the advertising peer is added as another source.
+ */
+int rhizome_fetch_bar_queued(const rhizome_bar_t *bar, const struct subscriber *peer)
 {
   const uint8_t *prefix = rhizome_bar_prefix(bar);
   uint64_t version = rhizome_bar_version(bar);
   
+  if (peer) {
+    struct rhizome_fetch_slot *slot = fetch_search_slot(prefix, RHIZOME_BAR_PREFIX_BYTES);
+    if (slot && slot->state == RHIZOME_FETCH_RXFILEMDP && slot->bidVersion == version
+      && fetch_add_source(slot, peer))
+      rhizome_fetch_mdp_requestblocks(slot);
+  }
+  
   rhizome_manifest *m=rhizome_fetch_search(prefix, RHIZOME_BAR_PREFIX_BYTES);
   if (m && m->version >= version)
     return 1;
@@ -389,7 +530,7 @@ int rhizome_any_fetch_queued()
 {
   unsigned i;
   for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].candidate_queue[0].manifest)
+    if (rhizome_fetch_queues[i].candidate_queue_size && rhizome_fetch_queues[i].candidate_queue[0].manifest)
       return 1;
   return 0;
 }
@@ -843,7 +984,8 @@ int rhizome_fetch_has_queue_space(unsigned char log2_size){
     for (j=0;j < q->candidate_queue_size;j++)
       if (!q->candidate_queue[j].manifest)
 	return 1;
-    return 0;
+    // or can the queue grow?
+    return q->candidate_queue_size < rhizome_fetch_queue_limit(q) ? 1 : 0;
   }
   return 0;
 }
@@ -934,7 +1076,10 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
 	j++;
     }
   }
-  // No duplicate was found, so if no free queue place was found either then bail out.
+  // No duplicate was found, so if no free queue place was found either, try to grow the queue,
+  // and if that fails then bail out.
+  if (ci == -1)
+    ci = rhizome_fetch_queue_grow(qi);
   if (ci == -1) {
     rhizome_manifest_free(m);
     RETURN(1);
@@ -1003,6 +1148,14 @@ static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
     OUT();
     return;
   }
+  // drop any source that has not sent anything for a while, so it does not hold up the fetch
+  unsigned i;
+  for (i = 0; i < slot->source_count && slot->source_count > 1; ) {
+    if (now - slot->sources[i].last_rx_time > slot->mdpIdleTimeout)
+      fetch_remove_source(slot, i);
+    else
+      ++i;
+  }
   DEBUGF(rhizome_rx, "Timeout: Resending request for slot=0x%p (%"PRIu64" of %"PRIu64" received)",
 	  slot, slot->write_state.file_offset,
 	  slot->write_state.file_length);
@@ -1026,65 +1179,110 @@ static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot)
   return 0;
 }
 
-static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+/* Build the bitmap of blocks that we already have in the 32 block window starting at the given
+ * offset, and return the number of blocks that still need to be requested.
+ */
+static int rhizome_fetch_mdp_window(struct rhizome_fetch_slot *slot, uint64_t offset, uint32_t *bitmap)
 {
-  IN();
-  // only issue new requests every 133ms.  
-  // we automatically re-issue once we have received all packets in this
-  // request also, so if there is no packet loss, we can go substantially
-  // faster.  Optimising behaviour when there is no packet loss is an
-  // outstanding task.
+  int requests=32;
+  int i;
+  struct rhizome_write_buffer *p = slot->write_state.buffer_list;
+  *bitmap=0;
+  for (i=0;i<32;i++){
+    if (offset >= slot->write_state.file_length){
+      // nothing to fetch beyond the end of the file
+      *bitmap |= 1<<(31-i);
+      requests --;
+    }else{
+      while(p && p->offset + p->data_size < offset)
+	p=p->_next;
+      if (p && p->offset <= offset && p->offset+p->data_size >= offset+slot->mdpRXBlockLength){
+	*bitmap |= 1<<(31-i);
+	requests --;
+      }
+    }
+    offset+=slot->mdpRXBlockLength;
+  }
+  return requests;
+}
+
+static void rhizome_fetch_mdp_request_source(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *src, uint64_t offset)
+{
+  uint32_t bitmap;
+  int requests = rhizome_fetch_mdp_window(slot, offset, &bitmap);
+  src->responses_outstanding = requests;
+  src->last_request_time = gettime_ms();
+  if (requests == 0)
+    return;
   
   struct internal_mdp_header header;
   bzero(&header, sizeof header);
   
   header.source = get_my_subscriber(1);
   header.source_port = MDP_PORT_RHIZOME_RESPONSE;
-  header.destination = (struct subscriber *)slot->peer;
+  header.destination = (struct subscriber *)src->peer;
   header.destination_port = MDP_PORT_RHIZOME_REQUEST;
   header.ttl = 1;
   header.qos = OQ_ORDINARY;
   
   struct overlay_buffer *payload = ob_new();
   ob_append_bytes(payload, slot->bid.binary, sizeof slot->bid.binary);
-  
-  uint32_t bitmap=0;
-  int requests=32;
-  int i;
-  struct rhizome_write_buffer *p = slot->write_state.buffer_list;
-  uint64_t offset = slot->write_state.file_offset;
-  for (i=0;i<32;i++){
-    while(p && p->offset + p->data_size < offset)
-      p=p->_next;
-    if (!p)
-      break;
-    if (p->offset <= offset && p->offset+p->data_size >= offset+slot->mdpRXBlockLength){
-      bitmap |= 1<<(31-i);
-      requests --;
-    }
-    offset+=slot->mdpRXBlockLength;
-  }
-  
   ob_append_ui64_rv(payload, slot->bidVersion);
-  ob_append_ui64_rv(payload, slot->write_state.file_offset);
+  ob_append_ui64_rv(payload, offset);
   ob_append_ui32_rv(payload, bitmap);
   ob_append_ui16_rv(payload, slot->mdpRXBlockLength);
   
   DEBUGF(rhizome_tx, "src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", slot->bidVersion=0x%"PRIx64,
 	 alloca_tohex_sid_t(header.source->sid),
 	 alloca_tohex_sid_t(header.destination->sid),
-	 slot->write_state.file_offset,
+	 offset,
 	 slot->bidVersion);
   
   ob_flip(payload);
   overlay_send_frame(&header, payload);
   ob_free(payload);
+}
+
+// order sources by observed throughput, fastest first
+static void rhizome_fetch_rank_sources(struct rhizome_fetch_slot *slot)
+{
+  uint64_t rates[RHIZOME_FETCH_MAX_SOURCES];
+  unsigned i, j;
+  for (i = 0; i < slot->source_count; ++i)
+    rates[i] = fetch_peer_rate(slot->sources[i].peer);
+  for (i = 1; i < slot->source_count; ++i) {
+    struct rhizome_fetch_source src = slot->sources[i];
+    uint64_t rate = rates[i];
+    for (j = i; j > 0 && rates[j - 1] < rate; --j) {
+      slot->sources[j] = slot->sources[j - 1];
+      rates[j] = rates[j - 1];
+    }
+    slot->sources[j] = src;
+    rates[j] = rate;
+  }
+}
+
+/* Request blocks from one source, or from all sources if src is NULL.  Sources are ranked by
+ * throughput, and each is asked for the window following that of the source ranked before it, so
+ * the fastest peer always serves the window that the write is waiting on.
+ */
+static int rhizome_fetch_mdp_requestblocks_from(struct rhizome_fetch_slot *slot, const struct subscriber *peer)
+{
+  IN();
+  // only issue new requests every 133ms.  
+  // we automatically re-issue once we have received all packets in this
+  // request also, so if there is no packet loss, we can go substantially
+  // faster.  Optimising behaviour when there is no packet loss is an
+  // outstanding task.
   
-  // remember when we sent the request so that we can adjust the inter-request
-  // interval based on how fast the packets arrive.
-  slot->mdpResponsesOutstanding=requests;
-  slot->mdp_last_request_offset = slot->write_state.file_offset;
-  slot->mdp_last_request_time = gettime_ms();
+  rhizome_fetch_rank_sources(slot);
+  uint64_t window = 32 * (uint64_t)slot->mdpRXBlockLength;
+  unsigned i;
+  for (i = 0; i < slot->source_count; ++i) {
+    if (peer && slot->sources[i].peer != peer)
+      continue;
+    rhizome_fetch_mdp_request_source(slot, &slot->sources[i], slot->write_state.file_offset + i * window);
+  }
   
   rhizome_fetch_mdp_touch_timeout(slot);
   
@@ -1092,6 +1290,11 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   OUT();
 }
 
+static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+{
+  return rhizome_fetch_mdp_requestblocks_from(slot, NULL);
+}
+
 static int pipe_journal(struct rhizome_fetch_slot *slot){
   if (!slot->previous)
     return 0;
@@ -1182,6 +1385,8 @@ static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizom
     slot->mdpIdleTimeout *= 1+(q - rhizome_fetch_queues);
   
   slot->mdpRXBlockLength = config.rhizome.mdp.block_size; // Rhizome over MDP block size
+  slot->source_count = 0;
+  fetch_add_source(slot, slot->peer);
   rhizome_fetch_mdp_requestblocks(slot);
 
   RETURN(STARTED);
@@ -1319,6 +1524,7 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, unsigned char *buffer
       rhizome_fetch_close(slot);
       RETURN(-1);
     }
+    rhizome_fetch_peer_received(slot->peer, bytes, gettime_ms());
 
   }
 
@@ -1330,7 +1536,7 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, unsigned char *buffer
   OUT();
 }
 
-int rhizome_received_content(const unsigned char *bidprefix,
+int rhizome_received_content(const struct subscriber *peer, const unsigned char *bidprefix,
 			     uint64_t version, uint64_t offset,
 			     size_t count, unsigned char *bytes)
 {
@@ -1346,6 +1552,7 @@ int rhizome_received_content(const unsigned char *bidprefix,
       DEBUGF(rhizome, "Write failed!");
       RETURN (-1);
     }
+    rhizome_fetch_peer_received(peer, count, gettime_ms());
     
     if (rhizome_write_complete(slot)){
       DEBUGF(rhizome, "Complete failed!");
@@ -1355,10 +1562,17 @@ int rhizome_received_content(const unsigned char *bidprefix,
     slot->last_write_time=gettime_ms();
     rhizome_fetch_mdp_touch_timeout(slot);
 
-    slot->mdpResponsesOutstanding--;
-    if (slot->mdpResponsesOutstanding==0) {
-      // We have received all responses, so immediately ask for more
-      rhizome_fetch_mdp_requestblocks(slot);
+    unsigned i;
+    for (i = 0; i < slot->source_count; ++i) {
+      struct rhizome_fetch_source *src = &slot->sources[i];
+      if (src->peer != peer)
+	continue;
+      src->last_rx_time = slot->last_write_time;
+      if (--src->responses_outstanding <= 0) {
+	// We have received all responses from this peer, so immediately ask it for more
+	rhizome_fetch_mdp_requestblocks_from(slot, peer);
+      }
+      break;
     }
     RETURN(0);
   }
@@ -89,6 +89,12 @@ static int rhizome_status_page(httpd_request *r, const char *remainder)
   strbuf_puts(b, "<html><head><meta http-equiv=\"refresh\" content=\"5\" ></head><body>");
   strbuf_sprintf(b, "%d HTTP requests<br>", current_httpd_request_count);
   strbuf_sprintf(b, "%d Bundles transferring via MDP<br>", rhizome_cache_count());
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  struct rhizome_store_usage usage;
+  if (rhizome_store_usage(&retry, &usage) == 0){
+    strbuf_sprintf(b, "%"PRIu64" bytes of payloads stored internally<br>", usage.internal_bytes);
+    strbuf_sprintf(b, "%"PRIu64" bytes of payloads stored externally<br>", usage.external_bytes);
+  }
   rhizome_fetch_status_html(b);
   strbuf_puts(b, "</body></html>");
   if (strbuf_overrun(b))
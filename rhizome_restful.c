@@ -34,6 +34,7 @@ DECLARE_HANDLER("/restful/rhizome/", restful_rhizome_);
 
 static HTTP_RENDERER render_manifest_headers;
 static void on_rhizome_bundle_added(httpd_request *r, rhizome_manifest *m);
+static void render_bundlelist_row(strbuf b, rhizome_manifest *m);
 
 static void finalise_union_read_state(httpd_request *r)
 {
@@ -258,15 +259,128 @@ static int restful_rhizome_newsince(httpd_request *r, const char *remainder)
   r->u.rhlist.cursor.rowid_since = rowid;
   r->u.rhlist.cursor.oldest_first = 1;
   r->u.rhlist.end_time = gettime_ms() + config.api.restful.newsince_timeout * 1000;
+  r->u.rhlist.from_ring = 0;
   r->trigger_rhizome_bundle_added = on_rhizome_bundle_added;
   return restful_open_cursor(r);
 }
 
-static void on_rhizome_bundle_added(httpd_request *r, rhizome_manifest *UNUSED(m))
+static void on_rhizome_bundle_added(httpd_request *r, rhizome_manifest *m)
 {
+  if (r->u.rhlist.cursor.service && strcmp(r->u.rhlist.cursor.service, m->service) != 0)
+    return;
   http_request_resume_response(&r->http);
 }
 
+/* All the newsince requests that are waiting for new bundles take their rows from a shared ring of
+ * the most recently added bundles, which are rendered into JSON only once, as they are added.  A
+ * request only queries the database again if it falls further behind than the ring holds, or if
+ * another process (eg, the command line) may have added bundles that the ring does not contain.
+ */
+#define NEWSINCE_RING_SIZE 64
+
+struct newsince_row {
+  uint64_t seq;
+  uint64_t rowid;
+  uint64_t prev_rowid; // the rowid of the bundle this process added before this one
+  rhizome_bid_t bid;
+  char *service;
+  char *json; // the row's columns after the token, or NULL if it could not be rendered
+};
+
+static struct newsince_row newsince_ring[NEWSINCE_RING_SIZE];
+static uint64_t newsince_ring_next_seq = 1;
+static uint64_t newsince_ring_last_rowid = 0;
+
+static void newsince_ring_add(rhizome_manifest *m)
+{
+  if (!is_rhizome_http_enabled())
+    return;
+  struct newsince_row *row = &newsince_ring[newsince_ring_next_seq % NELS(newsince_ring)];
+  if (row->service)
+    free(row->service);
+  if (row->json)
+    free(row->json);
+  bzero(row, sizeof *row);
+  row->seq = newsince_ring_next_seq++;
+  row->rowid = m->rowid;
+  row->prev_rowid = newsince_ring_last_rowid;
+  newsince_ring_last_rowid = m->rowid;
+  row->bid = m->keypair.public_key;
+  row->service = str_edup(m->service);
+  // Render the row as rhizome_list_next() would fetch it from the database, which only records
+  // the author if it is authentic.
+  rhizome_manifest *lm = rhizome_new_manifest();
+  if (lm) {
+    memcpy(lm->manifestdata, m->manifestdata, m->manifest_all_bytes);
+    lm->manifest_all_bytes = m->manifest_all_bytes;
+    if (rhizome_manifest_parse(lm) != -1 && rhizome_manifest_validate(lm)) {
+      if (m->authorship == AUTHOR_AUTHENTIC)
+	rhizome_manifest_set_author(lm, &m->author);
+      rhizome_manifest_set_rowid(lm, m->rowid);
+      rhizome_manifest_set_inserttime(lm, m->inserttime);
+      rhizome_lookup_author(lm);
+      strbuf sb;
+      STRBUF_ALLOCA_FIT(sb, 512, render_bundlelist_row(sb, lm));
+      row->json = str_edup(strbuf_str(sb));
+    }
+    rhizome_manifest_free(lm);
+  }
+}
+
+DEFINE_TRIGGER(bundle_add, newsince_ring_add);
+
+/* Returns true if a later bundle in the ring replaces the given one, in which case the database no
+ * longer contains it.
+ */
+static int newsince_ring_superseded(const struct newsince_row *row)
+{
+  uint64_t seq;
+  for (seq = row->seq + 1; seq < newsince_ring_next_seq; ++seq)
+    if (cmp_rhizome_bid_t(&newsince_ring[seq % NELS(newsince_ring)].bid, &row->bid) == 0)
+      return 1;
+  return 0;
+}
+
+/* Returns the next row in the ring that the request has not yet listed, or NULL if the request has
+ * listed all of them.  If the request has fallen so far behind that the rows it needs have been
+ * overwritten, or a row could not be rendered, or the database may contain rows that are missing
+ * from the ring, then returns NULL after reverting the request to reading from the database.
+ */
+static const struct newsince_row *newsince_ring_next(httpd_request *r)
+{
+  for (; r->u.rhlist.ring_seq < newsince_ring_next_seq; ++r->u.rhlist.ring_seq) {
+    if (r->u.rhlist.ring_seq + NELS(newsince_ring) < newsince_ring_next_seq) {
+      DEBUGF(httpd, "newsince request fell behind the ring, reading database after rowid=%"PRIu64,
+	     r->u.rhlist.cursor.rowid_since);
+      r->u.rhlist.from_ring = 0;
+      return NULL;
+    }
+    const struct newsince_row *row = &newsince_ring[r->u.rhlist.ring_seq % NELS(newsince_ring)];
+    assert(row->seq == r->u.rhlist.ring_seq);
+    // Bundles added to the database by another process never reach the ring, but they leave a gap
+    // in the rowids of the bundles that this process added.
+    if (row->rowid != row->prev_rowid + 1) {
+      DEBUGF(httpd, "newsince ring has a gap before rowid=%"PRIu64", reading database after rowid=%"PRIu64,
+	     row->rowid, r->u.rhlist.cursor.rowid_since);
+      r->u.rhlist.from_ring = 0;
+      return NULL;
+    }
+    if (row->rowid <= r->u.rhlist.cursor.rowid_since)
+      continue;
+    if (r->u.rhlist.cursor.service && strcmp(r->u.rhlist.cursor.service, row->service) != 0)
+      continue;
+    if (newsince_ring_superseded(row))
+      continue;
+    if (row->json == NULL) {
+      DEBUGF(httpd, "newsince ring row rowid=%"PRIu64" was not rendered, reading database", row->rowid);
+      r->u.rhlist.from_ring = 0;
+      return NULL;
+    }
+    return row;
+  }
+  return NULL;
+}
+
 static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr, strbuf b)
 {
   httpd_request *r = (httpd_request *) hr;
@@ -301,6 +415,38 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
       return 1;
     case LIST_FIRST:
     case LIST_ROWS:
+      if (r->u.rhlist.from_ring) {
+	const struct newsince_row *row = newsince_ring_next(r);
+	if (row) {
+	  if (r->u.rhlist.rowcount != 0)
+	    strbuf_putc(b, ',');
+	  strbuf_puts(b, "\n[");
+	  if (row->rowid > r->u.rhlist.rowid_highest)
+	    strbuf_json_string(b, alloca_list_token(row->rowid));
+	  else
+	    strbuf_json_null(b);
+	  strbuf_putc(b, ',');
+	  strbuf_puts(b, row->json);
+	  strbuf_puts(b, "]");
+	  if (!strbuf_overrun(b)) {
+	    if (row->rowid > r->u.rhlist.rowid_highest)
+	      r->u.rhlist.rowid_highest = row->rowid;
+	    // If the request reverts to reading the database, it must resume after this row.
+	    r->u.rhlist.cursor.rowid_since = row->rowid;
+	    ++r->u.rhlist.ring_seq;
+	    ++r->u.rhlist.rowcount;
+	  }
+	  return 1;
+	}
+	if (r->u.rhlist.from_ring) {
+	  if (gettime_ms() >= r->u.rhlist.end_time) {
+	    r->u.rhlist.phase = LIST_END;
+	    return 1;
+	  }
+	  http_request_pause_response(&r->http, r->u.rhlist.end_time);
+	  return 0;
+	}
+      }
       {
 	int ret = rhizome_list_next(&r->u.rhlist.cursor);
 	if (ret == -1)
@@ -311,6 +457,12 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
 	    r->u.rhlist.phase = LIST_END;
 	    return 1;
 	  }
+	  // The database has been read to the end, so take all bundles added from now on from the
+	  // ring, unless the list is filtered by name, which the ring does not support.
+	  if (r->u.rhlist.cursor.name == NULL) {
+	    r->u.rhlist.from_ring = 1;
+	    r->u.rhlist.ring_seq = newsince_ring_next_seq;
+	  }
 	  http_request_pause_response(&r->http, r->u.rhlist.end_time);
 	  return 0;
 	}
@@ -326,55 +478,7 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
 	} else
 	  strbuf_json_null(b);
 	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->rowid);
-	strbuf_putc(b, ',');
-	strbuf_json_string(b, m->service);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->keypair.public_key.binary, sizeof m->keypair.public_key.binary);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->version);
-	strbuf_putc(b, ',');
-	if (m->has_date)
-	  strbuf_sprintf(b, "%"PRItime_ms_t, m->date);
-	else
-	  strbuf_json_null(b);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRItime_ms_t",", m->inserttime);
-	// The 'fromhere' flag indicates if the author is a known (unlocked) identity in the local
-	// keyring.  The values are 0 (no), 1 (yes), 2 (yes and cryptographically verified).  In the
-	// implementation below, the 0 value (no) is redundant, because it only occurs when the
-	// 'author' column is null, but in future the author SID might be reported for non-local
-	// authors, so clients should only use 'fromhere != 0', never 'author != null', to detect
-	// local authorship.
-	int fromhere = 0;
-	switch (m->authorship) {
-	  case AUTHOR_AUTHENTIC:
-	    fromhere = 2;
-	    strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
-	    break;
-	  case AUTHOR_LOCAL:
-	    fromhere = 1;
-	    strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
-	    break;
-	  case AUTHOR_REMOTE:
-	    strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
-	    break;
-	  default:
-	    strbuf_json_null(b);
-	    break;
-	}
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%d", fromhere);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->filesize);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->filesize ? m->filehash.binary : NULL, sizeof m->filehash.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->has_sender ? m->sender.binary : NULL, sizeof m->sender.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->has_recipient ? m->recipient.binary : NULL, sizeof m->recipient.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_string(b, m->name);
+	render_bundlelist_row(b, m);
 	strbuf_puts(b, "]");
 	if (!strbuf_overrun(b)) {
 	  rhizome_list_commit(&r->u.rhlist.cursor);
@@ -393,6 +497,61 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
   abort();
 }
 
+/* Render the columns of a bundle list row that follow the token column.
+ */
+static void render_bundlelist_row(strbuf b, rhizome_manifest *m)
+{
+  strbuf_sprintf(b, "%"PRIu64, m->rowid);
+  strbuf_putc(b, ',');
+  strbuf_json_string(b, m->service);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, m->keypair.public_key.binary, sizeof m->keypair.public_key.binary);
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%"PRIu64, m->version);
+  strbuf_putc(b, ',');
+  if (m->has_date)
+    strbuf_sprintf(b, "%"PRItime_ms_t, m->date);
+  else
+    strbuf_json_null(b);
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%"PRItime_ms_t",", m->inserttime);
+  // The 'fromhere' flag indicates if the author is a known (unlocked) identity in the local
+  // keyring.  The values are 0 (no), 1 (yes), 2 (yes and cryptographically verified).  In the
+  // implementation below, the 0 value (no) is redundant, because it only occurs when the
+  // 'author' column is null, but in future the author SID might be reported for non-local
+  // authors, so clients should only use 'fromhere != 0', never 'author != null', to detect
+  // local authorship.
+  int fromhere = 0;
+  switch (m->authorship) {
+    case AUTHOR_AUTHENTIC:
+      fromhere = 2;
+      strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
+      break;
+    case AUTHOR_LOCAL:
+      fromhere = 1;
+      strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
+      break;
+    case AUTHOR_REMOTE:
+      strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
+      break;
+    default:
+      strbuf_json_null(b);
+      break;
+  }
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%d", fromhere);
+  strbuf_putc(b, ',');
+  strbuf_sprintf(b, "%"PRIu64, m->filesize);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, m->filesize ? m->filehash.binary : NULL, sizeof m->filehash.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, m->has_sender ? m->sender.binary : NULL, sizeof m->sender.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, m->has_recipient ? m->recipient.binary : NULL, sizeof m->recipient.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_string(b, m->name);
+}
+
 static HTTP_REQUEST_PARSER restful_rhizome_insert_end;
 static int insert_mime_part_start(struct http_request *);
 static int insert_mime_part_end(struct http_request *);
@@ -985,13 +1144,23 @@ int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t
   const size_t blocksz = 1 << 12;
   // Ask for a large buffer for all future reads.
   const size_t preferred_bufsz = 16 * blocksz;
+  // Limit how much of a file is hashed and sent directly at a time.
+  const size_t direct_max = 256 * blocksz;
   // Reads the next part of the payload into the supplied buffer.
   httpd_request *r = (httpd_request *) hr;
   assert(r->u.read_state.length != RHIZOME_SIZE_UNSET);
   assert(r->u.read_state.offset < r->u.read_state.length);
   uint64_t remain = r->u.read_state.length - r->u.read_state.offset;
+  // Unencrypted payloads in external blob files can be sent without copying them through the buffer.
+  ssize_t direct = rhizome_read_direct(&r->u.read_state, &result->file_fd, &result->file_offset,
+    remain < direct_max ? remain : direct_max);
+  if (direct == -1)
+    return -1;
   size_t readlen = bufsz;
-  if (remain <= bufsz)
+  if (direct > 0) {
+    result->file_length = (size_t) direct;
+    readlen = 0;
+  } else if (remain <= bufsz)
     readlen = remain;
   else
     readlen &= ~(blocksz - 1);
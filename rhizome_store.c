@@ -210,6 +210,35 @@ static uint64_t store_space_limit(uint64_t current_size)
   return limit;
 }
 
+/* Measure the space used by the store.  Payload byte totals are maintained by database triggers
+ * (see rhizome_opendb()), so this does not need to scan the FILES table.  Returns 0 on success, -1
+ * on error (logged).
+ */
+int rhizome_store_usage(sqlite_retry_state *retry, struct rhizome_store_usage *usage)
+{
+  bzero(usage, sizeof *usage);
+  sqlite3_stmt *statement = sqlite_prepare_bind(retry,
+      "SELECT internal_bytes, external_bytes FROM STORE_USAGE LIMIT 1;", END);
+  if (!statement)
+    return -1;
+  int r = sqlite_step_retry(retry, statement);
+  if (r == SQLITE_ROW) {
+    usage->internal_bytes = sqlite3_column_int64(statement, 0);
+    usage->external_bytes = sqlite3_column_int64(statement, 1);
+  }
+  sqlite3_finalize(statement);
+  if (!sqlite_code_ok(r))
+    return -1;
+  if (	sqlite_exec_uint64_retry(retry, &usage->db_page_size, "PRAGMA page_size;", END) == -1
+    ||  sqlite_exec_uint64_retry(retry, &usage->db_page_count, "PRAGMA page_count;", END) == -1
+    ||	sqlite_exec_uint64_retry(retry, &usage->db_free_page_count, "PRAGMA freelist_count;", END) == -1
+  )
+    return -1;
+  usage->used_bytes = usage->external_bytes + usage->db_page_size * (usage->db_page_count - usage->db_free_page_count);
+  usage->limit_bytes = store_space_limit(usage->used_bytes);
+  return 0;
+}
+
 // TODO readonly version?
 static enum rhizome_payload_status store_make_space(uint64_t bytes, struct rhizome_cleanup_report *report)
 {
@@ -224,24 +253,16 @@ static enum rhizome_payload_status store_make_space(uint64_t bytes, struct rhizo
   if (config.rhizome.database_size==UINT64_MAX && config.rhizome.min_free_space==0)
     return RHIZOME_PAYLOAD_STATUS_NEW;
     
-  // TODO index external_bytes calculation and/or cache result
-  
-  if (	sqlite_exec_uint64_retry(&retry, &db_page_size, "PRAGMA page_size;", END) == -1LL
-    ||  sqlite_exec_uint64_retry(&retry, &db_page_count, "PRAGMA page_count;", END) == -1LL
-    ||	sqlite_exec_uint64_retry(&retry, &db_free_page_count, "PRAGMA freelist_count;", END) == -1LL
-    ||  sqlite_exec_uint64_retry(&retry, &external_bytes, 
-	  "SELECT SUM(length) "
-	  "FROM FILES  "
-	  "WHERE NOT EXISTS( "
-	    "SELECT 1  "
-	    "FROM FILEBLOBS "
-	    "WHERE FILES.ID = FILEBLOBS.ID "
-	  ");", END) == -1LL
-  )
+  struct rhizome_store_usage usage;
+  if (rhizome_store_usage(&retry, &usage) == -1)
     return WHY("Cannot measure database used bytes");
+  external_bytes = usage.external_bytes;
+  db_page_size = usage.db_page_size;
+  db_page_count = usage.db_page_count;
+  db_free_page_count = usage.db_free_page_count;
   
-  uint64_t db_used = external_bytes + db_page_size * (db_page_count - db_free_page_count);
-  const uint64_t limit = store_space_limit(db_used);
+  uint64_t db_used = usage.used_bytes;
+  const uint64_t limit = usage.limit_bytes;
 
   // Automated tests depend on this message; do not alter.
   DEBUGF(rhizome, "RHIZOME SPACE USED bytes=%"PRIu64" (%sB), LIMIT bytes=%"PRIu64" (%sB)",
@@ -1044,6 +1065,7 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
   read->id = *hashp;
   read->blob_rowid = 0;
   read->blob_fd = -1;
+  read->blob_map = NULL;
   read->verified = 0;
   read->offset = 0;
   read->hash_offset = 0;
@@ -1087,7 +1109,15 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
       WHYF("Length mismatch");
       return RHIZOME_PAYLOAD_STATUS_ERROR;
     }
-    DEBUGF(rhizome_store, "Opened stored file %s as fd %d, len %"PRIx64, blob_path, read->blob_fd, read->length);
+    // Reading from a mapping needs no system calls, if we can't map the file we fall back to read(2)
+    if (read->length <= SIZE_MAX) {
+      void *map = mmap(NULL, (size_t)read->length, PROT_READ, MAP_SHARED, read->blob_fd, 0);
+      if (map == MAP_FAILED)
+	DEBUGF(rhizome_store, "mmap(%s) failed: %s", alloca_str_toprint(blob_path), strerror(errno));
+      else
+	read->blob_map = map;
+    }
+    DEBUGF(rhizome_store, "Opened stored file %s as fd %d, len %"PRIx64", %smapped", blob_path, read->blob_fd, read->length, read->blob_map ? "" : "not ");
   }
   crypto_hash_sha512_init(&read->sha512_context);
   return RHIZOME_PAYLOAD_STATUS_STORED;
@@ -1096,6 +1126,17 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
 static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz)
 {
   IN();
+  if (read_state->blob_map) {
+    size_t bytes_read = 0;
+    if (buffer && bufsz && read_state->offset < read_state->length) {
+      bytes_read = (size_t)(read_state->length - read_state->offset);
+      if (bytes_read > bufsz)
+	bytes_read = bufsz;
+      bcopy(read_state->blob_map + read_state->offset, buffer, bytes_read);
+    }
+    DEBUGF(rhizome_store, "Read %zu bytes from mapped fd=%d @%"PRIx64, bytes_read, read_state->blob_fd, read_state->offset);
+    RETURN(bytes_read);
+  }
   if (read_state->blob_fd != -1) {
     if (lseek64(read_state->blob_fd, (off64_t) read_state->offset, SEEK_SET) == -1)
       RETURN(WHYF_perror("lseek64(%d,%"PRIu64",SEEK_SET)", read_state->blob_fd, read_state->offset));
@@ -1137,6 +1178,30 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
   OUT();
 }
 
+// hash the payload as we go, but only if we happen to read the payload data in order
+static int rhizome_read_hash(struct rhizome_read *read_state, const unsigned char *data, size_t len)
+{
+  if (read_state->hash_offset != read_state->offset || !data || len == 0)
+    return 0;
+  crypto_hash_sha512_update(&read_state->sha512_context, data, len);
+  read_state->hash_offset += len;
+  
+  // if we hash everything and the hash doesn't match, we need to delete the payload
+  if (read_state->hash_offset >= read_state->length){
+    rhizome_filehash_t hash_out;
+    crypto_hash_sha512_final(&read_state->sha512_context, hash_out.binary);
+    if (cmp_rhizome_filehash_t(&read_state->id, &hash_out) != 0) {
+      // hash failure, mark the payload as invalid
+      read_state->verified = -1;
+      return WHYF("Expected hash=%s, got %s", alloca_tohex_rhizome_filehash_t(read_state->id), alloca_tohex_rhizome_filehash_t(hash_out));
+    }else{
+      // we read it, and it's good. Lets remember that (not fatal if the database is locked)
+      read_state->verified = 1;
+    }
+  }
+  return 0;
+}
+
 /* Read content from the store, hashing and decrypting as we go. 
  Random access is supported, but hashing requires all payload contents to be read sequentially. */
 // returns the number of bytes read
@@ -1153,25 +1218,8 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
     RETURN(-1);
   size_t bytes_read = (size_t) n;
 
-  // hash the payload as we go, but only if we happen to read the payload data in order
-  if (read_state->hash_offset == read_state->offset && buffer && bytes_read>0){
-    crypto_hash_sha512_update(&read_state->sha512_context, buffer, bytes_read);
-    read_state->hash_offset += bytes_read;
-    
-    // if we hash everything and the hash doesn't match, we need to delete the payload
-    if (read_state->hash_offset >= read_state->length){
-      rhizome_filehash_t hash_out;
-      crypto_hash_sha512_final(&read_state->sha512_context, hash_out.binary);
-      if (cmp_rhizome_filehash_t(&read_state->id, &hash_out) != 0) {
-	// hash failure, mark the payload as invalid
-	read_state->verified = -1;
-	RETURN(WHYF("Expected hash=%s, got %s", alloca_tohex_rhizome_filehash_t(read_state->id), alloca_tohex_rhizome_filehash_t(hash_out)));
-      }else{
-	// we read it, and it's good. Lets remember that (not fatal if the database is locked)
-	read_state->verified = 1;
-      }
-    }
-  }
+  if (rhizome_read_hash(read_state, buffer, bytes_read) == -1)
+    RETURN(-1);
   
   if (read_state->crypt && buffer && bytes_read>0){
     if(rhizome_crypt_xor_block(
@@ -1187,6 +1235,29 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
   OUT();
 }
 
+/* Allow the caller to send up to len bytes of an unencrypted, mapped blob file directly from its
+ * file descriptor, eg, with sendfile(2), instead of copying them through a buffer.  The bytes are
+ * hashed from the mapping as though they had been read.  Returns the number of bytes that may be sent
+ * from *fdp starting at *offsetp, zero if the content must be read with rhizome_read(), or -1 on
+ * error.
+ */
+ssize_t rhizome_read_direct(struct rhizome_read *read_state, int *fdp, uint64_t *offsetp, size_t len)
+{
+  if (read_state->verified == -1)
+    return -1;
+  if (read_state->crypt || !read_state->blob_map || read_state->offset >= read_state->length)
+    return 0;
+  if (len > read_state->length - read_state->offset)
+    len = (size_t)(read_state->length - read_state->offset);
+  if (rhizome_read_hash(read_state, read_state->blob_map + read_state->offset, len) == -1)
+    return -1;
+  *fdp = read_state->blob_fd;
+  *offsetp = read_state->offset;
+  read_state->offset += len;
+  DEBUGF(rhizome_store, "direct read %zu bytes, read_state->offset=%"PRIu64, len, read_state->offset);
+  return len;
+}
+
 /* Read len bytes from read->offset into data, using *buffer to cache any reads */
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len)
 {
@@ -1257,6 +1328,10 @@ void rhizome_read_close(struct rhizome_read *read)
     // bzero'd & never opened, or already closed
     return;
 
+  if (read->blob_map) {
+    munmap((void *)read->blob_map, (size_t)read->length);
+    read->blob_map = NULL;
+  }
   if (read->blob_fd != -1) {
     DEBUGF(rhizome_store, "Closing store fd %d", read->blob_fd);
     close(read->blob_fd);
@@ -1280,72 +1355,165 @@ void rhizome_read_close(struct rhizome_read *read)
   read->tail = 0;
 }
 
+/* Payloads being served to MDP block requests are kept open in a hash table keyed on bundle id
+ * and version.  Entries are closed once their timeout expires, which is found from a min-heap
+ * ordered by expiry time, or when more than rhizome.mdp.max_open_payloads are open, in which case
+ * the least recently used entry is closed first.  Each entry keeps a page of read-ahead, so
+ * consecutive small block requests do not each go back to the blob.
+ */
 struct cache_entry{
-  struct cache_entry *_left;
-  struct cache_entry *_right;
+  struct cache_entry *hash_next;
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+  unsigned heap_index;
   rhizome_bid_t bundle_id;
   uint64_t version;
   struct rhizome_read read_state;
+  struct rhizome_read_buffer read_buffer;
   time_ms_t expires;
 };
-struct cache_entry *root;
 
-static struct cache_entry ** find_entry_location(struct cache_entry **ptr, const rhizome_bid_t *bundle_id, uint64_t version)
+#define CACHE_HASH_SIZE 64
+
+static struct cache_entry *cache_hash[CACHE_HASH_SIZE];
+// most recently used at the head
+static struct cache_entry *cache_lru_head = NULL;
+static struct cache_entry *cache_lru_tail = NULL;
+static struct cache_entry **cache_heap = NULL;
+static unsigned cache_heap_count = 0;
+static unsigned cache_heap_allocated = 0;
+
+static unsigned cache_hash_index(const rhizome_bid_t *bundle_id, uint64_t version)
 {
+  // bundle ids are public keys, so any of their bytes are well distributed
+  uint32_t h;
+  memcpy(&h, bundle_id->binary, sizeof h);
+  return (h ^ (uint32_t)version) & (CACHE_HASH_SIZE - 1);
+}
+
+static struct cache_entry ** find_entry_location(const rhizome_bid_t *bundle_id, uint64_t version)
+{
+  struct cache_entry **ptr = &cache_hash[cache_hash_index(bundle_id, version)];
   while(*ptr){
     struct cache_entry *entry = *ptr;
-    int cmp = cmp_rhizome_bid_t(bundle_id, &entry->bundle_id);
-    if (cmp==0){
-      if (entry->version==version)
-	break;
-      if (version < entry->version)
-	ptr = &entry->_left;
-      else
-	ptr = &entry->_right;
-      continue;
-    }
-    if (cmp<0)
-      ptr = &entry->_left;
-    else
-      ptr = &entry->_right;
+    if (entry->version==version && cmp_rhizome_bid_t(bundle_id, &entry->bundle_id)==0)
+      break;
+    ptr = &entry->hash_next;
   }
   return ptr;
 }
 
-static time_ms_t close_entries(struct cache_entry **entry, time_ms_t timeout)
+static void cache_lru_unlink(struct cache_entry *entry)
 {
-  if (!*entry)
-    return 0;
-    
-  time_ms_t ret = close_entries(&(*entry)->_left, timeout);
-  time_ms_t t_right = close_entries(&(*entry)->_right, timeout);
-  if (t_right!=0 && (t_right < ret || ret==0))
-    ret=t_right;
-    
-  if ((*entry)->expires < timeout || timeout==0){
-    rhizome_read_close(&(*entry)->read_state);
-    // remember the two children
-    struct cache_entry *left=(*entry)->_left;
-    struct cache_entry *right=(*entry)->_right;
-    // free this entry
-    free(*entry);
-    // re-add both children to the tree
-    *entry=left;
-    if (right){
-      entry = find_entry_location(entry, &right->bundle_id, right->version);
-      *entry=right;
-    }
-  }else{
-    if ((*entry)->expires < ret || ret==0)
-      ret=(*entry)->expires;
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache_lru_head = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache_lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void cache_lru_push(struct cache_entry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = cache_lru_head;
+  if (cache_lru_head)
+    cache_lru_head->lru_prev = entry;
+  else
+    cache_lru_tail = entry;
+  cache_lru_head = entry;
+}
+
+static void cache_heap_set(unsigned i, struct cache_entry *entry)
+{
+  cache_heap[i] = entry;
+  entry->heap_index = i;
+}
+
+static void cache_heap_sift_up(unsigned i)
+{
+  struct cache_entry *entry = cache_heap[i];
+  while (i > 0) {
+    unsigned parent = (i - 1) / 2;
+    if (cache_heap[parent]->expires <= entry->expires)
+      break;
+    cache_heap_set(i, cache_heap[parent]);
+    i = parent;
   }
-  return ret;
+  cache_heap_set(i, entry);
+}
+
+static void cache_heap_sift_down(unsigned i)
+{
+  struct cache_entry *entry = cache_heap[i];
+  while (1) {
+    unsigned child = i * 2 + 1;
+    if (child >= cache_heap_count)
+      break;
+    if (child + 1 < cache_heap_count && cache_heap[child + 1]->expires < cache_heap[child]->expires)
+      child++;
+    if (entry->expires <= cache_heap[child]->expires)
+      break;
+    cache_heap_set(i, cache_heap[child]);
+    i = child;
+  }
+  cache_heap_set(i, entry);
+}
+
+static int cache_heap_insert(struct cache_entry *entry)
+{
+  if (cache_heap_count >= cache_heap_allocated) {
+    unsigned allocated = cache_heap_allocated ? cache_heap_allocated * 2 : 32;
+    struct cache_entry **heap = erealloc(cache_heap, allocated * sizeof *heap);
+    if (!heap)
+      return -1;
+    cache_heap = heap;
+    cache_heap_allocated = allocated;
+  }
+  cache_heap_set(cache_heap_count++, entry);
+  cache_heap_sift_up(entry->heap_index);
+  return 0;
+}
+
+static void cache_heap_remove(struct cache_entry *entry)
+{
+  unsigned i = entry->heap_index;
+  assert(i < cache_heap_count && cache_heap[i] == entry);
+  struct cache_entry *last = cache_heap[--cache_heap_count];
+  if (last != entry) {
+    cache_heap_set(i, last);
+    cache_heap_sift_up(i);
+    cache_heap_sift_down(last->heap_index);
+  }
+}
+
+static void close_entry(struct cache_entry *entry)
+{
+  struct cache_entry **ptr = find_entry_location(&entry->bundle_id, entry->version);
+  assert(*ptr == entry);
+  *ptr = entry->hash_next;
+  cache_lru_unlink(entry);
+  cache_heap_remove(entry);
+  rhizome_read_close(&entry->read_state);
+  free(entry);
+}
+
+// close all entries that expire before the timeout, or all of them if timeout is zero,
+// and return the next expiry time
+static time_ms_t close_entries(time_ms_t timeout)
+{
+  while (cache_heap_count && (timeout == 0 || cache_heap[0]->expires < timeout))
+    close_entry(cache_heap[0]);
+  return cache_heap_count ? cache_heap[0]->expires : 0;
 }
 
 // close any expired cache entries
 static void rhizome_cache_alarm(struct sched_ent *alarm)
 {
-  alarm->alarm = close_entries(&root, gettime_ms());
+  alarm->alarm = close_entries(gettime_ms());
   if (alarm->alarm){
     alarm->deadline = alarm->alarm + 1000;
     schedule(alarm);
@@ -1363,29 +1531,21 @@ static struct sched_ent cache_alarm={
 // close all cache entries
 int rhizome_cache_close()
 {
-  close_entries(&root, 0);
+  close_entries(0);
   unschedule(&cache_alarm);
   return 0;
 }
 
-static int _rhizome_cache_count(struct cache_entry *entry)
-{
-  if (!entry)
-    return 0;
-  return 1+_rhizome_cache_count(entry->_left)+_rhizome_cache_count(entry->_right);
-}
-
 int rhizome_cache_count()
 {
-  return _rhizome_cache_count(root);
+  return cache_heap_count;
 }
 
 // read a block of data, caching meta data for reuse
 ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t fileOffset, unsigned char *buffer, size_t length)
 {
   // look for a cached entry
-  struct cache_entry **ptr = find_entry_location(&root, bidp, version);
-  struct cache_entry *entry = *ptr;
+  struct cache_entry *entry = *find_entry_location(bidp, version);
   
   // if we don't have one yet, create one and open it
   if (!entry){
@@ -1395,6 +1555,12 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms
 	     alloca_tohex_rhizome_bid_t(*bidp), version);
       return -1;
     }
+    
+    // make room by closing the least recently used payloads
+    unsigned capacity = config.rhizome.mdp.max_open_payloads ? config.rhizome.mdp.max_open_payloads : 1;
+    while (cache_lru_tail && cache_heap_count >= capacity)
+      close_entry(cache_lru_tail);
+    
     entry = emalloc_zero(sizeof(struct cache_entry));
     if (entry == NULL)
       return -1;
@@ -1417,24 +1583,36 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms
     }
     entry->bundle_id = *bidp;
     entry->version = version;
+    entry->expires = timeout;
+    if (cache_heap_insert(entry) == -1){
+      rhizome_read_close(&entry->read_state);
+      free(entry);
+      return -1;
+    }
+    struct cache_entry **ptr = &cache_hash[cache_hash_index(bidp, version)];
+    entry->hash_next = *ptr;
     *ptr = entry;
+    cache_lru_push(entry);
+  }else if (entry != cache_lru_head){
+    cache_lru_unlink(entry);
+    cache_lru_push(entry);
   }
   
-  entry->read_state.offset = fileOffset;
-  if (entry->read_state.length != RHIZOME_SIZE_UNSET && fileOffset >= entry->read_state.length)
-    return 0;
-  
   if (entry->expires < timeout){
     entry->expires = timeout;
-    
-    if (!cache_alarm.alarm){
-      cache_alarm.alarm = timeout;
-      cache_alarm.deadline = timeout + 1000;
-      schedule(&cache_alarm);
-    }
+    cache_heap_sift_down(entry->heap_index);
   }
+  if (!cache_alarm.alarm){
+    cache_alarm.alarm = cache_heap[0]->expires;
+    cache_alarm.deadline = cache_alarm.alarm + 1000;
+    schedule(&cache_alarm);
+  }
+  
+  entry->read_state.offset = fileOffset;
+  if (entry->read_state.length != RHIZOME_SIZE_UNSET && fileOffset >= entry->read_state.length)
+    return 0;
   
-  return rhizome_read(&entry->read_state, buffer, length);
+  return rhizome_read_buffered(&entry->read_state, &entry->read_buffer, buffer, length);
 }
 
 /* Returns -1 on error, 0 on success.
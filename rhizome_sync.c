@@ -152,7 +152,7 @@ static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhi
     if (log2_size!=0xFF && rhizome_fetch_has_queue_space(log2_size)!=1)
       continue;
     
-    if (rhizome_fetch_bar_queued(&state->bars[i].bar)){
+    if (rhizome_fetch_bar_queued(&state->bars[i].bar, subscriber)){
       state->bars[i].next_request = now+2000;
       continue;
     }
@@ -260,11 +260,12 @@ static void annouce_cli_bundle_add(uint64_t row_id)
   if (max_token!=0){
     sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
     sqlite3_stmt *statement = sqlite_prepare_bind(&retry, 
-      "SELECT manifest FROM manifests WHERE rowid > ? AND rowid <= ? ORDER BY rowid ASC;",
+      "SELECT manifest, rowid, inserttime, author FROM manifests WHERE rowid > ? AND rowid <= ? ORDER BY rowid ASC;",
       INT64, max_token, INT64, row_id, END);
     while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
       const void *blob = sqlite3_column_blob(statement, 0);
       size_t blob_length = sqlite3_column_bytes(statement, 0);
+      const char *q_author = (const char *) sqlite3_column_text(statement, 3);
       rhizome_manifest *m = rhizome_new_manifest();
       if (m) {
 	memcpy(m->manifestdata, blob, blob_length);
@@ -274,6 +275,12 @@ static void annouce_cli_bundle_add(uint64_t row_id)
 	    && rhizome_manifest_verify(m)
 	) {
 	  assert(m->finalised);
+	  // bundle_add triggers expect the same details as a bundle this process stored
+	  sid_t author;
+	  if (q_author && str_to_sid_t(&author, q_author) != -1)
+	    rhizome_manifest_set_author(m, &author);
+	  rhizome_manifest_set_rowid(m, sqlite3_column_int64(statement, 1));
+	  rhizome_manifest_set_inserttime(m, sqlite3_column_int64(statement, 2));
 	  CALL_TRIGGER(bundle_add, m);
 	}
 	rhizome_manifest_free(m);
@@ -1,4 +1,9 @@
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include "rhizome.h"
 #include "overlay_address.h"
 #include "overlay_buffer.h"
@@ -13,6 +18,7 @@
 #include "overlay_interface.h"
 #include "route_link.h"
 #include "mem.h"
+#include "instance.h"
 
 #define STATE_SEND (1)
 #define STATE_REQ (2)
@@ -493,27 +499,258 @@ static void sync_peer_now_has (void * UNUSED(context), void *peer_context, void
     alloca_sync_key(key));
 }
 
-// this is probably fast enough. For huge stores, or slow storage media
-// we might need to use an alarm to slowly build this tree
+// The set of keys we can offer to peers is cached in a snapshot file beside the database.
+// The snapshot is stamped with the last SYNC_JOURNAL entry it includes,
+// database triggers record every later change to the set in the journal.
+// The same stamp is kept in SYNC_SNAPSHOT, which turns the triggers on.
+// If the journal grows too long, the database discards it and removes that row.
+#define SYNC_SNAPSHOT_FILE "sync_keys"
+#define SYNC_SNAPSHOT_MAGIC "SYNCKEY1"
+// rewrite the snapshot and trim the journal once this many entries have been applied
+#define SYNC_SNAPSHOT_INTERVAL 4096
+
+struct sync_snapshot_header{
+  char magic[8];
+  serval_uuid_t uuid;
+  uint64_t journal_id;
+  uint64_t key_count;
+};
+
+// last journal entry applied to sync_tree
+static uint64_t sync_journal_id=0;
+// last journal entry included in the snapshot file
+static uint64_t sync_snapshot_id=0;
+
+static int sync_key_from_hash(sync_key_t *key, const char *hash)
+{
+  rhizome_filehash_t manifest_hash;
+  if (!hash || str_to_rhizome_filehash_t(&manifest_hash, hash)==-1)
+    return -1;
+  memcpy(key->key, manifest_hash.binary, sizeof(sync_key_t));
+  return 0;
+}
+
+static int sync_journal_seq(sqlite_retry_state *retry, uint64_t *seq)
+{
+  *seq = 0;
+  return sqlite_exec_uint64_retry(retry, seq, "SELECT seq FROM sqlite_sequence WHERE name = 'SYNC_JOURNAL';", END);
+}
+
+// returns 1 if changes are being journaled after *journal_id, 0 if not, -1 on error
+static int sync_journal_stamp(sqlite_retry_state *retry, uint64_t *journal_id)
+{
+  *journal_id = 0;
+  return sqlite_exec_uint64_retry(retry, journal_id, "SELECT journal_id FROM SYNC_SNAPSHOT WHERE id = 0;", END);
+}
+
+static void set_sync_journal_stamp(sqlite_retry_state *retry, uint64_t journal_id)
+{
+  sqlite_exec_void_retry(retry, "INSERT OR REPLACE INTO SYNC_SNAPSHOT(id, journal_id) VALUES (0, ?);",
+    INT64, journal_id, END);
+}
+
+// Load the snapshot file, if it is consistent with the journal.
+// Every journal entry after the snapshot stamp must still be present, otherwise changes have been lost.
+static int load_snapshot()
+{
+  char path[1024];
+  if (!FORMF_RHIZOME_STORE_PATH(path, SYNC_SNAPSHOT_FILE))
+    return -1;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1){
+    if (errno != ENOENT)
+      WARNF_perror("open(%s)", alloca_str_toprint(path));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1){
+    WHYF_perror("fstat(%s)", alloca_str_toprint(path));
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(struct sync_snapshot_header)){
+    close(fd);
+    DEBUGF(rhizome_sync_keys, "Ignoring truncated snapshot %s", alloca_str_toprint(path));
+    return -1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return WHYF_perror("mmap(%s)", alloca_str_toprint(path));
+  
+  const struct sync_snapshot_header *header = (const struct sync_snapshot_header *)map;
+  size_t key_bytes = st.st_size - sizeof(struct sync_snapshot_header);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  uint64_t seq, following, stamp;
+  int ret = -1;
+  int journaling;
+  
+  if (memcmp(header->magic, SYNC_SNAPSHOT_MAGIC, sizeof header->magic) != 0
+    || cmp_uuid_t(&header->uuid, &rhizome_db_uuid) != 0
+    || key_bytes % sizeof(sync_key_t) != 0
+    || header->key_count != key_bytes / sizeof(sync_key_t)){
+    DEBUGF(rhizome_sync_keys, "Ignoring invalid snapshot %s", alloca_str_toprint(path));
+  }else if ((journaling = sync_journal_stamp(&retry, &stamp)) == -1
+    || sync_journal_seq(&retry, &seq) == -1
+    || sqlite_exec_uint64_retry(&retry, &following, "SELECT COUNT(*) FROM SYNC_JOURNAL WHERE id > ?;",
+	INT64, header->journal_id, END) == -1){
+    WHY("Failed to read sync journal");
+  }else if (journaling == 0 || stamp != header->journal_id){
+    DEBUGF(rhizome_sync_keys, "Ignoring snapshot %s, changes since journal %"PRIu64" were not journaled",
+      alloca_str_toprint(path), header->journal_id);
+  }else if (seq < header->journal_id || following != seq - header->journal_id){
+    DEBUGF(rhizome_sync_keys, "Ignoring stale snapshot %s (journal %"PRIu64", expected %"PRIu64" entries after %"PRIu64", found %"PRIu64")",
+      alloca_str_toprint(path), seq, seq - header->journal_id, header->journal_id, following);
+  }else{
+    const sync_key_t *keys = (const sync_key_t *)(header + 1);
+    uint64_t i;
+    for (i=0;i<header->key_count;i++)
+      sync_add_key(sync_tree, &keys[i], NULL);
+    sync_journal_id = sync_snapshot_id = header->journal_id;
+    DEBUGF(rhizome_sync_keys, "Loaded %"PRIu64" keys from snapshot, journal %"PRIu64, header->key_count, header->journal_id);
+    ret = 0;
+  }
+  munmap(map, st.st_size);
+  return ret;
+}
+
+// Apply every change that has been journaled since the tree was last updated,
+// including changes made by other processes.
+static void apply_journal()
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+    "SELECT id, manifest_hash, present FROM SYNC_JOURNAL WHERE id > ? ORDER BY id;",
+    INT64, sync_journal_id, END);
+  if (!statement)
+    return;
+  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    sync_journal_id = sqlite3_column_int64(statement, 0);
+    sync_key_t key;
+    if (sync_key_from_hash(&key, (const char *) sqlite3_column_text(statement, 1))==-1)
+      continue;
+    if (sqlite3_column_int(statement, 2)){
+      DEBUGF(rhizome_sync_keys, "Adding %s to tree",
+	alloca_sync_key(&key));
+      sync_add_key(sync_tree, &key, NULL);
+    }else{
+      DEBUGF(rhizome_sync_keys, "Removing %s from tree",
+	alloca_sync_key(&key));
+      sync_remove_key(sync_tree, &key);
+    }
+  }
+  sqlite3_finalize(statement);
+}
+
+static void write_snapshot_key(void *context, const sync_key_t *key)
+{
+  fwrite(key->key, sizeof key->key, 1, (FILE *)context);
+}
+
+static void save_snapshot()
+{
+  char path[1024];
+  char tmp_path[1024];
+  if (!FORMF_RHIZOME_STORE_PATH(path, SYNC_SNAPSHOT_FILE)
+    || !FORMF_RHIZOME_STORE_PATH(tmp_path, SYNC_SNAPSHOT_FILE ".tmp"))
+    return;
+  
+  FILE *f = fopen(tmp_path, "w");
+  if (!f){
+    WHYF_perror("fopen(%s)", alloca_str_toprint(tmp_path));
+    return;
+  }
+  struct sync_snapshot_header header;
+  bzero(&header, sizeof header);
+  memcpy(header.magic, SYNC_SNAPSHOT_MAGIC, sizeof header.magic);
+  header.uuid = rhizome_db_uuid;
+  header.journal_id = sync_journal_id;
+  header.key_count = sync_key_count(sync_tree);
+  fwrite(&header, sizeof header, 1, f);
+  sync_enum_keys(sync_tree, write_snapshot_key, f);
+  int err = ferror(f);
+  if (fclose(f) || err){
+    WHYF_perror("fwrite(%s)", alloca_str_toprint(tmp_path));
+    unlink(tmp_path);
+    return;
+  }
+  if (rename(tmp_path, path) == -1){
+    WHYF_perror("rename(%s, %s)", alloca_str_toprint(tmp_path), alloca_str_toprint(path));
+    unlink(tmp_path);
+    return;
+  }
+  sync_snapshot_id = sync_journal_id;
+  DEBUGF(rhizome_sync_keys, "Saved %"PRIu64" keys to snapshot, journal %"PRIu64, header.key_count, sync_snapshot_id);
+  
+  // entries up to the snapshot stamp are no longer needed
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  set_sync_journal_stamp(&retry, sync_snapshot_id);
+  sqlite_exec_void_retry(&retry, "DELETE FROM SYNC_JOURNAL WHERE id <= ?;", INT64, sync_snapshot_id, END);
+}
+
+// If the journal has been discarded, changes have been lost and the tree must be rebuilt
+static int journal_discarded()
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  uint64_t stamp;
+  return sync_journal_stamp(&retry, &stamp) == 0;
+}
+
+static void build_tree();
+
+static void update_tree()
+{
+  if (journal_discarded()){
+    DEBUG(rhizome_sync_keys, "Sync journal was discarded, rebuilding tree");
+    sync_free_state(sync_tree);
+    build_tree();
+    return;
+  }
+  apply_journal();
+  if (sync_journal_id - sync_snapshot_id >= SYNC_SNAPSHOT_INTERVAL)
+    save_snapshot();
+}
+
+// Scanning every manifest is slow for huge stores, so we only do it when there is no
+// usable snapshot.
 static void build_tree()
 {
   sync_tree = sync_alloc_state(NULL, sync_peer_has, sync_peer_does_not_have, sync_peer_now_has);
   
+  if (load_snapshot() == 0){
+    apply_journal();
+    return;
+  }
+  
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  // Start journaling before scanning, so no change can be missed.
+  // Any change committed after we read the journal sequence will be applied again, which is harmless
+  if (sync_journal_seq(&retry, &sync_journal_id) == -1)
+    sync_journal_id = 0;
+  set_sync_journal_stamp(&retry, sync_journal_id);
   sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT manifest_hash FROM manifests "
     "WHERE manifests.filehash IS NULL OR EXISTS(SELECT 1 FROM files WHERE files.id = manifests.filehash);");
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
-    const char *hash = (const char *) sqlite3_column_text(statement, 0);
-    rhizome_filehash_t manifest_hash;
-    if (str_to_rhizome_filehash_t(&manifest_hash, hash)==0){
-      sync_key_t key;
-      memcpy(key.key, manifest_hash.binary, sizeof(sync_key_t));
+    sync_key_t key;
+    if (sync_key_from_hash(&key, (const char *) sqlite3_column_text(statement, 0))==0){
       DEBUGF(rhizome_sync_keys, "Adding %s to tree",
 	alloca_sync_key(&key));
       sync_add_key(sync_tree, &key, NULL);
     }
   }
   sqlite3_finalize(statement);
+  
+  apply_journal();
+  save_snapshot();
+}
+
+void rhizome_sync_keys_save()
+{
+  if (!sync_tree || journal_discarded())
+    return;
+  apply_journal();
+  if (sync_journal_id != sync_snapshot_id)
+    save_snapshot();
 }
 
 DEFINE_ALARM(sync_send_keys);
@@ -521,6 +758,8 @@ void sync_send_keys(struct sched_ent *alarm)
 {
   if (!sync_tree)
     build_tree();
+  else
+    update_tree();
   
   uint8_t buff[MDP_MTU];
   size_t len = sync_build_message(sync_tree, buff, sizeof buff);
@@ -884,18 +1123,15 @@ static void sync_neighbour_changed(struct subscriber *neighbour, uint8_t found,
 }
 DEFINE_TRIGGER(nbr_change, sync_neighbour_changed);
 
-static void sync_bundle_add(rhizome_manifest *m)
+static void sync_bundle_add(rhizome_manifest *UNUSED(m))
 {
   if (!sync_tree){
     DEBUG(rhizome_sync_keys, "Ignoring added manifest, tree not built yet");
     return;
   }
   
-  sync_key_t key;
-  memcpy(key.key, m->manifesthash.binary, sizeof(sync_key_t));
-  DEBUGF(rhizome_sync_keys, "Adding %s to tree",
-    alloca_sync_key(&key));
-  sync_add_key(sync_tree, &key, NULL);
+  // the journal also records any older version of this bundle that was replaced
+  update_tree();
   
   if (link_has_neighbours()){
     struct sched_ent *alarm = &ALARM_STRUCT(sync_send_keys);
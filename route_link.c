@@ -58,7 +58,6 @@ struct link{
   struct link *_right;
 
   struct subscriber *transmitter;
-  struct link *parent;
   struct network_destination *destination;
   struct subscriber *receiver;
 
@@ -78,6 +77,14 @@ struct link{
 
   // loop prevention;
   char calculating;
+
+  // the link to our transmitter in the same tree, and the links that are reached through us.
+  // so that a change to one link only needs to recalculate the routes that depend on it.
+  struct link *parent;
+  struct link *_first_child;
+  struct link *_prev_sibling;
+  struct link *_next_sibling;
+  unsigned mark_version;
 };
 
 // statistics of incoming half of network links
@@ -161,6 +168,8 @@ struct link_state{
   // don't use this pointer directly, call find_best_link instead
   struct link *link;
   char calculating;
+  // are we waiting in the route queue?
+  char queued;
 
   // when do we need to send a new link state message.
   time_ms_t next_update;
@@ -174,6 +183,20 @@ struct neighbour *neighbours=NULL;
 unsigned neighbour_count=0;
 int route_version=0;
 
+// subscribers whose route may have changed since we last processed a link state update
+static struct subscriber **route_queue = NULL;
+static unsigned route_queue_len = 0;
+static unsigned route_queue_size = 0;
+static unsigned link_mark_version = 0;
+static unsigned link_state_count = 0;
+
+// route calculation stats
+static uint64_t route_calculations = 0;
+static uint64_t route_invalidations = 0;
+static uint64_t route_updates = 0;
+static uint64_t route_update_calculations = 0;
+static uint64_t route_update_us = 0;
+
 struct network_destination * new_destination(struct overlay_interface *interface){
   assert(interface);
   struct network_destination *ret = emalloc_zero(sizeof(struct network_destination));
@@ -248,6 +271,7 @@ static struct link_state *get_link_state(struct subscriber *subscriber)
   if (!subscriber->link_state){
     subscriber->link_state = emalloc_zero(sizeof(struct link_state));
     subscriber->link_state->route_version = route_version -1;
+    link_state_count++;
   }
   return subscriber->link_state;
 }
@@ -304,6 +328,7 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
         link = *link_ptr = emalloc_zero(sizeof(struct link));
         link->receiver = receiver;
         link->path_version = neighbour->path_version -1;
+        link->mark_version = link_mark_version -1;
 	link->last_ack_seq = -1;
 	link->link_version = -1;
       }
@@ -323,12 +348,41 @@ static struct link *get_parent(struct neighbour *neighbour, struct link *link)
   if (link->receiver == neighbour->subscriber || link->transmitter == NULL)
     return NULL;
 
-  if (!link->parent)
-    link->parent = find_link(neighbour, link->transmitter, 0);
-
   return link->parent;
 }
 
+// move this link under the link to its new transmitter
+static void set_link_transmitter(struct neighbour *neighbour, struct link *link, struct subscriber *transmitter)
+{
+  if (link->parent){
+    if (link->_prev_sibling)
+      link->_prev_sibling->_next_sibling = link->_next_sibling;
+    else
+      link->parent->_first_child = link->_next_sibling;
+    if (link->_next_sibling)
+      link->_next_sibling->_prev_sibling = link->_prev_sibling;
+    link->_prev_sibling = link->_next_sibling = link->parent = NULL;
+  }
+
+  link->transmitter = transmitter;
+
+  if (link->receiver == neighbour->subscriber
+    || transmitter == NULL
+    || transmitter == link->receiver
+    || transmitter == get_my_subscriber(1))
+    return;
+
+  // if we haven't heard how to reach the transmitter yet, add an unreachable link for our children to hang from
+  struct link *parent = find_link(neighbour, transmitter, 1);
+  if (!parent)
+    return;
+  link->parent = parent;
+  link->_next_sibling = parent->_first_child;
+  if (parent->_first_child)
+    parent->_first_child->_prev_sibling = link;
+  parent->_first_child = link;
+}
+
 static void update_path_score(struct neighbour *neighbour, struct link *link){
   if (link->path_version == neighbour->path_version)
     return;
@@ -372,6 +426,61 @@ static void update_path_score(struct neighbour *neighbour, struct link *link){
   link->calculating = 0;
 }
 
+// mark this subscriber's route as dirty, to be recalculated by route_recalculate()
+static void route_queue_add(struct subscriber *subscriber)
+{
+  struct link_state *state = get_link_state(subscriber);
+  state->route_version = route_version -1;
+  if (state->queued)
+    return;
+  if (route_queue_len >= route_queue_size){
+    unsigned size = route_queue_size ? route_queue_size * 2 : 64;
+    struct subscriber **queue = erealloc(route_queue, size * sizeof(struct subscriber *));
+    if (!queue){
+      // we can still fall back to recalculating everything on demand
+      route_version++;
+      return;
+    }
+    route_queue = queue;
+    route_queue_size = size;
+  }
+  route_queue[route_queue_len++] = subscriber;
+  state->queued = 1;
+}
+
+// this link has changed, so has every path score in the tree below it
+static void link_mark_dirty(struct link *link)
+{
+  if (link->mark_version == link_mark_version)
+    return;
+  link->mark_version = link_mark_version;
+  route_queue_add(link->receiver);
+  struct link *child = link->_first_child;
+  while(child){
+    link_mark_dirty(child);
+    child = child->_next_sibling;
+  }
+}
+
+// our route to this transmitter has moved to or from this neighbour,
+// so any path they advertise through the transmitter is now usable or not.
+static void route_queue_children(struct subscriber *next_hop, struct subscriber *transmitter)
+{
+  if (!next_hop)
+    return;
+  struct neighbour *neighbour = get_neighbour(next_hop, 0);
+  if (!neighbour)
+    return;
+  struct link *link = find_link(neighbour, transmitter, 0);
+  if (!link)
+    return;
+  struct link *child = link->_first_child;
+  while(child){
+    route_queue_add(child->receiver);
+    child = child->_next_sibling;
+  }
+}
+
 // pick the best path to this network end point
 static struct link * find_best_link(struct subscriber *subscriber)
 {
@@ -386,7 +495,9 @@ static struct link * find_best_link(struct subscriber *subscriber)
   if (state->calculating)
     RETURN(NULL);
   state->calculating = 1;
+  route_calculations++;
 
+  struct subscriber *old_next_hop = state->next_hop;
   struct neighbour *neighbour = neighbours;
   struct network_destination *destination = NULL;
   int best_hop_count = 99;
@@ -438,6 +549,11 @@ next:
   state->route_version = route_version;
   state->calculating = 0;
   state->link = best_link;
+
+  if (next_hop != old_next_hop){
+    route_queue_children(old_next_hop, subscriber);
+    route_queue_children(next_hop, subscriber);
+  }
   
   if (next_hop == subscriber)
     next_hop = NULL;
@@ -458,6 +574,51 @@ next:
   RETURN(best_link);
 }
 
+static uint64_t route_clock_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// recalculate every route that was marked dirty by a link change.
+// routes that change will queue the routes that depend on them, so we only visit the affected part of the network.
+static void route_recalculate()
+{
+  if (!route_queue_len)
+    return;
+  uint64_t start = route_clock_us();
+  // a route should only need to be recalculated a couple of times for any set of changes,
+  // if we go around more than that, something is flapping and we'll fall back to recalculating on demand.
+  unsigned limit = route_queue_len + 2 * link_state_count;
+  unsigned i;
+  for (i = 0; i < route_queue_len; i++){
+    struct subscriber *subscriber = route_queue[i];
+    subscriber->link_state->queued = 0;
+    if (i < limit)
+      find_best_link(subscriber);
+  }
+  if (i > limit){
+    DEBUGF(linkstate, "LINK STATE; too many route changes, recalculating all routes");
+    route_version++;
+    route_invalidations++;
+    i = limit;
+  }
+  route_updates++;
+  route_update_calculations += i;
+  route_update_us += route_clock_us() - start;
+  route_queue_len = 0;
+}
+
+static void link_show_route_stats()
+{
+  INFOF("routing: %u nodes, %"PRIu64" route calculations, %"PRIu64" full invalidations, "
+    "%"PRIu64" incremental updates recalculating %"PRIu64" routes in %"PRIu64"us",
+    link_state_count, route_calculations, route_invalidations,
+    route_updates, route_update_calculations, route_update_us);
+}
+DEFINE_TRIGGER(show_stats, link_show_route_stats);
+
 static int append_link_state(struct overlay_buffer *payload, char flags, 
                              struct subscriber *transmitter, struct subscriber *receiver, 
                              int interface, int version, int ack_sequence, uint32_t ack_mask, 
@@ -617,8 +778,10 @@ static void clean_neighbours(time_ms_t now)
     struct link_state *state = get_link_state(subscriber);
     if (state->next_hop == subscriber && 
 	(n->link_in_timeout < now || !n->links || !alive) && 
-	state->route_version == route_version)
+	(state->route_version == route_version || state->queued)){
       route_version++;
+      route_invalidations++;
+    }
       
     if (!n->links || !alive){
       free_neighbour(n_ptr);
@@ -740,7 +903,7 @@ int link_destination_has_neighbours(struct network_destination *dest)
 }
 
 static int send_legacy_self_announce_ack(struct neighbour *neighbour, struct link_in *link, time_ms_t now){
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type = OF_TYPE_SELFANNOUNCE_ACK;
   frame->ttl = 6;
   frame->destination = neighbour->subscriber;
@@ -828,7 +991,7 @@ static int send_neighbour_link(struct neighbour *n)
     send_legacy_self_announce_ack(n, n->best_link, now);
     n->last_update = now;
   } else {
-    struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+    struct overlay_frame *frame = op_new();
     frame->type=OF_TYPE_DATA;
     frame->source=get_my_subscriber(1);
     frame->ttl=1;
@@ -934,6 +1097,7 @@ void link_send(struct sched_ent *alarm)
 
   // TODO use a separate alarm?
   link_send_neighbours();
+  route_recalculate();
 
   struct overlay_buffer *payload = ob_new();
   if (!payload){
@@ -1332,6 +1496,7 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
 
   time_ms_t now = gettime_ms();
   char changed = 0;
+  link_mark_version++;
 
   while(ob_remaining(payload)>0){
     struct subscriber *receiver=NULL, *transmitter=NULL;
@@ -1529,18 +1694,20 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
 
     if (link->transmitter != transmitter || link->link_version != version){
       changed = 1;
-      link->transmitter = transmitter;
+      if (link->transmitter != transmitter)
+        set_link_transmitter(neighbour, link, transmitter);
       link->link_version = version & 0xFF;
       link->drop_rate = drop_rate;
       // TODO other link attributes...
+      link_mark_dirty(link);
     }
   }
 
   send_please_explain(&context, myself, header->source);
 
   if (changed){
-    route_version++;
     neighbour->path_version ++;
+    route_recalculate();
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
     }
@@ -1594,7 +1761,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   if (link->transmitter != get_my_subscriber(1))
     changed = 1;
 
-  link->transmitter = get_my_subscriber(1);
+  set_link_transmitter(neighbour, link, get_my_subscriber(1));
   link->link_version = 1;
   link->destination = interface->destination;
 
@@ -1609,8 +1776,10 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   neighbour->link_in_timeout = now + link->destination->ifconfig.reachable_timeout_ms;
 
   if (changed){
-    route_version++;
+    link_mark_version++;
+    link_mark_dirty(link);
     neighbour->path_version ++;
+    route_recalculate();
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
     }
@@ -33,6 +33,7 @@ DECLARE_HANDLER("/static/", static_page);
 DECLARE_HANDLER("/interface/", interface_page);
 DECLARE_HANDLER("/neighbour/", neighbour_page);
 DECLARE_HANDLER("/favicon.ico", fav_icon_header);
+DECLARE_HANDLER("/restful/stats.json", restful_stats_json);
 
 static int root_page(httpd_request *r, const char *remainder)
 {
@@ -79,6 +80,34 @@ static int fav_icon_header(httpd_request *r, const char *remainder)
   return 1;
 }
 
+static int restful_stats_json(httpd_request *r, const char *remainder)
+{
+  r->http.response.header.content_type = CONTENT_TYPE_JSON;
+  int ret = authorize_restful(&r->http);
+  if (ret)
+    return ret;
+  if (*remainder)
+    return 404;
+  if (r->http.verb != HTTP_VERB_GET)
+    return 405;
+  // one row per profiled function, so grow the buffer until they all fit
+  size_t size = 16*1024;
+  while(1){
+    char *buf = emalloc(size);
+    if (!buf)
+      return 500;
+    strbuf b = strbuf_local(buf, size);
+    fd_stats_json(b);
+    if (!strbuf_overrun(b)){
+      http_request_response_static(&r->http, 200, CONTENT_TYPE_JSON, buf, strbuf_len(b));
+      free(buf);
+      return 1;
+    }
+    free(buf);
+    size *= 2;
+  }
+}
+
 static int neighbour_page(httpd_request *r, const char *remainder)
 {
   if (r->http.verb != HTTP_VERB_GET)
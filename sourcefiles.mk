@@ -22,9 +22,11 @@ SERVAL_CLIENT_SOURCES = \
 	log_util.c \
 	mem.c \
 	net.c \
+	nibble_tree.c \
 	numeric_str.c \
 	os.c \
 	performance_timing.c \
+	prefix_index.c \
 	rotbuf.c \
 	sighandlers.c \
 	socket.c \
@@ -89,7 +91,6 @@ SERVAL_DAEMON_SOURCES = \
 	overlay_mdp_dnalookup.c \
 	mdp_filter.c \
 	msp_server.c \
-	nibble_tree.c \
 	network_cli.c \
 	overlay_olsr.c \
 	overlay_packetformats.c \
@@ -379,6 +379,40 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
   }
 }
 
+void sync_remove_key(struct sync_state *state, const sync_key_t *key)
+{
+  key_message_t message = MESSAGE_FROM_KEY(key);
+  if (!find_message(state->root, &message))
+    return;
+  
+  state->key_count--;
+  state->progress=0;
+  remove_key(state, &state->root, key);
+}
+
+unsigned sync_key_count(const struct sync_state *state)
+{
+  return state->key_count;
+}
+
+static void enum_keys(const struct node *node, void (*callback)(void *context, const sync_key_t *key), void *context)
+{
+  if (!node)
+    return;
+  if (node->message.prefix_len == KEY_LEN_BITS){
+    callback(context, &node->message.key);
+    return;
+  }
+  unsigned i;
+  for (i=0;i<NODE_CHILDREN;i++)
+    enum_keys(node->children[i], callback, context);
+}
+
+void sync_enum_keys(const struct sync_state *state, void (*callback)(void *context, const sync_key_t *key), void *context)
+{
+  enum_keys(state->root, callback, context);
+}
+
 void sync_free_peer_state(struct sync_state *state, void *peer_context){
   struct sync_peer_state **peer_state = &state->peers;
   while(*peer_state){
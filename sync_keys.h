@@ -32,7 +32,12 @@ void sync_free_peer_state(struct sync_state *state, void *peer_context);
 // tell the sync process that we now have key, with callback context
 // if the key is already present, the context will be updated
 void sync_add_key(struct sync_state *state, const sync_key_t *key, void *key_context);
+// forget that we have key, eg the bundle has been deleted
+void sync_remove_key(struct sync_state *state, const sync_key_t *key);
 int sync_key_exists(const struct sync_state *state, const sync_key_t *key);
+unsigned sync_key_count(const struct sync_state *state);
+// call back for every key we have, in key order
+void sync_enum_keys(const struct sync_state *state, void (*callback)(void *context, const sync_key_t *key), void *context);
 int sync_has_transmit_queued(const struct sync_state *state);
 
 // ask for a message to be inserted into buff, returns packet length
@@ -33,6 +33,8 @@
 #include "commandline.h"
 #include "mem.h"
 #include "str.h"
+#include "nibble_tree.h"
+#include "prefix_index.h"
 
 DEFINE_FEATURE(cli_tests);
 
@@ -250,6 +252,173 @@ static int app_mem_test(const struct cli_parsed *UNUSED(parsed), struct cli_cont
   return 0;
 }
 
+struct bench_record{
+  unsigned tree_depth;
+  uint8_t binary[SID_SIZE];
+};
+
+struct bench_records{
+  struct bench_record *records;
+  unsigned next;
+};
+
+static void *bench_create(void *context, const uint8_t *binary, size_t bin_length)
+{
+  struct bench_records *r = (struct bench_records *)context;
+  struct bench_record *record = &r->records[r->next++];
+  memcpy(record->binary, binary, bin_length);
+  return record;
+}
+
+static int bench_forget(void **record, void *UNUSED(context))
+{
+  *record = NULL;
+  return 0;
+}
+
+// the same lookup in both structures must give the same answer
+static int bench_compare(struct tree_root *tree, struct bench_records *tree_records,
+  struct prefix_index *index, struct bench_records *index_records, const uint8_t *binary, size_t bin_length)
+{
+  void *tree_result, *index_result;
+  enum tree_error_reason tree_ret = tree_find(tree, &tree_result, binary, bin_length, NULL, NULL);
+  enum tree_error_reason index_ret = prefix_index_find(index, &index_result, binary, bin_length, NULL, NULL);
+  long tree_pos = tree_result ? (struct bench_record *)tree_result - tree_records->records : -1;
+  long index_pos = index_result ? (struct bench_record *)index_result - index_records->records : -1;
+  if (tree_ret != index_ret || tree_pos != index_pos)
+    return WHYF("Lookup of %s differs, tree = %d (record %ld), index = %d (record %ld)",
+      alloca_tohex(binary, bin_length), tree_ret, tree_pos, index_ret, index_pos);
+  return 0;
+}
+
+DEFINE_CMD(app_subscriber_test, 0,
+   "Compare the speed and size of the nibble tree and prefix index, filled with random SIDs",
+   "test","subscribers","[<count>]");
+static int app_subscriber_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_text;
+  if (cli_arg(parsed, "count", &count_text, cli_uint, "50000") == -1)
+    return -1;
+  unsigned count = atoi(count_text);
+  if (count == 0)
+    return WHY("Invalid count");
+
+  uint8_t *sids = emalloc(count * SID_SIZE);
+  unsigned *lengths = emalloc(count * sizeof(unsigned));
+  struct bench_records tree_records = {.records = emalloc_zero(count * sizeof(struct bench_record))};
+  struct bench_records index_records = {.records = emalloc_zero(count * sizeof(struct bench_record))};
+  int ret = -1;
+  if (!sids || !lengths || !tree_records.records || !index_records.records)
+    goto end;
+
+  randombytes_buf(sids, count * SID_SIZE);
+  // Keep the first bytes 0xFE and 0xFF for a few sparse SIDs, so that some short
+  // prefixes have a single match that is not in the first bucket they cover
+  const uint8_t sparse[][2] = {{0xFE, 0x40}, {0xFF, 0x00}, {0xFF, 0xC0}};
+  unsigned i;
+  for (i=0;i<count;i++)
+    sids[i*SID_SIZE] %= 0xFE;
+  for (i=0;i<NELS(sparse) && i<count;i++)
+    memcpy(&sids[(count - 1 - i)*SID_SIZE], sparse[i], sizeof sparse[i]);
+
+  struct tree_root tree = {.binary_length = SID_SIZE};
+  struct prefix_index index = {.binary_length = SID_SIZE};
+  time_ns_t tree_insert, tree_lookup, tree_abbrev, index_insert, index_lookup, index_abbrev;
+  void *result;
+
+  time_ns_t start = gettime_ns();
+  for (i=0;i<count;i++)
+    tree_find(&tree, NULL, &sids[i*SID_SIZE], SID_SIZE, bench_create, &tree_records);
+  tree_insert = gettime_ns() - start;
+
+  start = gettime_ns();
+  for (i=0;i<count;i++)
+    prefix_index_find(&index, NULL, &sids[i*SID_SIZE], SID_SIZE, bench_create, &index_records);
+  index_insert = gettime_ns() - start;
+
+  if (tree_records.next != count || index_records.next != count){
+    WHY("Random SIDs were not unique");
+    goto cleanup;
+  }
+
+  // Both structures must choose the same abbreviation for every subscriber
+  for (i=0;i<count;i++){
+    if (tree_records.records[i].tree_depth != index_records.records[i].tree_depth){
+      WHYF("Depth of %s differs, tree = %u, index = %u", alloca_tohex(&sids[i*SID_SIZE], SID_SIZE),
+	tree_records.records[i].tree_depth, index_records.records[i].tree_depth);
+      goto cleanup;
+    }
+    lengths[i] = (tree_records.records[i].tree_depth >> 3) + 1;
+  }
+
+  start = gettime_ns();
+  for (i=0;i<count;i++)
+    if (tree_find(&tree, &result, &sids[i*SID_SIZE], SID_SIZE, NULL, NULL) != TREE_FOUND
+      || result != &tree_records.records[i]){
+      WHYF("Tree lookup of %s failed", alloca_tohex(&sids[i*SID_SIZE], SID_SIZE));
+      goto cleanup;
+    }
+  tree_lookup = gettime_ns() - start;
+
+  start = gettime_ns();
+  for (i=0;i<count;i++)
+    if (prefix_index_find(&index, &result, &sids[i*SID_SIZE], SID_SIZE, NULL, NULL) != TREE_FOUND
+      || result != &index_records.records[i]){
+      WHYF("Index lookup of %s failed", alloca_tohex(&sids[i*SID_SIZE], SID_SIZE));
+      goto cleanup;
+    }
+  index_lookup = gettime_ns() - start;
+
+  start = gettime_ns();
+  for (i=0;i<count;i++)
+    if (tree_find(&tree, &result, &sids[i*SID_SIZE], lengths[i], NULL, NULL) != TREE_FOUND
+      || result != &tree_records.records[i]){
+      WHYF("Tree lookup of %s failed", alloca_tohex(&sids[i*SID_SIZE], lengths[i]));
+      goto cleanup;
+    }
+  tree_abbrev = gettime_ns() - start;
+
+  start = gettime_ns();
+  for (i=0;i<count;i++)
+    if (prefix_index_find(&index, &result, &sids[i*SID_SIZE], lengths[i], NULL, NULL) != TREE_FOUND
+      || result != &index_records.records[i]){
+      WHYF("Index lookup of %s failed", alloca_tohex(&sids[i*SID_SIZE], lengths[i]));
+      goto cleanup;
+    }
+  index_abbrev = gettime_ns() - start;
+
+  // Prefixes shorter than each abbreviation, including single bytes, which may
+  // be not unique, or found in a bucket after the first one that they cover
+  for (i=0;i<count;i++){
+    size_t len;
+    for (len=1; len<lengths[i]; len++)
+      if (bench_compare(&tree, &tree_records, &index, &index_records, &sids[i*SID_SIZE], len) == -1)
+	goto cleanup;
+  }
+  for (i=0;i<256;i++){
+    uint8_t prefix = i;
+    if (bench_compare(&tree, &tree_records, &index, &index_records, &prefix, 1) == -1)
+      goto cleanup;
+  }
+
+  cli_printf(context, "Benchmarking %u subscribers, mean time per operation:\n", count);
+  cli_printf(context, "nibble tree - insert %.0fns, lookup %.0fns, abbreviated lookup %.0fns, %zu bytes\n",
+    tree_insert * 1.0 / count, tree_lookup * 1.0 / count, tree_abbrev * 1.0 / count, tree_memory(&tree));
+  cli_printf(context, "prefix index - insert %.0fns, lookup %.0fns, abbreviated lookup %.0fns, %zu bytes\n",
+    index_insert * 1.0 / count, index_lookup * 1.0 / count, index_abbrev * 1.0 / count, prefix_index_memory(&index));
+  ret = 0;
+
+cleanup:
+  tree_walk(&tree, NULL, 0, bench_forget, NULL);
+  prefix_index_walk(&index, NULL, 0, bench_forget, NULL);
+end:
+  free(sids);
+  free(lengths);
+  free(tree_records.records);
+  free(index_records.records);
+  return ret;
+}
+
 DEFINE_CMD(app_config_test, 0,
    "Load a test config file and log various fields",
    "config","test","<file>");
@@ -543,9 +543,14 @@ http_unquote_string() {
 
 rhizome_add_bundles() {
    local encrypted=false
-   case "$1" in
-   --encrypted) encrypted=true; shift;;
-   esac
+   local service=
+   while true; do
+      case "$1" in
+      --encrypted) encrypted=true; shift;;
+      --service=*) service="${1#*=}"; shift;;
+      *) break;;
+      esac
+   done
    local SID="${1?}"
    shift
    local n
@@ -555,6 +560,9 @@ rhizome_add_bundles() {
       if $encrypted; then
          echo "crypt=1" >>file$n.manifest
       fi
+      if [ -n "$service" ]; then
+         echo "service=$service" >>file$n.manifest
+      fi
       if $RHIZOME_USE_RESTFUL; then
          executeOk curl \
 	       -H "Expect:" \